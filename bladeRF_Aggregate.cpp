@@ -0,0 +1,785 @@
+/*
+ * This file is part of the bladeRF project:
+ *   http://www.github.com/nuand/bladeRF
+ *
+ * Copyright (C) 2015-2018 Josh Blum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "bladeRF_Aggregate.hpp"
+#include "bladeRF_SoapySDR.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <SoapySDR/Logger.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <climits>
+#include <cmath>
+#include <cstring> //memcpy
+#include <chrono>
+#include <sstream>
+
+//! rx blocks buffered per board before its worker waits for the reader
+#define MAX_AGGREGATE_BLOCKS 16
+
+//! timeout of the worker reads so they notice a deactivation
+#define WORKER_TIMEOUT_US 100000
+
+/*******************************************************************
+ * Device init/shutdown
+ ******************************************************************/
+
+bladeRF_Aggregate::bladeRF_Aggregate(std::vector<std::unique_ptr<SoapySDR::Device>> &&boards):
+    _rxElemSize(0),
+    _txElemSize(0),
+    _rxMTU(0),
+    _txMTU(0),
+    _txInBurst(false),
+    _rxRate(),
+    _rxRunning(false)
+{
+    if (boards.empty()) throw std::runtime_error("bladeRF_Aggregate() requires at least one board");
+
+    for (auto &device : boards)
+    {
+        std::unique_ptr<AggregateBoard> board(new AggregateBoard());
+        board->device = std::move(device);
+        board->rxStream = nullptr;
+        board->txStream = nullptr;
+        board->numRxChans = 0;
+        board->numTxChans = 0;
+        board->offset = 0;
+
+        const size_t index = _boards.size();
+        for (size_t ch = 0; ch < board->device->getNumChannels(SOAPY_SDR_RX); ch++) _rxChanMap.emplace_back(index, ch);
+        for (size_t ch = 0; ch < board->device->getNumChannels(SOAPY_SDR_TX); ch++) _txChanMap.emplace_back(index, ch);
+        _boards.push_back(std::move(board));
+    }
+}
+
+bladeRF_Aggregate::~bladeRF_Aggregate(void)
+{
+    this->_stopRxWorkers();
+    for (auto &board : _boards)
+    {
+        if (board->rxStream != nullptr) board->device->closeStream(board->rxStream);
+        if (board->txStream != nullptr) board->device->closeStream(board->txStream);
+    }
+}
+
+std::pair<size_t, size_t> bladeRF_Aggregate::_locate(const int direction, const size_t channel) const
+{
+    const auto &chanMap = (direction == SOAPY_SDR_RX)?_rxChanMap:_txChanMap;
+    if (channel >= chanMap.size()) throw std::runtime_error("invalid channel " + std::to_string(channel));
+    return chanMap.at(channel);
+}
+
+SoapySDR::Device *bladeRF_Aggregate::_board(const int direction, const size_t channel, size_t &boardChannel) const
+{
+    const auto location = this->_locate(direction, channel);
+    boardChannel = location.second;
+    return _boards.at(location.first)->device.get();
+}
+
+/*******************************************************************
+ * Identification API
+ ******************************************************************/
+
+std::string bladeRF_Aggregate::getHardwareKey(void) const
+{
+    return _boards.front()->device->getHardwareKey();
+}
+
+SoapySDR::Kwargs bladeRF_Aggregate::getHardwareInfo(void) const
+{
+    SoapySDR::Kwargs info;
+    info["boards"] = std::to_string(_boards.size());
+    for (size_t i = 0; i < _boards.size(); i++)
+    {
+        for (const auto &pair : _boards[i]->device->getHardwareInfo())
+        {
+            info["board" + std::to_string(i) + "_" + pair.first] = pair.second;
+        }
+    }
+    return info;
+}
+
+/*******************************************************************
+ * Channels API
+ ******************************************************************/
+
+size_t bladeRF_Aggregate::getNumChannels(const int direction) const
+{
+    return (direction == SOAPY_SDR_RX)?_rxChanMap.size():_txChanMap.size();
+}
+
+bool bladeRF_Aggregate::getFullDuplex(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getFullDuplex(direction, ch);
+}
+
+/*******************************************************************
+ * Stream API
+ ******************************************************************/
+
+std::vector<std::string> bladeRF_Aggregate::getStreamFormats(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getStreamFormats(direction, ch);
+}
+
+std::string bladeRF_Aggregate::getNativeStreamFormat(const int direction, const size_t channel, double &fullScale) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getNativeStreamFormat(direction, ch, fullScale);
+}
+
+SoapySDR::ArgInfoList bladeRF_Aggregate::getStreamArgsInfo(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getStreamArgsInfo(direction, ch);
+}
+
+SoapySDR::Stream *bladeRF_Aggregate::setupStream(
+    const int direction,
+    const std::string &format,
+    const std::vector<size_t> &channels_,
+    const SoapySDR::Kwargs &args)
+{
+    auto channels = channels_;
+    if (channels.empty()) channels.push_back(0);
+    if (direction == SOAPY_SDR_RX) this->_stopRxWorkers();
+
+    //the boards take their channels in ascending order, the buffers are mapped back to the requested order
+    std::vector<std::vector<size_t>> boardChans(_boards.size());
+    for (const auto channel : channels)
+    {
+        const auto location = this->_locate(direction, channel);
+        boardChans[location.first].push_back(location.second);
+    }
+    for (auto &chans : boardChans) std::sort(chans.begin(), chans.end());
+
+    auto &buffMap = (direction == SOAPY_SDR_RX)?_rxBuffMap:_txBuffMap;
+    buffMap.clear();
+    for (const auto channel : channels)
+    {
+        const auto location = this->_locate(direction, channel);
+        const auto &chans = boardChans[location.first];
+        const size_t index = std::find(chans.begin(), chans.end(), location.second) - chans.begin();
+        buffMap.emplace_back(location.first, index);
+    }
+
+    size_t mtu(0);
+    for (size_t i = 0; i < _boards.size(); i++)
+    {
+        AggregateBoard &board = *_boards[i];
+        SoapySDR::Stream *&stream = (direction == SOAPY_SDR_RX)?board.rxStream:board.txStream;
+        ((direction == SOAPY_SDR_RX)?board.numRxChans:board.numTxChans) = boardChans[i].size();
+        if (stream != nullptr) board.device->closeStream(stream);
+        stream = nullptr;
+        if (boardChans[i].empty()) continue;
+
+        stream = board.device->setupStream(direction, format, boardChans[i], args);
+        const size_t boardMTU = board.device->getStreamMTU(stream);
+        mtu = (mtu == 0)?boardMTU:std::min(mtu, boardMTU);
+    }
+
+    if (direction == SOAPY_SDR_RX)
+    {
+        _rxElemSize = SoapySDR::formatToSize(format);
+        _rxMTU = mtu;
+    }
+    if (direction == SOAPY_SDR_TX)
+    {
+        _txElemSize = SoapySDR::formatToSize(format);
+        _txMTU = mtu;
+        _txInBurst = false;
+    }
+
+    return reinterpret_cast<SoapySDR::Stream *>(new int(direction));
+}
+
+void bladeRF_Aggregate::closeStream(SoapySDR::Stream *stream)
+{
+    const int direction = *reinterpret_cast<int *>(stream);
+    if (direction == SOAPY_SDR_RX) this->_stopRxWorkers();
+
+    for (auto &board : _boards)
+    {
+        SoapySDR::Stream *&boardStream = (direction == SOAPY_SDR_RX)?board->rxStream:board->txStream;
+        if (boardStream != nullptr) board->device->closeStream(boardStream);
+        boardStream = nullptr;
+    }
+
+    delete reinterpret_cast<int *>(stream);
+}
+
+size_t bladeRF_Aggregate::getStreamMTU(SoapySDR::Stream *stream) const
+{
+    const int direction = *reinterpret_cast<int *>(stream);
+    return (direction == SOAPY_SDR_RX)?_rxMTU:_txMTU;
+}
+
+int bladeRF_Aggregate::activateStream(
+    SoapySDR::Stream *stream,
+    const int flags,
+    const long long timeNs,
+    const size_t numElems)
+{
+    const int direction = *reinterpret_cast<int *>(stream);
+
+    for (auto &board : _boards)
+    {
+        SoapySDR::Stream *boardStream = (direction == SOAPY_SDR_RX)?board->rxStream:board->txStream;
+        if (boardStream == nullptr) continue;
+        const int ret = board->device->activateStream(boardStream, flags, timeNs, numElems);
+        if (ret != 0) return ret;
+    }
+
+    if (direction == SOAPY_SDR_RX)
+    {
+        this->_stopRxWorkers();
+        this->_updateRxRate();
+        _rxRunning = true;
+        for (auto &board : _boards)
+        {
+            if (board->rxStream == nullptr) continue;
+            board->worker = std::thread(&bladeRF_Aggregate::_rxWorker, this, std::ref(*board));
+        }
+    }
+
+    return 0;
+}
+
+int bladeRF_Aggregate::deactivateStream(
+    SoapySDR::Stream *stream,
+    const int flags,
+    const long long timeNs)
+{
+    const int direction = *reinterpret_cast<int *>(stream);
+    if (direction == SOAPY_SDR_RX) this->_stopRxWorkers();
+
+    int result(0);
+    for (auto &board : _boards)
+    {
+        SoapySDR::Stream *boardStream = (direction == SOAPY_SDR_RX)?board->rxStream:board->txStream;
+        if (boardStream == nullptr) continue;
+        const int ret = board->device->deactivateStream(boardStream, flags, timeNs);
+        if (ret != 0) result = ret;
+    }
+    return result;
+}
+
+void bladeRF_Aggregate::_stopRxWorkers(void)
+{
+    _rxRunning = false;
+    for (auto &board : _boards)
+    {
+        board->cond.notify_all();
+        if (board->worker.joinable()) board->worker.join();
+
+        //samples from before the stop are stale once streaming restarts
+        for (auto &block : board->blocks) board->spares.push_back(std::move(block));
+        board->blocks.clear();
+        board->offset = 0;
+    }
+}
+
+void bladeRF_Aggregate::_updateRxRate(void)
+{
+    //the boards run at one rate, a board without the exact rate gives the micro hertz part of the nominal rate
+    const SoapySDR::Device *device = _boards.front()->device.get();
+    std::istringstream exact(device->readSetting("rx_rational_rate"));
+    if (exact >> _rxRate.integer >> _rxRate.num >> _rxRate.den and _rxRate.den != 0) return;
+    const double rate = device->getSampleRate(SOAPY_SDR_RX, 0);
+    _rxRate.integer = uint64_t(std::floor(rate));
+    _rxRate.num = uint64_t(std::llround((rate - std::floor(rate))*1e6));
+    _rxRate.den = 1000000;
+}
+
+void bladeRF_Aggregate::_rxWorker(AggregateBoard &board)
+{
+    std::vector<void *> buffs(board.numRxChans);
+    while (_rxRunning)
+    {
+        AggregateBlock block;
+        {
+            //hold off while the reader is behind, the board then reports the overflow
+            std::unique_lock<std::mutex> lock(board.mutex);
+            board.cond.wait_for(lock, std::chrono::microseconds(WORKER_TIMEOUT_US), [this, &board](void)
+            {
+                return board.blocks.size() < MAX_AGGREGATE_BLOCKS or not _rxRunning;
+            });
+            if (board.blocks.size() >= MAX_AGGREGATE_BLOCKS) continue;
+            if (not board.spares.empty())
+            {
+                block = std::move(board.spares.back());
+                board.spares.pop_back();
+            }
+        }
+
+        block.buffs.resize(board.numRxChans);
+        for (size_t i = 0; i < board.numRxChans; i++)
+        {
+            block.buffs[i].resize(_rxMTU*_rxElemSize);
+            buffs[i] = block.buffs[i].data();
+        }
+
+        block.flags = 0;
+        block.timeNs = 0;
+        block.ret = board.device->readStream(board.rxStream, buffs.data(), _rxMTU, block.flags, block.timeNs, WORKER_TIMEOUT_US);
+        block.numElems = (block.ret > 0)?size_t(block.ret):0;
+
+        std::lock_guard<std::mutex> lock(board.mutex);
+        if (block.ret == SOAPY_SDR_TIMEOUT or block.ret == 0) board.spares.push_back(std::move(block));
+        else board.blocks.push_back(std::move(block));
+        board.cond.notify_all();
+    }
+}
+
+int bladeRF_Aggregate::readStream(
+    SoapySDR::Stream *,
+    void * const *buffs,
+    const size_t numElems,
+    int &flags,
+    long long &timeNs,
+    const long timeoutUs)
+{
+    const auto exitTime = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+    const auto toTicks = [this](const long long ns)
+    {
+        return bladeRF_SoapySDR::_nsToTicks(ns, _rxRate);
+    };
+
+    flags = 0;
+    timeNs = 0;
+    while (true)
+    {
+        //wait for a block from every streaming board, errors are passed on as they arrive
+        long long alignTicks = LLONG_MIN;
+        for (auto &board : _boards)
+        {
+            if (board->rxStream == nullptr) continue;
+            std::unique_lock<std::mutex> lock(board->mutex);
+            if (not board->cond.wait_until(lock, exitTime, [&board](void){return not board->blocks.empty();}))
+            {
+                return SOAPY_SDR_TIMEOUT;
+            }
+            AggregateBlock &block = board->blocks.front();
+            if (block.ret < 0)
+            {
+                const int ret = block.ret;
+                flags = block.flags;
+                timeNs = block.timeNs;
+                board->spares.push_back(std::move(block));
+                board->blocks.pop_front();
+                board->offset = 0;
+                board->cond.notify_all();
+                return ret;
+            }
+            alignTicks = std::max(alignTicks, toTicks(block.timeNs) + (long long)board->offset);
+        }
+
+        //drop the samples that precede the latest board
+        bool aligned = true;
+        for (auto &board : _boards)
+        {
+            if (board->rxStream == nullptr) continue;
+            std::lock_guard<std::mutex> lock(board->mutex);
+            AggregateBlock &block = board->blocks.front();
+            const long long position = toTicks(block.timeNs) + (long long)board->offset;
+            if (position >= alignTicks) continue;
+            board->offset += std::min<size_t>(size_t(alignTicks - position), block.numElems - board->offset);
+            if (board->offset < block.numElems) continue;
+            board->spares.push_back(std::move(block));
+            board->blocks.pop_front();
+            board->offset = 0;
+            board->cond.notify_all();
+            aligned = false;
+        }
+        if (not aligned) continue;
+
+        //every board is at the same sample, copy what all of them have
+        size_t n = numElems;
+        for (auto &board : _boards)
+        {
+            if (board->rxStream == nullptr) continue;
+            std::lock_guard<std::mutex> lock(board->mutex);
+            n = std::min(n, board->blocks.front().numElems - board->offset);
+        }
+
+        for (size_t i = 0; i < _rxBuffMap.size(); i++)
+        {
+            AggregateBoard &board = *_boards[_rxBuffMap[i].first];
+            std::lock_guard<std::mutex> lock(board.mutex);
+            const AggregateBlock &block = board.blocks.front();
+            std::memcpy(buffs[i], block.buffs[_rxBuffMap[i].second].data() + board.offset*_rxElemSize, n*_rxElemSize);
+        }
+
+        for (auto &board : _boards)
+        {
+            if (board->rxStream == nullptr) continue;
+            std::lock_guard<std::mutex> lock(board->mutex);
+            AggregateBlock &block = board->blocks.front();
+            board->offset += n;
+            if (board->offset < block.numElems) continue;
+            flags |= (block.flags & SOAPY_SDR_END_BURST);
+            board->spares.push_back(std::move(block));
+            board->blocks.pop_front();
+            board->offset = 0;
+            board->cond.notify_all();
+        }
+
+        flags |= SOAPY_SDR_HAS_TIME;
+        timeNs = bladeRF_SoapySDR::_ticksToNs(alignTicks, _rxRate);
+        return int(n);
+    }
+}
+
+int bladeRF_Aggregate::writeStream(
+    SoapySDR::Stream *,
+    const void * const *buffs,
+    const size_t numElems,
+    int &flags,
+    const long long timeNs,
+    const long timeoutUs)
+{
+    //the boards are written one after the other, only a timed burst start lines them up
+    const size_t numTxBoards = std::count_if(_boards.begin(), _boards.end(), [](const std::unique_ptr<AggregateBoard> &b){return b->txStream != nullptr;});
+    if (numTxBoards > 1 and not _txInBurst and (flags & SOAPY_SDR_HAS_TIME) == 0)
+    {
+        SoapySDR::log(SOAPY_SDR_ERROR, "bladeRF_Aggregate::writeStream() a burst on several boards must start with a time");
+        return SOAPY_SDR_NOT_SUPPORTED;
+    }
+
+    //each board transmits the whole buffer, the burst end goes with its last chunk
+    bool written(false);
+    for (size_t i = 0; i < _boards.size(); i++)
+    {
+        AggregateBoard &board = *_boards[i];
+        if (board.txStream == nullptr) continue;
+
+        std::vector<const char *> boardBuffs(board.numTxChans);
+        for (size_t j = 0; j < _txBuffMap.size(); j++)
+        {
+            if (_txBuffMap[j].first == i) boardBuffs[_txBuffMap[j].second] = (const char *)buffs[j];
+        }
+
+        size_t done(0);
+        while (done < numElems)
+        {
+            std::vector<const void *> ptrs;
+            for (const auto buff : boardBuffs) ptrs.push_back(buff + done*_txElemSize);
+
+            int boardFlags = flags;
+            if (done != 0) boardFlags &= ~SOAPY_SDR_HAS_TIME;
+            if (numElems - done > _txMTU) boardFlags &= ~SOAPY_SDR_END_BURST;
+            const size_t chunk = std::min(numElems - done, _txMTU);
+            int ret = board.device->writeStream(board.txStream, ptrs.data(), chunk, boardFlags, timeNs, timeoutUs);
+            if (ret == 0) ret = SOAPY_SDR_TIMEOUT;
+
+            //nothing sent yet, the caller can retry the same buffer
+            if (ret < 0 and not written) return ret;
+
+            //the other boards already took part of the buffer, they are no longer in step
+            if (ret < 0)
+            {
+                SoapySDR::logf(SOAPY_SDR_ERROR, "bladeRF_Aggregate::writeStream() board %d returned %d after other boards sent the buffer", int(i), ret);
+                _txInBurst = false;
+                return SOAPY_SDR_STREAM_ERROR;
+            }
+            done += size_t(ret);
+            written = true;
+        }
+    }
+    _txInBurst = (flags & SOAPY_SDR_END_BURST) == 0;
+    return int(numElems);
+}
+
+int bladeRF_Aggregate::readStreamStatus(
+    SoapySDR::Stream *,
+    size_t &chanMask,
+    int &flags,
+    long long &timeNs,
+    const long timeoutUs)
+{
+    //poll the boards until one of them has an event
+    const auto exitTime = std::chrono::high_resolution_clock::now() + std::chrono::microseconds(timeoutUs);
+    while (true)
+    {
+        for (auto &board : _boards)
+        {
+            if (board->txStream == nullptr) continue;
+            const int ret = board->device->readStreamStatus(board->txStream, chanMask, flags, timeNs, 0);
+            if (ret != SOAPY_SDR_TIMEOUT) return ret;
+        }
+        if (std::chrono::high_resolution_clock::now() > exitTime) return SOAPY_SDR_TIMEOUT;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/*******************************************************************
+ * Antenna API
+ ******************************************************************/
+
+std::vector<std::string> bladeRF_Aggregate::listAntennas(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->listAntennas(direction, ch);
+}
+
+void bladeRF_Aggregate::setAntenna(const int direction, const size_t channel, const std::string &name)
+{
+    size_t ch(0);
+    this->_board(direction, channel, ch)->setAntenna(direction, ch, name);
+}
+
+std::string bladeRF_Aggregate::getAntenna(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getAntenna(direction, ch);
+}
+
+/*******************************************************************
+ * Gain API
+ ******************************************************************/
+
+bool bladeRF_Aggregate::hasGainMode(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->hasGainMode(direction, ch);
+}
+
+void bladeRF_Aggregate::setGainMode(const int direction, const size_t channel, const bool automatic)
+{
+    size_t ch(0);
+    this->_board(direction, channel, ch)->setGainMode(direction, ch, automatic);
+}
+
+bool bladeRF_Aggregate::getGainMode(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getGainMode(direction, ch);
+}
+
+std::vector<std::string> bladeRF_Aggregate::listGains(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->listGains(direction, ch);
+}
+
+void bladeRF_Aggregate::setGain(const int direction, const size_t channel, const double value)
+{
+    size_t ch(0);
+    this->_board(direction, channel, ch)->setGain(direction, ch, value);
+}
+
+void bladeRF_Aggregate::setGain(const int direction, const size_t channel, const std::string &name, const double value)
+{
+    size_t ch(0);
+    this->_board(direction, channel, ch)->setGain(direction, ch, name, value);
+}
+
+double bladeRF_Aggregate::getGain(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getGain(direction, ch);
+}
+
+double bladeRF_Aggregate::getGain(const int direction, const size_t channel, const std::string &name) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getGain(direction, ch, name);
+}
+
+SoapySDR::Range bladeRF_Aggregate::getGainRange(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getGainRange(direction, ch);
+}
+
+SoapySDR::Range bladeRF_Aggregate::getGainRange(const int direction, const size_t channel, const std::string &name) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getGainRange(direction, ch, name);
+}
+
+/*******************************************************************
+ * Frequency API
+ ******************************************************************/
+
+void bladeRF_Aggregate::setFrequency(const int direction, const size_t channel, const std::string &name, const double frequency, const SoapySDR::Kwargs &args)
+{
+    size_t ch(0);
+    this->_board(direction, channel, ch)->setFrequency(direction, ch, name, frequency, args);
+}
+
+double bladeRF_Aggregate::getFrequency(const int direction, const size_t channel, const std::string &name) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getFrequency(direction, ch, name);
+}
+
+std::vector<std::string> bladeRF_Aggregate::listFrequencies(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->listFrequencies(direction, ch);
+}
+
+SoapySDR::RangeList bladeRF_Aggregate::getFrequencyRange(const int direction, const size_t channel, const std::string &name) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getFrequencyRange(direction, ch, name);
+}
+
+/*******************************************************************
+ * Sample Rate API
+ ******************************************************************/
+
+void bladeRF_Aggregate::setSampleRate(const int direction, const size_t channel, const double rate)
+{
+    this->_locate(direction, channel); //validate
+    for (auto &board : _boards) board->device->setSampleRate(direction, 0, rate);
+    if (direction == SOAPY_SDR_RX) this->_updateRxRate();
+}
+
+double bladeRF_Aggregate::getSampleRate(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getSampleRate(direction, ch);
+}
+
+SoapySDR::RangeList bladeRF_Aggregate::getSampleRateRange(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getSampleRateRange(direction, ch);
+}
+
+/*******************************************************************
+ * Bandwidth API
+ ******************************************************************/
+
+void bladeRF_Aggregate::setBandwidth(const int direction, const size_t channel, const double bw)
+{
+    size_t ch(0);
+    this->_board(direction, channel, ch)->setBandwidth(direction, ch, bw);
+}
+
+double bladeRF_Aggregate::getBandwidth(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getBandwidth(direction, ch);
+}
+
+SoapySDR::RangeList bladeRF_Aggregate::getBandwidthRange(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    return this->_board(direction, channel, ch)->getBandwidthRange(direction, ch);
+}
+
+/*******************************************************************
+ * Clocking API
+ ******************************************************************/
+
+std::vector<std::string> bladeRF_Aggregate::listClockSources(void) const
+{
+    return _boards.front()->device->listClockSources();
+}
+
+void bladeRF_Aggregate::setClockSource(const std::string &source)
+{
+    for (auto &board : _boards) board->device->setClockSource(source);
+}
+
+std::string bladeRF_Aggregate::getClockSource(void) const
+{
+    return _boards.front()->device->getClockSource();
+}
+
+/*******************************************************************
+ * Time API
+ ******************************************************************/
+
+bool bladeRF_Aggregate::hasHardwareTime(const std::string &what) const
+{
+    return _boards.front()->device->hasHardwareTime(what);
+}
+
+long long bladeRF_Aggregate::getHardwareTime(const std::string &what) const
+{
+    return _boards.front()->device->getHardwareTime(what);
+}
+
+void bladeRF_Aggregate::setHardwareTime(const long long timeNs, const std::string &what)
+{
+    //the boards are set one after the other, use the trigger settings for a common edge
+    for (auto &board : _boards) board->device->setHardwareTime(timeNs, what);
+}
+
+void bladeRF_Aggregate::setCommandTime(const long long timeNs, const std::string &what)
+{
+    for (auto &board : _boards) board->device->setCommandTime(timeNs, what);
+}
+
+/*******************************************************************
+ * Settings API
+ ******************************************************************/
+
+SoapySDR::ArgInfoList bladeRF_Aggregate::getSettingInfo(void) const
+{
+    return _boards.front()->device->getSettingInfo();
+}
+
+void bladeRF_Aggregate::writeSetting(const std::string &key, const std::string &value)
+{
+    for (auto &board : _boards) board->device->writeSetting(key, value);
+}
+
+std::string bladeRF_Aggregate::readSetting(const std::string &key) const
+{
+    return _boards.front()->device->readSetting(key);
+}
+
+SoapySDR::ArgInfoList bladeRF_Aggregate::getSettingInfo(const int direction, const size_t channel) const
+{
+    size_t ch(0);
+    SoapySDR::ArgInfoList info = this->_board(direction, channel, ch)->getSettingInfo(direction, ch);
+    //board settings are reachable through any channel of the board
+    for (const auto &arg : this->_board(direction, channel, ch)->getSettingInfo()) info.push_back(arg);
+    return info;
+}
+
+void bladeRF_Aggregate::writeSetting(const int direction, const size_t channel, const std::string &key, const std::string &value)
+{
+    size_t ch(0);
+    SoapySDR::Device *board = this->_board(direction, channel, ch);
+    for (const auto &arg : board->getSettingInfo())
+    {
+        if (arg.key == key) return board->writeSetting(key, value);
+    }
+    board->writeSetting(direction, ch, key, value);
+}
+
+std::string bladeRF_Aggregate::readSetting(const int direction, const size_t channel, const std::string &key) const
+{
+    size_t ch(0);
+    SoapySDR::Device *board = this->_board(direction, channel, ch);
+    for (const auto &arg : board->getSettingInfo())
+    {
+        if (arg.key == key) return board->readSetting(key);
+    }
+    return board->readSetting(direction, ch, key);
+}
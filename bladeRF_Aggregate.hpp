@@ -0,0 +1,295 @@
+/*
+ * This file is part of the bladeRF project:
+ *   http://www.github.com/nuand/bladeRF
+ *
+ * Copyright (C) 2015-2018 Josh Blum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <SoapySDR/Device.hpp>
+#include <libbladeRF.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <utility>
+
+/*!
+ * A block of rx samples read by a board worker, one buffer per channel
+ */
+struct AggregateBlock
+{
+    int ret;
+    int flags;
+    long long timeNs;
+    size_t numElems;
+    std::vector<std::vector<char>> buffs;
+};
+
+/*!
+ * One board of an aggregate device and its rx worker state
+ */
+struct AggregateBoard
+{
+    std::unique_ptr<SoapySDR::Device> device;
+    SoapySDR::Stream *rxStream;
+    SoapySDR::Stream *txStream;
+    size_t numRxChans; //channels of this board in the rx stream
+    size_t numTxChans; //channels of this board in the tx stream
+
+    //filled by the worker, consumed by readStream()
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<AggregateBlock> blocks;
+    std::vector<AggregateBlock> spares;
+    size_t offset; //samples already consumed from the front block
+};
+
+/*!
+ * Several blade RF boards exposed as one device.
+ * Channels are numbered board by board, e.g. two bladeRF2 give rx channels 0-3.
+ * Each board streams rx in its own thread and readStream() returns the
+ * channels of all boards aligned on the hardware time, so the boards
+ * must share a time base (see the trigger_* settings).
+ * writeStream() sends the buffer to the boards one after the other,
+ * so a tx burst on several boards must start with a time to be aligned.
+ */
+class bladeRF_Aggregate : public SoapySDR::Device
+{
+public:
+
+    //! takes ownership of the boards, channels are numbered in this order
+    bladeRF_Aggregate(std::vector<std::unique_ptr<SoapySDR::Device>> &&boards);
+
+    //! destructor stops streaming and closes the boards
+    ~bladeRF_Aggregate(void);
+
+    /*******************************************************************
+     * Identification API
+     ******************************************************************/
+
+    std::string getDriverKey(void) const
+    {
+        return "bladeRF_array";
+    }
+
+    std::string getHardwareKey(void) const;
+
+    SoapySDR::Kwargs getHardwareInfo(void) const;
+
+    /*******************************************************************
+     * Channels API
+     ******************************************************************/
+
+    size_t getNumChannels(const int) const;
+
+    bool getFullDuplex(const int, const size_t) const;
+
+    /*******************************************************************
+     * Stream API
+     ******************************************************************/
+
+    std::vector<std::string> getStreamFormats(const int direction, const size_t channel) const;
+
+    std::string getNativeStreamFormat(const int direction, const size_t channel, double &fullScale) const;
+
+    SoapySDR::ArgInfoList getStreamArgsInfo(const int direction, const size_t channel) const;
+
+    SoapySDR::Stream *setupStream(
+        const int direction,
+        const std::string &format,
+        const std::vector<size_t> &channels = std::vector<size_t>(),
+        const SoapySDR::Kwargs &args = SoapySDR::Kwargs());
+
+    void closeStream(SoapySDR::Stream *stream);
+
+    size_t getStreamMTU(SoapySDR::Stream *stream) const;
+
+    int activateStream(
+        SoapySDR::Stream *stream,
+        const int flags = 0,
+        const long long timeNs = 0,
+        const size_t numElems = 0);
+
+    int deactivateStream(
+        SoapySDR::Stream *stream,
+        const int flags = 0,
+        const long long timeNs = 0);
+
+    int readStream(
+        SoapySDR::Stream *stream,
+        void * const *buffs,
+        const size_t numElems,
+        int &flags,
+        long long &timeNs,
+        const long timeoutUs = 100000);
+
+    int writeStream(
+        SoapySDR::Stream *stream,
+        const void * const *buffs,
+        const size_t numElems,
+        int &flags,
+        const long long timeNs = 0,
+        const long timeoutUs = 100000);
+
+    int readStreamStatus(
+        SoapySDR::Stream *stream,
+        size_t &chanMask,
+        int &flags,
+        long long &timeNs,
+        const long timeoutUs = 100000);
+
+    /*******************************************************************
+     * Antenna API
+     ******************************************************************/
+
+    std::vector<std::string> listAntennas(const int direction, const size_t channel) const;
+
+    void setAntenna(const int direction, const size_t channel, const std::string &name);
+
+    std::string getAntenna(const int direction, const size_t channel) const;
+
+    /*******************************************************************
+     * Gain API
+     ******************************************************************/
+
+    bool hasGainMode(const int direction, const size_t channel) const;
+
+    void setGainMode(const int direction, const size_t channel, const bool automatic);
+
+    bool getGainMode(const int direction, const size_t channel) const;
+
+    std::vector<std::string> listGains(const int direction, const size_t channel) const;
+
+    void setGain(const int direction, const size_t channel, const double value);
+
+    void setGain(const int direction, const size_t channel, const std::string &name, const double value);
+
+    double getGain(const int direction, const size_t channel) const;
+
+    double getGain(const int direction, const size_t channel, const std::string &name) const;
+
+    SoapySDR::Range getGainRange(const int direction, const size_t channel) const;
+
+    SoapySDR::Range getGainRange(const int direction, const size_t channel, const std::string &name) const;
+
+    /*******************************************************************
+     * Frequency API
+     ******************************************************************/
+
+    void setFrequency(const int direction, const size_t channel, const std::string &name, const double frequency, const SoapySDR::Kwargs &args = SoapySDR::Kwargs());
+
+    double getFrequency(const int direction, const size_t channel, const std::string &name) const;
+
+    std::vector<std::string> listFrequencies(const int direction, const size_t channel) const;
+
+    SoapySDR::RangeList getFrequencyRange(const int direction, const size_t channel, const std::string &name) const;
+
+    /*******************************************************************
+     * Sample Rate API
+     ******************************************************************/
+
+    //! all boards stream at one rate, setting it on any channel sets every board
+    void setSampleRate(const int direction, const size_t channel, const double rate);
+
+    double getSampleRate(const int direction, const size_t channel) const;
+
+    SoapySDR::RangeList getSampleRateRange(const int direction, const size_t channel) const;
+
+    /*******************************************************************
+     * Bandwidth API
+     ******************************************************************/
+
+    void setBandwidth(const int direction, const size_t channel, const double bw);
+
+    double getBandwidth(const int direction, const size_t channel) const;
+
+    SoapySDR::RangeList getBandwidthRange(const int direction, const size_t channel) const;
+
+    /*******************************************************************
+     * Clocking API
+     ******************************************************************/
+
+    std::vector<std::string> listClockSources(void) const;
+
+    void setClockSource(const std::string &source);
+
+    std::string getClockSource(void) const;
+
+    /*******************************************************************
+     * Time API
+     ******************************************************************/
+
+    bool hasHardwareTime(const std::string &what = "") const;
+
+    long long getHardwareTime(const std::string &what = "") const;
+
+    void setHardwareTime(const long long timeNs, const std::string &what = "");
+
+    void setCommandTime(const long long timeNs, const std::string &what = "");
+
+    /*******************************************************************
+     * Settings API
+     ******************************************************************/
+
+    //! device settings are written to every board and read from the first one
+    SoapySDR::ArgInfoList getSettingInfo(void) const;
+
+    void writeSetting(const std::string &key, const std::string &value);
+
+    std::string readSetting(const std::string &key) const;
+
+    //! channel settings go to the board owning the channel, e.g. trigger_role per board
+    SoapySDR::ArgInfoList getSettingInfo(const int direction, const size_t channel) const;
+
+    void writeSetting(const int direction, const size_t channel, const std::string &key, const std::string &value);
+
+    std::string readSetting(const int direction, const size_t channel, const std::string &key) const;
+
+private:
+
+    //! board index and board channel of an aggregate channel
+    std::pair<size_t, size_t> _locate(const int direction, const size_t channel) const;
+    SoapySDR::Device *_board(const int direction, const size_t channel, size_t &boardChannel) const;
+
+    //! exact rx rate of the boards, timestamps are aligned in ticks of this rate
+    void _updateRxRate(void);
+
+    void _rxWorker(AggregateBoard &board);
+    void _stopRxWorkers(void);
+
+    std::vector<std::unique_ptr<AggregateBoard>> _boards;
+    std::vector<std::pair<size_t, size_t>> _rxChanMap;
+    std::vector<std::pair<size_t, size_t>> _txChanMap;
+
+    //stream buffer index to (board index, buffer index of that board's stream)
+    std::vector<std::pair<size_t, size_t>> _rxBuffMap;
+    std::vector<std::pair<size_t, size_t>> _txBuffMap;
+
+    size_t _rxElemSize;
+    size_t _txElemSize;
+    size_t _rxMTU;
+    size_t _txMTU;
+    bool _txInBurst; //the next write continues a burst started with a time
+    bladerf_rational_rate _rxRate;
+    std::atomic<bool> _rxRunning;
+};
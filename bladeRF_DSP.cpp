@@ -0,0 +1,1361 @@
+/*
+ * This file is part of the bladeRF project:
+ *   http://www.github.com/nuand/bladeRF
+ *
+ * Copyright (C) 2015-2022 Josh Blum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "bladeRF_DSP.hpp"
+#include <algorithm> //copy, fill, swap
+#include <cmath>
+#include <chrono>
+#include <cstdlib> //llabs
+
+//! time constant of the correction tracking in samples
+#define CORRECTION_TAU 100000.0
+
+//! samples between recomputing the NCO rotators from the exact phase
+#define NCO_RESYNC 4096
+
+//! floats summed in parallel by the filter dot products
+#define DOT_LANES 16
+
+//! taps of the decimation filters per output phase
+#define DDC_TAPS_PER_PHASE 16
+
+//! Kaiser window beta of the designed filters, about 70 dB of stop band
+#define KAISER_BETA 7.0
+
+/*******************************************************************
+ * Filter helpers
+ ******************************************************************/
+
+void convertCS16(const int16_t *in, const size_t stride, std::complex<float> *out, const size_t n)
+{
+    float *o = reinterpret_cast<float *>(out);
+    for (size_t k = 0; k < n; k++)
+    {
+        o[2*k+0] = float(in[2*k*stride+0])/2048;
+        o[2*k+1] = float(in[2*k*stride+1])/2048;
+    }
+}
+
+//! full scale float to int16, saturating instead of wrapping around
+static inline int16_t toCS16(const float x)
+{
+    return int16_t(std::max(-2048.0f, std::min(2047.0f, x*2048)));
+}
+
+void convertCF32(const std::complex<float> *in, int16_t *out, const size_t stride, const size_t n)
+{
+    const float *i = reinterpret_cast<const float *>(in);
+    for (size_t k = 0; k < n; k++)
+    {
+        out[2*k*stride+0] = toCS16(i[2*k+0]);
+        out[2*k*stride+1] = toCS16(i[2*k+1]);
+    }
+}
+
+//! zeroth order modified bessel function of the first kind
+static double besselI0(const double x)
+{
+    double sum(1.0), term(1.0);
+    for (int k = 1; k < 50 and term > 1e-12*sum; k++)
+    {
+        const double half = x/(2*k);
+        term *= half*half;
+        sum += term;
+    }
+    return sum;
+}
+
+std::vector<float> designLowpass(const size_t numTaps, const double cutoff, const double gain)
+{
+    std::vector<double> taps(numTaps);
+    const double mid = (numTaps - 1)/2.0;
+    double sum(0.0);
+    for (size_t n = 0; n < numTaps; n++)
+    {
+        const double x = n - mid;
+        const double sinc = (x == 0.0)?2*cutoff:std::sin(2*M_PI*cutoff*x)/(M_PI*x);
+        const double r = (mid == 0.0)?0.0:x/mid;
+        taps[n] = sinc*besselI0(KAISER_BETA*std::sqrt(std::max(0.0, 1.0 - r*r)))/besselI0(KAISER_BETA);
+        sum += taps[n];
+    }
+
+    std::vector<float> out(numTaps);
+    for (size_t n = 0; n < numTaps; n++) out[n] = float(taps[n]*gain/sum);
+    return out;
+}
+
+/*!
+ * Dot product of I/Q pairs with real taps, both as interleaved floats.
+ * The length is a multiple of DOT_LANES, the partial sums let the loop vectorize.
+ */
+static inline std::complex<float> dotTaps(const float *taps, const float *x, const size_t len)
+{
+    float acc[DOT_LANES] = {};
+    for (size_t k = 0; k < len; k += DOT_LANES)
+    {
+        for (size_t l = 0; l < DOT_LANES; l++) acc[l] += taps[k+l]*x[k+l];
+    }
+    float i(0), q(0);
+    for (size_t l = 0; l < DOT_LANES; l += 2)
+    {
+        i += acc[l];
+        q += acc[l+1];
+    }
+    return std::complex<float>(i, q);
+}
+
+/*******************************************************************
+ * IQ correction
+ ******************************************************************/
+
+IQCorrector::IQCorrector(const bool correctIQ):
+    _correctIQ(correctIQ),
+    _dc(0.0f, 0.0f),
+    _w(0.0f, 0.0f),
+    _square(0.0, 0.0),
+    _power(0.0)
+{
+    return;
+}
+
+void IQCorrector::convert(const int16_t *in, const size_t stride, std::complex<float> *out, const size_t n)
+{
+    if (n == 0) return;
+
+    const float scale = 1.0f/2048;
+    const float dcI = _dc.real(), dcQ = _dc.imag();
+    const float wI = _w.real(), wQ = _w.imag();
+
+    //sums of the raw samples and of the dc free samples for the next estimates
+    float sumI(0), sumQ(0), sumII(0), sumQQ(0), sumIQ(0);
+    float *o = reinterpret_cast<float *>(out);
+    for (size_t k = 0; k < n; k++)
+    {
+        const float i = in[2*k*stride]*scale;
+        const float q = in[2*k*stride+1]*scale;
+        sumI += i;
+        sumQ += q;
+        const float yi = i - dcI;
+        const float yq = q - dcQ;
+        sumII += yi*yi;
+        sumQQ += yq*yq;
+        sumIQ += yi*yq;
+        //z = y + w*conj(y)
+        o[2*k+0] = yi + wI*yi + wQ*yq;
+        o[2*k+1] = yq + wQ*yi - wI*yq;
+    }
+
+    //blend this buffer into the tracked statistics
+    const double alpha = 1.0 - std::exp(-double(n)/CORRECTION_TAU);
+    const std::complex<double> mean(sumI/n, sumQ/n);
+    const std::complex<double> square((sumII - sumQQ)/n, 2*sumIQ/n);
+    const double power = (sumII + sumQQ)/n;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _dc += std::complex<float>(alpha*(mean - std::complex<double>(_dc)));
+    if (not _correctIQ) return;
+    _square += alpha*(square - _square);
+    _power += alpha*(power - _power);
+
+    //for y = a*x + b*conj(x) with a proper x, E[y^2]/(2*E[|y|^2]) ~= b/a
+    if (_power > 0.0) _w = std::complex<float>(-_square/(2*_power));
+}
+
+std::complex<double> IQCorrector::dcOffset(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return std::complex<double>(_dc);
+}
+
+std::complex<double> IQCorrector::imbalance(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return -std::complex<double>(_w);
+}
+
+/*******************************************************************
+ * NCO
+ ******************************************************************/
+
+NCO::NCO(const double freq):
+    _freq(freq - std::floor(freq)),
+    _phase(0.0),
+    _stepI(1.0f),
+    _stepQ(0.0f)
+{
+    return;
+}
+
+void NCO::reset(void)
+{
+    _phase = 0.0;
+}
+
+template <typename Input, typename Output>
+void NCO::_mix(const Input &input, const Output &output, const size_t n)
+{
+    const double step = 2*M_PI*_freq*LANES;
+    _stepI = float(std::cos(step));
+    _stepQ = float(std::sin(step));
+
+    for (size_t start = 0; start < n; start += NCO_RESYNC)
+    {
+        const size_t len = std::min<size_t>(NCO_RESYNC, n - start);
+        for (size_t l = 0; l < LANES; l++)
+        {
+            const double phase = 2*M_PI*(_phase + _freq*l);
+            _rotI[l] = float(std::cos(phase));
+            _rotQ[l] = float(std::sin(phase));
+        }
+
+        for (size_t k = start; k < start + len; k += LANES)
+        {
+            const size_t lanes = std::min<size_t>(LANES, start + len - k);
+            for (size_t l = 0; l < lanes; l++)
+            {
+                float i, q;
+                input(k+l, i, q);
+                output(k+l, i*_rotI[l] - q*_rotQ[l], i*_rotQ[l] + q*_rotI[l]);
+            }
+            for (size_t l = 0; l < LANES; l++)
+            {
+                const float rotI = _rotI[l]*_stepI - _rotQ[l]*_stepQ;
+                _rotQ[l] = _rotI[l]*_stepQ + _rotQ[l]*_stepI;
+                _rotI[l] = rotI;
+            }
+        }
+
+        _phase += _freq*len;
+        _phase -= std::floor(_phase);
+    }
+}
+
+void NCO::mix(const int16_t *in, const size_t stride, std::complex<float> *out, const size_t n)
+{
+    float *o = reinterpret_cast<float *>(out);
+    this->_mix([in, stride](const size_t k, float &i, float &q)
+    {
+        i = float(in[2*k*stride+0])/2048;
+        q = float(in[2*k*stride+1])/2048;
+    }, [o](const size_t k, const float i, const float q)
+    {
+        o[2*k+0] = i;
+        o[2*k+1] = q;
+    }, n);
+}
+
+void NCO::mix(std::complex<float> *inout, const size_t n)
+{
+    float *io = reinterpret_cast<float *>(inout);
+    this->_mix([io](const size_t k, float &i, float &q)
+    {
+        i = io[2*k+0];
+        q = io[2*k+1];
+    }, [io](const size_t k, const float i, const float q)
+    {
+        io[2*k+0] = i;
+        io[2*k+1] = q;
+    }, n);
+}
+
+void NCO::mix(const std::complex<float> *in, int16_t *out, const size_t stride, const size_t n)
+{
+    const float *f = reinterpret_cast<const float *>(in);
+    this->_mix([f](const size_t k, float &i, float &q)
+    {
+        i = f[2*k+0];
+        q = f[2*k+1];
+    }, [out, stride](const size_t k, const float i, const float q)
+    {
+        out[2*k*stride+0] = toCS16(i);
+        out[2*k*stride+1] = toCS16(q);
+    }, n);
+}
+
+/*******************************************************************
+ * Decimating FIR
+ ******************************************************************/
+
+FirDecimator::FirDecimator(const std::vector<float> &taps, const size_t decim):
+    _decim(decim),
+    _numTaps(taps.size()),
+    _skip(0)
+{
+    //pad to whole dot product lanes, the padding multiplies samples past the window by 0
+    const size_t padded = ((2*_numTaps + DOT_LANES - 1)/DOT_LANES)*DOT_LANES;
+    _taps.resize(padded, 0.0f);
+    for (size_t m = 0; m < _numTaps; m++)
+    {
+        _taps[2*m+0] = _taps[2*m+1] = taps[_numTaps-1-m];
+    }
+    this->reset();
+}
+
+void FirDecimator::reset(void)
+{
+    _work.assign(_numTaps - 1 + _taps.size()/2, std::complex<float>());
+    _skip = 0;
+}
+
+std::complex<float> *FirDecimator::input(const size_t n)
+{
+    const size_t size = _numTaps - 1 + n + _taps.size()/2;
+    if (_work.size() < size) _work.resize(size);
+    return _work.data() + _numTaps - 1;
+}
+
+size_t FirDecimator::filter(const size_t n, std::complex<float> *out)
+{
+    //the window of the output at block index j starts at work index j
+    const float *work = reinterpret_cast<const float *>(_work.data());
+    size_t numOut(0), j(_skip);
+    for (; j < n; j += _decim)
+    {
+        out[numOut++] = dotTaps(_taps.data(), work + 2*j, _taps.size());
+    }
+    _skip = j - n;
+
+    //keep the last samples as the history of the next block
+    std::copy(_work.begin() + n, _work.begin() + n + _numTaps - 1, _work.begin());
+    return numOut;
+}
+
+/*******************************************************************
+ * Interpolating FIR
+ ******************************************************************/
+
+FirInterpolator::FirInterpolator(const std::vector<float> &taps, const size_t interp):
+    _interp(interp),
+    _numTaps(taps.size())
+{
+    //phase p filters with the taps p, p+interp, p+2*interp... reversed like FirDecimator
+    _phaseLen = (_numTaps + _interp - 1)/_interp;
+    _phaseStride = ((2*_phaseLen + DOT_LANES - 1)/DOT_LANES)*DOT_LANES;
+    _taps.resize(_phaseStride*_interp, 0.0f);
+    for (size_t p = 0; p < _interp; p++)
+    {
+        for (size_t k = 0; k < _phaseLen; k++)
+        {
+            const size_t n = p + k*_interp;
+            const size_t m = _phaseLen-1-k;
+            if (n < _numTaps) _taps[p*_phaseStride + 2*m+0] = _taps[p*_phaseStride + 2*m+1] = taps[n];
+        }
+    }
+    this->reset();
+}
+
+void FirInterpolator::reset(void)
+{
+    _work.assign(_phaseLen - 1 + _phaseStride/2, std::complex<float>());
+}
+
+size_t FirInterpolator::process(const std::complex<float> *in, const size_t n, std::complex<float> *out)
+{
+    const size_t size = _phaseLen - 1 + n + _phaseStride/2;
+    if (_work.size() < size) _work.resize(size);
+    if (in == nullptr) std::fill(_work.begin() + _phaseLen - 1, _work.begin() + _phaseLen - 1 + n, std::complex<float>());
+    else std::copy(in, in + n, _work.begin() + _phaseLen - 1);
+
+    //the window of the input at block index j starts at work index j
+    const float *work = reinterpret_cast<const float *>(_work.data());
+    for (size_t j = 0; j < n; j++)
+    {
+        for (size_t p = 0; p < _interp; p++)
+        {
+            out[j*_interp + p] = dotTaps(_taps.data() + p*_phaseStride, work + 2*j, _phaseStride);
+        }
+    }
+
+    std::copy(_work.begin() + n, _work.begin() + n + _phaseLen - 1, _work.begin());
+    return n*_interp;
+}
+
+/*******************************************************************
+ * Rational resampler
+ ******************************************************************/
+
+Resampler::Resampler(const size_t interp, const size_t decim, const size_t phaseLen):
+    _interp(interp),
+    _decim(decim),
+    _next(0),
+    _phase(0)
+{
+    //the prototype runs at interp times the input rate and also limits the band to the output rate
+    const size_t rate = std::max(interp, decim);
+    const auto taps = designLowpass(phaseLen*rate + 1, 0.5/rate, double(interp));
+    _numTaps = taps.size();
+    _phaseLen = (_numTaps + _interp - 1)/_interp;
+    _phaseStride = ((2*_phaseLen + DOT_LANES - 1)/DOT_LANES)*DOT_LANES;
+    _taps.resize(_phaseStride*_interp, 0.0f);
+    for (size_t p = 0; p < _interp; p++)
+    {
+        for (size_t k = 0; k < _phaseLen; k++)
+        {
+            const size_t n = p + k*_interp;
+            const size_t m = _phaseLen-1-k;
+            if (n < _numTaps) _taps[p*_phaseStride + 2*m+0] = _taps[p*_phaseStride + 2*m+1] = taps[n];
+        }
+    }
+    this->reset();
+}
+
+void Resampler::reset(void)
+{
+    _work.assign(_phaseLen - 1 + _phaseStride/2, std::complex<float>());
+    _next = 0;
+    _phase = 0;
+}
+
+std::complex<float> *Resampler::input(const size_t n)
+{
+    const size_t size = _phaseLen - 1 + n + _phaseStride/2;
+    if (_work.size() < size) _work.resize(size);
+    return _work.data() + _phaseLen - 1;
+}
+
+size_t Resampler::filter(const size_t n, std::complex<float> *out)
+{
+    //the window of the input at block index j starts at work index j
+    const float *work = reinterpret_cast<const float *>(_work.data());
+    size_t numOut(0);
+    while (_next < n)
+    {
+        out[numOut++] = dotTaps(_taps.data() + _phase*_phaseStride, work + 2*_next, _phaseStride);
+        _phase += _decim;
+        _next += _phase/_interp;
+        _phase %= _interp;
+    }
+    _next -= n;
+
+    std::copy(_work.begin() + n, _work.begin() + n + _phaseLen - 1, _work.begin());
+    return numOut;
+}
+
+/*******************************************************************
+ * RX processing chain
+ ******************************************************************/
+
+RxChain::RxChain(IQCorrector *corrector, const double freq, const size_t decim, const size_t interp, const size_t resampDecim):
+    _corrector(corrector),
+    _decim(decim)
+{
+    if (freq != 0.0) _nco.reset(new NCO(freq));
+    if (decim > 1) _fir.reset(new FirDecimator(designLowpass(DDC_TAPS_PER_PHASE*decim + 1, 0.5/decim), decim));
+    if (interp != resampDecim) _resampler.reset(new Resampler(interp, resampDecim, DDC_TAPS_PER_PHASE));
+}
+
+double RxChain::ratio(void) const
+{
+    return _resampler?_decim*_resampler->ratio():double(_decim);
+}
+
+size_t RxChain::maxInput(const size_t numOut) const
+{
+    return (_resampler?_resampler->maxInput(numOut):numOut)*_decim;
+}
+
+double RxChain::nextOutputOffset(void) const
+{
+    //the resampler input is the decimator output
+    double offset(0.0);
+    if (_resampler) offset = _resampler->nextOutput() - _resampler->delay();
+    if (_fir) offset = double(_fir->nextOutput()) - double(_fir->delay()) + offset*_decim;
+    return offset;
+}
+
+size_t RxChain::process(const int16_t *in, const size_t stride, std::complex<float> *out, const size_t n)
+{
+    //each stage writes straight into the input of the next one
+    std::complex<float> *resampIn = _resampler?_resampler->input(_fir?(n/_decim + 1):n):nullptr;
+    std::complex<float> *stage = _fir?_fir->input(n):(_resampler?resampIn:out);
+    if (_corrector != nullptr)
+    {
+        _corrector->convert(in, stride, stage, n);
+        if (_nco) _nco->mix(stage, n);
+    }
+    else if (_nco) _nco->mix(in, stride, stage, n);
+    else convertCS16(in, stride, stage, n);
+
+    size_t numOut = n;
+    if (_fir) numOut = _fir->filter(n, _resampler?resampIn:out);
+    if (_resampler) numOut = _resampler->filter(numOut, out);
+    return numOut;
+}
+
+void RxChain::reset(void)
+{
+    if (_nco) _nco->reset();
+    if (_fir) _fir->reset();
+    if (_resampler) _resampler->reset();
+}
+
+/*******************************************************************
+ * TX processing chain
+ ******************************************************************/
+
+TxChain::TxChain(const double freq, const size_t interp, const size_t resampInterp, const size_t resampDecim):
+    _interp(interp)
+{
+    if (resampInterp != resampDecim) _resampler.reset(new Resampler(resampInterp, resampDecim, DDC_TAPS_PER_PHASE));
+    if (interp > 1) _fir.reset(new FirInterpolator(designLowpass(DDC_TAPS_PER_PHASE*interp + 1, 0.5/interp, double(interp)), interp));
+    if (freq != 0.0) _nco.reset(new NCO(freq));
+}
+
+double TxChain::ratio(void) const
+{
+    return _resampler?_interp/_resampler->ratio():double(_interp);
+}
+
+size_t TxChain::maxInput(const size_t numOut) const
+{
+    const size_t n = numOut/_interp;
+    if (not _resampler) return n;
+    //maxOutput() bounds the resampler output by one more than the ratio
+    return (n == 0)?0:_resampler->maxInput(n - 1);
+}
+
+double TxChain::delay(void) const
+{
+    //the first input leaves the resampler after its delay at the resampler output rate
+    double delay(0.0);
+    if (_resampler) delay = _resampler->delay()/_resampler->ratio()*_interp;
+    if (_fir) delay += double(_fir->delay());
+    return delay;
+}
+
+size_t TxChain::flushInput(void) const
+{
+    size_t n = _fir?_fir->history():0;
+    if (_resampler) n = _resampler->history() + size_t(std::ceil(n*_resampler->ratio())) + 1;
+    return n;
+}
+
+size_t TxChain::process(const std::complex<float> *in, int16_t *out, const size_t stride, const size_t n)
+{
+    //the filter output is mixed and converted in one pass
+    const std::complex<float> *stage = in;
+    size_t num = n;
+    if (_resampler)
+    {
+        std::complex<float> *resampIn = _resampler->input(n);
+        if (in == nullptr) std::fill(resampIn, resampIn + n, std::complex<float>());
+        else std::copy(in, in + n, resampIn);
+        if (_resampled.size() < _resampler->maxOutput(n)) _resampled.resize(_resampler->maxOutput(n));
+        num = _resampler->filter(n, _resampled.data());
+        stage = _resampled.data();
+    }
+    if (_fir)
+    {
+        if (_buff.size() < num*_interp) _buff.resize(num*_interp);
+        _fir->process(stage, num, _buff.data());
+        stage = _buff.data();
+    }
+    else if (stage == nullptr)
+    {
+        _buff.assign(num, std::complex<float>());
+        stage = _buff.data();
+    }
+
+    const size_t numOut = num*_interp;
+    if (_nco) _nco->mix(stage, out, stride, numOut);
+    else convertCF32(stage, out, stride, numOut);
+    return numOut;
+}
+
+void TxChain::reset(void)
+{
+    if (_resampler) _resampler->reset();
+    if (_fir) _fir->reset();
+    if (_nco) _nco->reset();
+}
+
+/*******************************************************************
+ * FFT
+ ******************************************************************/
+
+FFT::FFT(const size_t size):
+    _size(size),
+    _reversed(size),
+    _twiddleI(size/2),
+    _twiddleQ(size/2)
+{
+    size_t bits(0);
+    while ((size_t(1) << bits) < size) bits++;
+    for (size_t i = 0; i < size; i++)
+    {
+        size_t r(0);
+        for (size_t b = 0; b < bits; b++) if ((i >> b) & 1) r |= size_t(1) << (bits-1-b);
+        _reversed[i] = r;
+    }
+    for (size_t k = 0; k < size/2; k++)
+    {
+        _twiddleI[k] = float(std::cos(-2*M_PI*k/size));
+        _twiddleQ[k] = float(std::sin(-2*M_PI*k/size));
+    }
+}
+
+void FFT::transform(std::complex<float> *data) const
+{
+    for (size_t i = 0; i < _size; i++)
+    {
+        if (i < _reversed[i]) std::swap(data[i], data[_reversed[i]]);
+    }
+
+    //the butterflies use plain float math, std::complex multiplication checks for infinities
+    float *x = reinterpret_cast<float *>(data);
+    for (size_t len = 2; len <= _size; len <<= 1)
+    {
+        const size_t half = len/2;
+        const size_t step = _size/len;
+        for (size_t i = 0; i < _size; i += len)
+        {
+            float *a = x + 2*i;
+            float *b = x + 2*(i + half);
+            for (size_t k = 0; k < half; k++)
+            {
+                const float wI = _twiddleI[k*step], wQ = _twiddleQ[k*step];
+                const float vI = b[2*k]*wI - b[2*k+1]*wQ;
+                const float vQ = b[2*k]*wQ + b[2*k+1]*wI;
+                const float uI = a[2*k], uQ = a[2*k+1];
+                a[2*k] = uI + vI;
+                a[2*k+1] = uQ + vQ;
+                b[2*k] = uI - vI;
+                b[2*k+1] = uQ - vQ;
+            }
+        }
+    }
+}
+
+/*******************************************************************
+ * Worker pool
+ ******************************************************************/
+
+WorkerPool::WorkerPool(const size_t numThreads):
+    _task(nullptr),
+    _next(0),
+    _count(0),
+    _remaining(0),
+    _exit(false)
+{
+    for (size_t i = 1; i < numThreads; i++) _threads.emplace_back(&WorkerPool::_work, this);
+}
+
+WorkerPool::~WorkerPool(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _exit = true;
+    }
+    _cond.notify_all();
+    for (auto &thread : _threads) thread.join();
+}
+
+void WorkerPool::run(const size_t n, const std::function<void(size_t)> &task)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _task = &task;
+    _next = 0;
+    _count = n;
+    _remaining = n;
+    _cond.notify_all();
+
+    //the calling thread takes tasks too
+    while (_next < _count)
+    {
+        const size_t i = _next++;
+        lock.unlock();
+        task(i);
+        lock.lock();
+        _remaining--;
+    }
+    _doneCond.wait(lock, [this]{return _remaining == 0;});
+    _task = nullptr;
+}
+
+void WorkerPool::_work(void)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _cond.wait(lock, [this]{return _exit or _next < _count;});
+        if (_exit) return;
+        const size_t i = _next++;
+        const auto &task = *_task;
+        lock.unlock();
+        task(i);
+        lock.lock();
+        if (--_remaining == 0) _doneCond.notify_all();
+    }
+}
+
+/*******************************************************************
+ * Polyphase channelizer
+ ******************************************************************/
+
+Channelizer::Channelizer(const size_t numChans, const bool oversample, const std::vector<size_t> &bins, const size_t numThreads):
+    _numChans(numChans),
+    _hop(oversample?numChans/2:numChans),
+    _numTaps(DDC_TAPS_PER_PHASE*numChans),
+    _bins(bins),
+    _mixI(numChans),
+    _mixQ(numChans),
+    _fft(numChans),
+    _scratch(std::max<size_t>(1, numThreads), std::vector<std::complex<float>>(2*numChans)),
+    _next(0),
+    _position(0)
+{
+    const auto taps = designLowpass(_numTaps, 0.5/numChans);
+    _taps.resize(2*_numTaps);
+    for (size_t i = 0; i < _numTaps; i++)
+    {
+        _taps[2*i+0] = _taps[2*i+1] = taps[_numTaps-1-i];
+    }
+    for (size_t r = 0; r < numChans; r++)
+    {
+        _mixI[r] = float(std::cos(-2*M_PI*r/numChans));
+        _mixQ[r] = float(std::sin(-2*M_PI*r/numChans));
+    }
+    if (numThreads > 1) _pool.reset(new WorkerPool(numThreads));
+    this->reset();
+}
+
+void Channelizer::reset(void)
+{
+    _work.assign(_numTaps - 1, std::complex<float>());
+    _next = 0;
+    _position = 0;
+}
+
+std::complex<float> *Channelizer::input(const size_t n)
+{
+    if (_work.size() < _numTaps - 1 + n) _work.resize(_numTaps - 1 + n);
+    return _work.data() + _numTaps - 1;
+}
+
+void Channelizer::_frame(const float *window, const size_t newest, std::complex<float> *scratch, std::complex<float> * const *outs, const size_t index) const
+{
+    //weight the window by the reversed prototype and fold it into numChans sums,
+    //the sums are contiguous along the window so the loop vectorizes
+    float *v = reinterpret_cast<float *>(scratch);
+    const size_t width = 2*_numChans;
+    std::fill(v, v + width, 0.0f);
+    for (size_t s = 0; s < _numTaps; s += _numChans)
+    {
+        const float *t = _taps.data() + 2*s;
+        const float *w = window + 2*s;
+        for (size_t f = 0; f < width; f++) v[f] += t[f]*w[f];
+    }
+
+    //sum u[m]*exp(+j*2*pi*b*m/K) over the fold u[m] = v[K-1-m] is the FFT of v rotated by one
+    std::complex<float> *u = scratch + _numChans;
+    u[0] = scratch[_numChans-1];
+    std::copy(scratch, scratch + _numChans - 1, u + 1);
+    _fft.transform(u);
+
+    //mixing by the bin frequency is referenced to the newest input sample
+    for (size_t i = 0; i < _bins.size(); i++)
+    {
+        const size_t r = (_bins[i]*newest) % _numChans;
+        const float x = u[_bins[i]].real(), y = u[_bins[i]].imag();
+        outs[i][index] = std::complex<float>(x*_mixI[r] - y*_mixQ[r], x*_mixQ[r] + y*_mixI[r]);
+    }
+}
+
+size_t Channelizer::filter(const size_t n, std::complex<float> * const *outs)
+{
+    //frames end at block index _next, _next+hop...
+    const float *work = reinterpret_cast<const float *>(_work.data());
+    const size_t numFrames = (_next < n)?(n - _next + _hop - 1)/_hop:0;
+    const size_t numTasks = (_pool and numFrames >= 2*_pool->size())?_pool->size():1;
+    const std::function<void(size_t)> task = [&](const size_t t)
+    {
+        for (size_t q = (t*numFrames)/numTasks; q < ((t+1)*numFrames)/numTasks; q++)
+        {
+            const size_t j = _next + q*_hop;
+            this->_frame(work + 2*j, (_position + j) % _numChans, _scratch[t].data(), outs, q);
+        }
+    };
+    if (numTasks > 1) _pool->run(numTasks, task);
+    else task(0);
+
+    _position = (_position + n) % _numChans;
+    _next = _next + numFrames*_hop - n;
+    std::copy(_work.begin() + n, _work.begin() + n + _numTaps - 1, _work.begin());
+    return numFrames;
+}
+
+/*******************************************************************
+ * Averaged power spectrum
+ ******************************************************************/
+
+PowerSpectrum::PowerSpectrum(const size_t size, const std::string &window, const size_t hop, const size_t average, const size_t numThreads):
+    _hop(hop),
+    _average(average),
+    _fft(size),
+    _window(size, 1.0f),
+    _scratch(std::max<size_t>(1, numThreads), std::vector<std::complex<float>>(size)),
+    _pendingIndex(0),
+    _sum(size),
+    _count(0),
+    _frameIndex(0)
+{
+    double total(0.0);
+    std::vector<double> w(size, 1.0);
+    for (size_t i = 0; i < size; i++)
+    {
+        const double x = 2*M_PI*i/size;
+        if (window == "hann") w[i] = 0.5 - 0.5*std::cos(x);
+        if (window == "hamming") w[i] = 0.54 - 0.46*std::cos(x);
+        if (window == "blackmanharris") w[i] = 0.35875 - 0.48829*std::cos(x) + 0.14128*std::cos(2*x) - 0.01168*std::cos(3*x);
+        total += w[i];
+    }
+
+    //a tone at a bin center sums to its amplitude times the window sum
+    for (size_t i = 0; i < size; i++) _window[i] = float(w[i]/total);
+    if (numThreads > 1) _pool.reset(new WorkerPool(numThreads));
+    this->reset();
+}
+
+void PowerSpectrum::reset(void)
+{
+    _pending.clear();
+    _pendingIndex = 0;
+    std::fill(_sum.begin(), _sum.end(), 0.0f);
+    _count = 0;
+    _frameIndex = 0;
+    _frames.clear();
+}
+
+void PowerSpectrum::_spectrum(const std::complex<float> *in, std::complex<float> *scratch, float *power) const
+{
+    const size_t size = _fft.size();
+    for (size_t i = 0; i < size; i++) scratch[i] = in[i]*_window[i];
+    _fft.transform(scratch);
+    const float *x = reinterpret_cast<const float *>(scratch);
+    for (size_t k = 0; k < size; k++) power[k] = x[2*k]*x[2*k] + x[2*k+1]*x[2*k+1];
+}
+
+void PowerSpectrum::process(const std::complex<float> *in, const size_t n)
+{
+    const size_t size = _fft.size();
+    _pending.insert(_pending.end(), in, in + n);
+    if (_pending.size() < size) return;
+
+    //the transforms of one call are independent, only the sums are in order
+    const size_t numSpectra = (_pending.size() - size)/_hop + 1;
+    if (_spectra.size() < numSpectra*size) _spectra.resize(numSpectra*size);
+    const size_t numTasks = (_pool and numSpectra >= 2)?std::min(numSpectra, _pool->size()):1;
+    const std::function<void(size_t)> task = [&](const size_t t)
+    {
+        for (size_t q = (t*numSpectra)/numTasks; q < ((t+1)*numSpectra)/numTasks; q++)
+        {
+            this->_spectrum(_pending.data() + q*_hop, _scratch[t].data(), _spectra.data() + q*size);
+        }
+    };
+    if (numTasks > 1) _pool->run(numTasks, task);
+    else task(0);
+
+    for (size_t q = 0; q < numSpectra; q++)
+    {
+        if (_count == 0) _frameIndex = _pendingIndex + q*_hop;
+        const float *power = _spectra.data() + q*size;
+        for (size_t k = 0; k < size; k++) _sum[k] += power[k];
+        if (++_count < _average) continue;
+
+        std::vector<float> frame(size);
+        for (size_t k = 0; k < size; k++) frame[k] = _sum[k]/_average;
+        _frames.emplace_back(_frameIndex, std::move(frame));
+        std::fill(_sum.begin(), _sum.end(), 0.0f);
+        _count = 0;
+    }
+
+    const size_t used = numSpectra*_hop;
+    _pending.erase(_pending.begin(), _pending.begin() + used);
+    _pendingIndex += used;
+}
+
+unsigned long long PowerSpectrum::take(float *out)
+{
+    //bins from the lowest frequency, the FFT has DC first
+    const size_t size = _fft.size();
+    const auto &frame = _frames.front().second;
+    std::copy(frame.begin() + size/2, frame.end(), out);
+    std::copy(frame.begin(), frame.begin() + size/2, out + size - size/2);
+    const unsigned long long index = _frames.front().first;
+    _frames.pop_front();
+    return index;
+}
+
+/*******************************************************************
+ * Energy squelch
+ ******************************************************************/
+
+EnergySquelch::EnergySquelch(const size_t numChans, const size_t elemSize, const float threshold, const size_t window, const size_t pre, const size_t post, const size_t delay):
+    _numChans(numChans),
+    _elemSize(elemSize),
+    _thresholdSum(double(threshold)*window),
+    _pre(pre),
+    _post(post),
+    _delay(delay),
+    _recent(window),
+    _history(numChans)
+{
+    this->reset();
+}
+
+void EnergySquelch::reset(void)
+{
+    std::fill(_recent.begin(), _recent.end(), 0.0f);
+    _recentPos = 0;
+    _recentSum = 0.0;
+    for (auto &history : _history) history.clear();
+    _historyIndex = 0;
+    _next = 0;
+    _floor = 0;
+    _active = false;
+    _lastActive = 0;
+    _bursts.clear();
+}
+
+void EnergySquelch::discontinuity(void)
+{
+    if (_active)
+    {
+        _bursts.back().end = _next;
+        _bursts.back().closed = true;
+        _active = false;
+    }
+    if (not _bursts.empty() and _bursts.back().end > _next)
+    {
+        _bursts.back().end = _next;
+        if (_bursts.back().start >= _next) _bursts.pop_back();
+    }
+    _floor = _next;
+    std::fill(_recent.begin(), _recent.end(), 0.0f);
+    _recentSum = 0.0;
+}
+
+void EnergySquelch::process(const int16_t * const *in, const size_t n)
+{
+    //the detector takes the loudest channel of each sample
+    if (_power.size() < n) _power.resize(n);
+    const float scale = 1.0f/(2048.0f*2048.0f);
+    std::fill(_power.begin(), _power.begin() + n, 0.0f);
+    for (size_t c = 0; c < _numChans; c++)
+    {
+        const int16_t *x = in[c];
+        for (size_t i = 0; i < n; i++)
+        {
+            const float p = (float(x[2*i])*x[2*i] + float(x[2*i+1])*x[2*i+1])*scale;
+            _power[i] = std::max(_power[i], p);
+        }
+    }
+    this->_keep((const void * const *)in, n);
+    this->_detect(n);
+    this->_advance(n);
+}
+
+void EnergySquelch::process(const std::complex<float> * const *in, const size_t n)
+{
+    if (_power.size() < n) _power.resize(n);
+    std::fill(_power.begin(), _power.begin() + n, 0.0f);
+    for (size_t c = 0; c < _numChans; c++)
+    {
+        const float *x = reinterpret_cast<const float *>(in[c]);
+        for (size_t i = 0; i < n; i++)
+        {
+            const float p = x[2*i]*x[2*i] + x[2*i+1]*x[2*i+1];
+            _power[i] = std::max(_power[i], p);
+        }
+    }
+    this->_keep((const void * const *)in, n);
+    this->_detect(n);
+    this->_advance(n);
+}
+
+void EnergySquelch::keep(const void * const *in, const size_t n)
+{
+    this->_keep(in, n);
+    this->_advance(n);
+}
+
+void EnergySquelch::trigger(const unsigned long long first, const unsigned long long last)
+{
+    //overlapping windows extend the last burst
+    const unsigned long long start = std::max(std::max(_floor, _historyIndex), (first > _pre)?first - _pre:0);
+    const unsigned long long end = last + _post + 1;
+    if (start >= end) return;
+    if (not _bursts.empty() and _bursts.back().closed and start <= _bursts.back().end)
+    {
+        _bursts.back().end = std::max(_bursts.back().end, end);
+        return;
+    }
+    Burst burst;
+    burst.start = start;
+    burst.end = end;
+    burst.closed = true;
+    _bursts.push_back(burst);
+}
+
+void EnergySquelch::_keep(const void * const *in, const size_t n)
+{
+    for (size_t c = 0; c < _numChans; c++)
+    {
+        const char *bytes = reinterpret_cast<const char *>(in[c]);
+        _history[c].insert(_history[c].end(), bytes, bytes + n*_elemSize);
+    }
+}
+
+void EnergySquelch::_detect(const size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        const unsigned long long index = _next + i;
+        _recentSum += _power[i] - _recent[_recentPos];
+        _recent[_recentPos] = _power[i];
+        if (++_recentPos == _recent.size()) _recentPos = 0;
+
+        if (_recentSum > _thresholdSum)
+        {
+            if (not _active)
+            {
+                Burst burst;
+                burst.start = std::max(_floor, (index > _pre)?index - _pre:0);
+                burst.end = 0;
+                burst.closed = false;
+                _bursts.push_back(burst);
+            }
+            _active = true;
+            _lastActive = index;
+        }
+        else if (_active and index > _lastActive + _post)
+        {
+            _bursts.back().end = index;
+            _bursts.back().closed = true;
+            _floor = index;
+            _active = false;
+        }
+    }
+}
+
+void EnergySquelch::_advance(const size_t n)
+{
+    _next += n;
+
+    //keep the unread bursts and enough samples to pad the next one
+    const unsigned long long margin = _pre + _delay;
+    const unsigned long long keep = _bursts.empty()?std::max(_floor, (_next > margin)?_next - margin:0):_bursts.front().start;
+    if (keep > _historyIndex)
+    {
+        const size_t drop = size_t(std::min(keep, _next) - _historyIndex)*_elemSize;
+        for (auto &history : _history) history.erase(history.begin(), history.begin() + drop);
+        _historyIndex = std::min(keep, _next);
+    }
+}
+
+bool EnergySquelch::ready(void) const
+{
+    if (_bursts.empty()) return false;
+    const Burst &burst = _bursts.front();
+    return (burst.closed?std::min(burst.end, _next):_next) > burst.start;
+}
+
+size_t EnergySquelch::read(void * const *out, const size_t n, unsigned long long &index, bool &end)
+{
+    Burst &burst = _bursts.front();
+    const unsigned long long last = burst.closed?std::min(burst.end, _next):_next;
+    const size_t count = size_t(std::min<unsigned long long>(n, last - burst.start));
+    const size_t offset = size_t(burst.start - _historyIndex)*_elemSize;
+    for (size_t c = 0; c < _numChans; c++)
+    {
+        std::copy(_history[c].begin() + offset, _history[c].begin() + offset + count*_elemSize, reinterpret_cast<char *>(out[c]));
+    }
+    index = burst.start;
+    burst.start += count;
+    end = burst.closed and burst.start == burst.end;
+    if (end) _bursts.pop_front();
+    return count;
+}
+
+/*******************************************************************
+ * Preamble detector
+ ******************************************************************/
+
+static size_t correlatorSize(const std::vector<std::vector<std::complex<float>>> &refs)
+{
+    //a block of four preambles keeps most of each transform useful
+    size_t length(1), size(256);
+    for (const auto &ref : refs) length = std::max(length, ref.size());
+    while (size < 4*length) size *= 2;
+    return size;
+}
+
+PreambleDetector::PreambleDetector(const std::vector<std::vector<std::complex<float>>> &refs, const float threshold):
+    _threshold(threshold),
+    _length(1),
+    _fft(correlatorSize(refs)),
+    _block(_fft.size()),
+    _product(_fft.size()),
+    _energy(_fft.size() + 1)
+{
+    for (const auto &samples : refs)
+    {
+        Reference ref;
+        ref.samples = samples;
+        ref.spectrum.assign(_fft.size(), std::complex<float>());
+        std::copy(samples.begin(), samples.end(), ref.spectrum.begin());
+        _fft.transform(ref.spectrum.data());
+        for (auto &x : ref.spectrum) x = std::conj(x);
+        ref.energy = 0.0;
+        for (const auto &x : samples) ref.energy += std::norm(x);
+        _refs.push_back(ref);
+        _length = std::max(_length, samples.size());
+    }
+    this->reset();
+}
+
+void PreambleDetector::reset(void)
+{
+    _inputIndex = 0;
+    this->discontinuity();
+}
+
+void PreambleDetector::discontinuity(void)
+{
+    _inputIndex += _input.size();
+    _input.clear();
+    for (auto &ref : _refs)
+    {
+        ref.tracking = false;
+        ref.holdoff = _inputIndex;
+    }
+}
+
+double PreambleDetector::_offset(const Reference &ref, const std::complex<float> *x) const
+{
+    //the phase advance between the correlations of the two halves
+    const size_t half = ref.samples.size()/2;
+    std::complex<double> a, b;
+    for (size_t m = 0; m < half; m++) a += std::complex<double>(x[m]*std::conj(ref.samples[m]));
+    for (size_t m = half; m < 2*half; m++) b += std::complex<double>(x[m]*std::conj(ref.samples[m]));
+    if (half == 0) return 0.0;
+    return std::arg(b*std::conj(a))/(2*M_PI*half);
+}
+
+void PreambleDetector::_correlate(const size_t numOut, std::vector<Detection> &detections)
+{
+    const size_t size = _fft.size();
+    std::copy(_input.begin(), _input.begin() + size, _block.begin());
+    _energy[0] = 0.0;
+    for (size_t i = 0; i < size; i++) _energy[i+1] = _energy[i] + std::norm(_block[i]);
+    _fft.transform(_block.data());
+
+    for (size_t r = 0; r < _refs.size(); r++)
+    {
+        //the inverse transform is the forward one of the conjugate, only the magnitude is used
+        Reference &ref = _refs[r];
+        const size_t len = ref.samples.size();
+        for (size_t k = 0; k < size; k++) _product[k] = std::conj(_block[k]*ref.spectrum[k]);
+        _fft.transform(_product.data());
+
+        const double scale = 1.0/(double(size)*size*ref.energy);
+        for (size_t k = 0; k < numOut; k++)
+        {
+            const unsigned long long index = _inputIndex + k;
+            const double energy = _energy[k+len] - _energy[k];
+            const float metric = (energy > 0.0)?float(std::norm(_product[k])*scale/energy):0.0f;
+
+            //report the highest peak of each crossing, once per preamble length
+            if (ref.tracking and (metric < _threshold or index >= ref.first + len))
+            {
+                detections.push_back(ref.best);
+                ref.tracking = false;
+                ref.holdoff = ref.best.index + len;
+            }
+            if (metric < _threshold or index < ref.holdoff) continue;
+            if (not ref.tracking)
+            {
+                ref.tracking = true;
+                ref.first = index;
+                ref.best.peak = 0.0f;
+            }
+            if (metric > ref.best.peak)
+            {
+                ref.best.index = index;
+                ref.best.preamble = r;
+                ref.best.length = len;
+                ref.best.peak = std::min(metric, 1.0f);
+                ref.best.freq = this->_offset(ref, _input.data() + k);
+            }
+        }
+    }
+}
+
+void PreambleDetector::process(const std::complex<float> *in, const size_t n, std::vector<Detection> &detections)
+{
+    //each block gives the correlations that do not wrap around it
+    const size_t size = _fft.size();
+    const size_t numOut = size - _length + 1;
+    _input.insert(_input.end(), in, in + n);
+    const size_t begin = detections.size();
+    while (_input.size() >= size)
+    {
+        this->_correlate(numOut, detections);
+        _input.erase(_input.begin(), _input.begin() + numOut);
+        _inputIndex += numOut;
+    }
+
+    //references are scanned one after the other
+    std::sort(detections.begin() + begin, detections.end(), [](const Detection &a, const Detection &b){return a.index < b.index;});
+}
+
+/*******************************************************************
+ * Capture ring
+ ******************************************************************/
+
+CaptureRing::CaptureRing(const size_t numChans, const size_t elemSize, const size_t pre, const size_t post, const double rate):
+    _numChans(numChans),
+    _elemSize(elemSize),
+    _pre(pre),
+    _post(post),
+    _capacity(pre + post),
+    _rate(rate),
+    _ring(numChans, std::vector<char>((pre + post)*elemSize)),
+    _state(CAPTURING),
+    _next(0),
+    _floor(0),
+    _runIndex(0),
+    _runNs(0),
+    _running(false),
+    _start(0),
+    _end(0),
+    _read(0),
+    _startNs(0)
+{
+    return;
+}
+
+void CaptureRing::write(const void * const *in, const size_t n, const long long timeNs)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    //a gap ends a pending snapshot and the history
+    const long long expectedNs = _runNs + std::llround((_next - _runIndex)*1e9/_rate);
+    if (not _running or std::llabs(timeNs - expectedNs) > std::llround(0.5e9/_rate))
+    {
+        if (_state == TRIGGERED)
+        {
+            _end = std::min(_end, _next);
+            _state = (_end > _start)?READY:CAPTURING;
+            if (_state == READY) _cond.notify_all();
+        }
+        _running = true;
+        _runIndex = _next;
+        _runNs = timeNs;
+        if (_state == CAPTURING) _floor = _next;
+    }
+
+    //a held snapshot is never overwritten, the writes after its end are dropped
+    size_t count = n;
+    if (_state == READY) count = 0;
+    if (_state == TRIGGERED) count = size_t(std::min<unsigned long long>(n, _end - _next));
+    for (size_t done = 0; done < count;)
+    {
+        const size_t pos = size_t((_next + done) % _capacity);
+        const size_t chunk = std::min(count - done, _capacity - pos);
+        for (size_t c = 0; c < _numChans; c++)
+        {
+            const char *bytes = reinterpret_cast<const char *>(in[c]) + done*_elemSize;
+            std::copy(bytes, bytes + chunk*_elemSize, _ring[c].begin() + pos*_elemSize);
+        }
+        done += chunk;
+    }
+    _next += n;
+    if (_state == TRIGGERED and _next >= _end)
+    {
+        _state = READY;
+        _cond.notify_all();
+    }
+}
+
+bool CaptureRing::_trigger(const unsigned long long index)
+{
+    if (_state != CAPTURING) return false;
+    const unsigned long long oldest = std::max(_floor, (_next > _capacity)?_next - _capacity:0);
+    _start = std::max(oldest, (index > _pre)?index - _pre:0);
+    _end = index + _post;
+    if (_end <= _start) return false;
+    _read = _start;
+    _startNs = _runNs + std::llround((double(_start) - double(_runIndex))*1e9/_rate);
+    _state = (_end <= _next)?READY:TRIGGERED;
+    if (_state == READY) _cond.notify_all();
+    return true;
+}
+
+bool CaptureRing::trigger(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return this->_trigger(_next);
+}
+
+bool CaptureRing::trigger(const long long timeNs)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    const double index = _runIndex + (timeNs - _runNs)*_rate/1e9;
+    if (not _running or index < 0.0) return false;
+    return this->_trigger((unsigned long long)(std::llround(index)));
+}
+
+bool CaptureRing::wait(const long timeoutUs)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _cond.wait_for(lock, std::chrono::microseconds(timeoutUs), [this]{return _state == READY;});
+}
+
+size_t CaptureRing::peek(const void **out, const size_t n, long long &timeNs, bool &end) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_state != READY) return 0;
+    const size_t pos = size_t(_read % _capacity);
+    const size_t count = size_t(std::min<unsigned long long>(std::min<unsigned long long>(n, _end - _read), _capacity - pos));
+    for (size_t c = 0; c < _numChans; c++) out[c] = _ring[c].data() + pos*_elemSize;
+    timeNs = _startNs + std::llround((_read - _start)*1e9/_rate);
+    end = _read + count == _end;
+    return count;
+}
+
+void CaptureRing::consume(const size_t n)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_state != READY) return;
+    _read = std::min<unsigned long long>(_read + n, _end);
+    if (_read < _end) return;
+    _state = CAPTURING;
+    _floor = _next;
+}
+
+std::string CaptureRing::state(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_state == TRIGGERED) return "triggered";
+    if (_state == READY) return "ready";
+    return "capturing";
+}
@@ -0,0 +1,703 @@
+/*
+ * This file is part of the bladeRF project:
+ *   http://www.github.com/nuand/bladeRF
+ *
+ * Copyright (C) 2015-2022 Josh Blum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <complex>
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * Host side stream processing.
+ * The loops work on plain float arrays so that the compiler can vectorize
+ * them for the target instruction set, no intrinsics are used.
+ */
+
+/*!
+ * Tracks and removes the residual DC offset and IQ imbalance of an rx channel
+ * while converting from the interleaved CS16 samples to CF32.
+ * The estimates of one buffer are applied to the next one, so the
+ * correction is a single pass over the samples.
+ */
+class IQCorrector
+{
+public:
+    IQCorrector(const bool correctIQ);
+
+    /*!
+     * Convert n samples from in (I/Q pairs every stride pairs) to out,
+     * removing the current estimates and updating them from this buffer.
+     */
+    void convert(const int16_t *in, const size_t stride, std::complex<float> *out, const size_t n);
+
+    //! residual DC offset, full scale is 1.0 like setDCOffset()
+    std::complex<double> dcOffset(void) const;
+
+    //! image coefficient b of y = x + b*conj(x), the image rejection is -20*log10(|b|) dB
+    std::complex<double> imbalance(void) const;
+
+private:
+    const bool _correctIQ;
+    mutable std::mutex _mutex;
+    std::complex<float> _dc; //subtracted offset
+    std::complex<float> _w; //applied image correction z = y + w*conj(y)
+    std::complex<double> _square; //tracked E[y^2]
+    double _power; //tracked E[|y|^2]
+};
+
+//! convert n samples from in (I/Q pairs every stride pairs) to out
+void convertCS16(const int16_t *in, const size_t stride, std::complex<float> *out, const size_t n);
+
+//! convert n samples from in to out (I/Q pairs every stride pairs), saturating at full scale
+void convertCF32(const std::complex<float> *in, int16_t *out, const size_t stride, const size_t n);
+
+/*!
+ * Design a lowpass FIR with a Kaiser window.
+ * The cutoff is in cycles per sample, the taps sum to the gain.
+ */
+std::vector<float> designLowpass(const size_t numTaps, const double cutoff, const double gain = 1.0);
+
+/*!
+ * Numerically controlled oscillator that mixes a stream by exp(j*2*pi*freq*n).
+ * A bank of rotators is advanced together so the mixing loop vectorizes,
+ * the rotators are recomputed from the exact phase regularly to avoid drift.
+ */
+class NCO
+{
+public:
+    //! freq is in cycles per sample
+    NCO(const double freq);
+
+    //! convert n samples from in (I/Q pairs every stride pairs) to out and mix them
+    void mix(const int16_t *in, const size_t stride, std::complex<float> *out, const size_t n);
+
+    //! mix n samples in place
+    void mix(std::complex<float> *inout, const size_t n);
+
+    //! mix n samples and convert them to out (I/Q pairs every stride pairs), saturating at full scale
+    void mix(const std::complex<float> *in, int16_t *out, const size_t stride, const size_t n);
+
+    //! restart at phase 0
+    void reset(void);
+
+private:
+    static const size_t LANES = 16;
+    template <typename Input, typename Output>
+    void _mix(const Input &input, const Output &output, const size_t n);
+    const double _freq;
+    double _phase; //cycles, wraps at 1
+    float _rotI[LANES], _rotQ[LANES];
+    float _stepI, _stepQ;
+};
+
+/*!
+ * Decimating FIR filter, only the samples that are kept are computed,
+ * like a polyphase decimator. The history is carried between blocks.
+ */
+class FirDecimator
+{
+public:
+    FirDecimator(const std::vector<float> &taps, const size_t decim);
+
+    //! space for the next n input samples, written in place by the previous stage
+    std::complex<float> *input(const size_t n);
+
+    //! filter the n samples written to input() into out, returns the number of output samples
+    size_t filter(const size_t n, std::complex<float> *out);
+
+    //! index of the next block input at which an output is computed
+    size_t nextOutput(void) const
+    {
+        return _skip;
+    }
+
+    //! group delay in input samples
+    size_t delay(void) const
+    {
+        return _numTaps/2;
+    }
+
+    //! clear the history
+    void reset(void);
+
+private:
+    const size_t _decim;
+    const size_t _numTaps;
+    std::vector<float> _taps; //reversed, each tap twice to match the I/Q pairs
+    std::vector<std::complex<float>> _work; //history followed by the current block
+    size_t _skip;
+};
+
+/*!
+ * Polyphase interpolating FIR filter, every input sample produces one
+ * output per phase. The history is carried between blocks.
+ */
+class FirInterpolator
+{
+public:
+    //! the taps are designed for the output rate with a gain of interp
+    FirInterpolator(const std::vector<float> &taps, const size_t interp);
+
+    //! interpolate n samples into out, returns n*interp
+    size_t process(const std::complex<float> *in, const size_t n, std::complex<float> *out);
+
+    //! group delay in output samples
+    size_t delay(void) const
+    {
+        return _numTaps/2;
+    }
+
+    //! input samples needed to push the history out of the filter
+    size_t history(void) const
+    {
+        return _phaseLen - 1;
+    }
+
+    //! clear the history
+    void reset(void);
+
+private:
+    const size_t _interp;
+    const size_t _numTaps;
+    size_t _phaseLen; //taps per phase
+    size_t _phaseStride; //floats per phase, reversed and padded like FirDecimator
+    std::vector<float> _taps;
+    std::vector<std::complex<float>> _work; //history followed by the current block
+};
+
+/*!
+ * Rational polyphase resampler by interp/decim.
+ * The output n*decim/interp in input samples is computed from the filter
+ * phase (n*decim)%interp, so the output rate is exact for any ratio.
+ */
+class Resampler
+{
+public:
+    //! phaseLen is the number of taps per phase when the rate is not reduced
+    Resampler(const size_t interp, const size_t decim, const size_t phaseLen);
+
+    //! space for the next n input samples, written in place by the previous stage
+    std::complex<float> *input(const size_t n);
+
+    //! resample the n samples written to input() into out, returns the number of output samples
+    size_t filter(const size_t n, std::complex<float> *out);
+
+    //! input samples per output sample
+    double ratio(void) const
+    {
+        return double(_decim)/_interp;
+    }
+
+    //! position of the next output in input samples relative to the next block
+    double nextOutput(void) const
+    {
+        return double(_next) + double(_phase)/_interp;
+    }
+
+    //! group delay in input samples
+    double delay(void) const
+    {
+        return double(_numTaps/2)/_interp;
+    }
+
+    //! input samples needed to push the history out of the filter
+    size_t history(void) const
+    {
+        return _phaseLen - 1;
+    }
+
+    //! the number of input samples that produce at most numOut output samples
+    size_t maxInput(const size_t numOut) const
+    {
+        return size_t((static_cast<unsigned long long>(numOut)*_decim)/_interp);
+    }
+
+    //! an upper bound on the output samples of n input samples
+    size_t maxOutput(const size_t n) const
+    {
+        return size_t((static_cast<unsigned long long>(n)*_interp)/_decim) + 1;
+    }
+
+    //! clear the history
+    void reset(void);
+
+private:
+    const size_t _interp;
+    const size_t _decim;
+    size_t _numTaps;
+    size_t _phaseLen;
+    size_t _phaseStride;
+    std::vector<float> _taps; //per phase, reversed and padded like FirDecimator
+    std::vector<std::complex<float>> _work; //history followed by the current block
+    size_t _next; //block index of the input of the next output
+    size_t _phase; //filter phase of the next output
+};
+
+/*!
+ * Converts and processes the samples of one rx channel.
+ * Every stage is optional: the correction, the NCO, the decimating FIR and the resampler.
+ */
+class RxChain
+{
+public:
+    //! freq is the NCO frequency in cycles per sample, the corrector is not owned, resampling is by interp/decim
+    RxChain(IQCorrector *corrector, const double freq, const size_t decim, const size_t interp = 1, const size_t resampDecim = 1);
+
+    //! input samples per output sample
+    double ratio(void) const;
+
+    //! the number of input samples that produce at most numOut output samples
+    size_t maxInput(const size_t numOut) const;
+
+    /*!
+     * Position of the first output of the next process() call, in input samples
+     * relative to its first input sample, with the filter group delays removed.
+     */
+    double nextOutputOffset(void) const;
+
+    //! convert n samples from in (I/Q pairs every stride pairs), returns the number of output samples
+    size_t process(const int16_t *in, const size_t stride, std::complex<float> *out, const size_t n);
+
+    //! forget the history after a discontinuity
+    void reset(void);
+
+private:
+    IQCorrector *_corrector;
+    const size_t _decim;
+    std::unique_ptr<NCO> _nco;
+    std::unique_ptr<FirDecimator> _fir;
+    std::unique_ptr<Resampler> _resampler;
+};
+
+/*!
+ * Processes and converts the samples of one tx channel.
+ * Every stage is optional: the resampler, the interpolating FIR and the NCO.
+ */
+class TxChain
+{
+public:
+    //! freq is the NCO frequency in cycles per output sample, resampling is by resampInterp/resampDecim
+    TxChain(const double freq, const size_t interp, const size_t resampInterp = 1, const size_t resampDecim = 1);
+
+    //! output samples per input sample
+    double ratio(void) const;
+
+    //! the number of input samples that produce at most numOut output samples
+    size_t maxInput(const size_t numOut) const;
+
+    //! group delay in output samples, the burst starts this early
+    double delay(void) const;
+
+    //! zero input samples appended at the end of a burst to flush the filters
+    size_t flushInput(void) const;
+
+    /*!
+     * Convert n samples from in to out (I/Q pairs every stride pairs), returns the number of output samples.
+     * A null input processes zeros, to flush the filters.
+     */
+    size_t process(const std::complex<float> *in, int16_t *out, const size_t stride, const size_t n);
+
+    //! forget the history, at the start of a burst
+    void reset(void);
+
+private:
+    const size_t _interp;
+    std::unique_ptr<Resampler> _resampler;
+    std::unique_ptr<FirInterpolator> _fir;
+    std::unique_ptr<NCO> _nco;
+    std::vector<std::complex<float>> _resampled;
+    std::vector<std::complex<float>> _buff;
+};
+
+/*!
+ * In place radix-2 forward FFT of a power of 2 size
+ */
+class FFT
+{
+public:
+    FFT(const size_t size);
+
+    size_t size(void) const
+    {
+        return _size;
+    }
+
+    void transform(std::complex<float> *data) const;
+
+private:
+    const size_t _size;
+    std::vector<size_t> _reversed;
+    std::vector<float> _twiddleI, _twiddleQ;
+};
+
+/*!
+ * Threads that split a batch of independent tasks with the calling thread
+ */
+class WorkerPool
+{
+public:
+    //! the calling thread is one of the numThreads
+    WorkerPool(const size_t numThreads);
+
+    ~WorkerPool(void);
+
+    size_t size(void) const
+    {
+        return _threads.size() + 1;
+    }
+
+    //! call task(0) to task(n-1) and return once all are done
+    void run(const size_t n, const std::function<void(size_t)> &task);
+
+private:
+    void _work(void);
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::condition_variable _doneCond;
+    const std::function<void(size_t)> *_task;
+    size_t _next;
+    size_t _count;
+    size_t _remaining;
+    bool _exit;
+};
+
+/*!
+ * Polyphase filter bank channelizer splitting the input into numChans
+ * channels of rate/numChans bandwidth. Each frame weights the windowed
+ * input with the polyphase filter and takes one FFT, the outputs are
+ * the requested bins. The hop is numChans, or numChans/2 when oversampled.
+ */
+class Channelizer
+{
+public:
+    //! bins are FFT bins, bin b is centered at b/numChans cycles per input sample
+    Channelizer(const size_t numChans, const bool oversample, const std::vector<size_t> &bins, const size_t numThreads);
+
+    //! input samples per output sample
+    size_t ratio(void) const
+    {
+        return _hop;
+    }
+
+    //! the number of input samples that produce at most numOut output samples
+    size_t maxInput(const size_t numOut) const
+    {
+        return numOut*_hop;
+    }
+
+    //! position of the next output in input samples relative to the next block, group delay removed
+    double nextOutputOffset(void) const
+    {
+        return double(_next) - (_numTaps - 1)/2.0;
+    }
+
+    //! space for the next n input samples
+    std::complex<float> *input(const size_t n);
+
+    //! channelize the n samples written to input(), outs holds one buffer per bin, returns the samples per bin
+    size_t filter(const size_t n, std::complex<float> * const *outs);
+
+    //! clear the history
+    void reset(void);
+
+private:
+    void _frame(const float *window, const size_t newest, std::complex<float> *scratch, std::complex<float> * const *outs, const size_t index) const;
+    const size_t _numChans;
+    const size_t _hop;
+    const size_t _numTaps;
+    const std::vector<size_t> _bins;
+    std::vector<float> _taps; //reversed, each tap twice to match the I/Q pairs
+    std::vector<float> _mixI, _mixQ; //exp(-j*2*pi*r/numChans)
+    FFT _fft;
+    std::vector<std::vector<std::complex<float>>> _scratch; //per worker
+    std::unique_ptr<WorkerPool> _pool;
+    std::vector<std::complex<float>> _work; //history followed by the current block
+    size_t _next; //block index of the newest input of the next frame
+    size_t _position; //input index of the block start modulo numChans
+};
+
+/*!
+ * Averaged power spectrum of a stream. Windowed FFTs start every hop samples
+ * and each frame averages a fixed number of them, in order from the lowest
+ * frequency. A full scale tone at a bin center has a power of 1.0.
+ */
+class PowerSpectrum
+{
+public:
+    //! window is rect, hann, hamming or blackmanharris, hop is at most size
+    PowerSpectrum(const size_t size, const std::string &window, const size_t hop, const size_t average, const size_t numThreads);
+
+    size_t size(void) const
+    {
+        return _fft.size();
+    }
+
+    //! add n samples to the average
+    void process(const std::complex<float> *in, const size_t n);
+
+    //! a frame is complete
+    bool ready(void) const
+    {
+        return not _frames.empty();
+    }
+
+    /*!
+     * Copy out the oldest complete frame of size() powers.
+     * Returns the index of its first sample, counted from the reset.
+     */
+    unsigned long long take(float *out);
+
+    //! drop the partial average and the pending samples
+    void reset(void);
+
+private:
+    void _spectrum(const std::complex<float> *in, std::complex<float> *scratch, float *power) const;
+    const size_t _hop;
+    const size_t _average;
+    FFT _fft;
+    std::vector<float> _window; //scaled so that the powers are normalized
+    std::unique_ptr<WorkerPool> _pool;
+    std::vector<std::vector<std::complex<float>>> _scratch; //per worker
+    std::vector<std::complex<float>> _pending; //samples not yet in a completed FFT
+    unsigned long long _pendingIndex; //index of the first pending sample
+    std::vector<float> _spectra; //powers of the FFTs of one process() call
+    std::vector<float> _sum;
+    size_t _count;
+    unsigned long long _frameIndex; //index of the first sample of the partial average
+    std::deque<std::pair<unsigned long long, std::vector<float>>> _frames;
+};
+
+/*!
+ * Energy squelch over the channels of a stream. The power averaged over a
+ * window opens the gate while any channel exceeds the threshold, each burst
+ * is padded with pre samples before and post samples after the activity.
+ * Samples are kept as elements of elemSize bytes until the burst is read.
+ */
+class EnergySquelch
+{
+public:
+    /*!
+     * threshold is a power relative to full scale.
+     * delay is how many samples trigger() may lag behind the processed samples.
+     */
+    EnergySquelch(const size_t numChans, const size_t elemSize, const float threshold, const size_t window, const size_t pre, const size_t post, const size_t delay = 0);
+
+    //! keep n samples of each channel and run the detector, full scale is 2048
+    void process(const int16_t * const *in, const size_t n);
+
+    //! keep n samples of each channel and run the detector, full scale is 1.0
+    void process(const std::complex<float> * const *in, const size_t n);
+
+    //! keep n samples of each channel without the power detector
+    void keep(const void * const *in, const size_t n);
+
+    //! open the gate over samples first to last, found by a detector beside the squelch
+    void trigger(const unsigned long long first, const unsigned long long last);
+
+    //! the next samples do not follow the previous ones: close the burst and restart the detector
+    void discontinuity(void);
+
+    //! samples of a burst can be read
+    bool ready(void) const;
+
+    /*!
+     * Copy up to n samples of the oldest burst to out. index is the first
+     * copied sample counted from the reset, end marks the last samples of the burst.
+     */
+    size_t read(void * const *out, const size_t n, unsigned long long &index, bool &end);
+
+    //! index of the next sample to process
+    unsigned long long next(void) const
+    {
+        return _next;
+    }
+
+    void reset(void);
+
+private:
+    struct Burst
+    {
+        unsigned long long start; //next sample to read
+        unsigned long long end; //valid once closed, triggered bursts may end after _next
+        bool closed;
+    };
+    void _keep(const void * const *in, const size_t n);
+    void _detect(const size_t n);
+    void _advance(const size_t n);
+    const size_t _numChans;
+    const size_t _elemSize;
+    const double _thresholdSum; //threshold times the window
+    const size_t _pre;
+    const size_t _post;
+    const size_t _delay;
+    std::vector<float> _power; //highest channel power of each sample of one process() call
+    std::vector<float> _recent; //powers of the last window
+    size_t _recentPos;
+    double _recentSum;
+    std::vector<std::vector<char>> _history; //per channel from _historyIndex to _next
+    unsigned long long _historyIndex;
+    unsigned long long _next;
+    unsigned long long _floor; //a burst does not start before this sample
+    bool _active;
+    unsigned long long _lastActive;
+    std::deque<Burst> _bursts;
+};
+
+/*!
+ * Overlap-save FFT correlator against known preambles. A detection is the
+ * peak of the correlation normalized by the energy of the preamble and of
+ * the samples, from 0 to 1, wherever it exceeds the threshold.
+ */
+class PreambleDetector
+{
+public:
+    struct Detection
+    {
+        unsigned long long index; //first sample of the preamble, counted from the reset
+        size_t preamble; //index in the references
+        size_t length; //of that reference
+        float peak; //normalized correlation
+        double freq; //offset in cycles per sample, estimated between the preamble halves
+    };
+
+    PreambleDetector(const std::vector<std::vector<std::complex<float>>> &refs, const float threshold);
+
+    //! longest preamble
+    size_t length(void) const
+    {
+        return _length;
+    }
+
+    //! most samples between the first sample of a preamble and the end of the call that detects it
+    size_t delay(void) const
+    {
+        return 2*_fft.size() + _length;
+    }
+
+    //! correlate n samples, detections are appended in order of index
+    void process(const std::complex<float> *in, const size_t n, std::vector<Detection> &detections);
+
+    //! the next samples do not follow the previous ones, indexes continue
+    void discontinuity(void);
+
+    void reset(void);
+
+private:
+    struct Reference
+    {
+        std::vector<std::complex<float>> samples;
+        std::vector<std::complex<float>> spectrum; //conjugate FFT, zero padded
+        double energy;
+        bool tracking; //above the threshold, looking for the peak
+        unsigned long long first; //index where the threshold was crossed
+        unsigned long long holdoff; //no detection before this index
+        Detection best;
+    };
+    void _correlate(const size_t numOut, std::vector<Detection> &detections);
+    double _offset(const Reference &ref, const std::complex<float> *x) const;
+    const float _threshold;
+    size_t _length;
+    FFT _fft;
+    std::vector<Reference> _refs;
+    std::vector<std::complex<float>> _input; //samples from _inputIndex
+    unsigned long long _inputIndex;
+    std::vector<std::complex<float>> _block, _product;
+    std::vector<double> _energy; //cumulative sample energy of the block
+};
+
+/*!
+ * Circular history of a stream for capture around a trigger. The writer
+ * thread fills it continuously and a trigger freezes the pre samples before
+ * and the post samples from the trigger time until the snapshot is read.
+ * Snapshots never span a gap in the sample times. Samples are elements of
+ * elemSize bytes, the snapshot is read in place.
+ */
+class CaptureRing
+{
+public:
+    //! rate in samples per second converts between sample counts and times
+    CaptureRing(const size_t numChans, const size_t elemSize, const size_t pre, const size_t post, const double rate);
+
+    //! append n samples of each channel starting at timeNs, dropped while a snapshot is held
+    void write(const void * const *in, const size_t n, const long long timeNs);
+
+    //! snapshot around the newest sample, false when a snapshot is pending already
+    bool trigger(void);
+
+    //! snapshot around the sample at timeNs, false when pending already or not in the history
+    bool trigger(const long long timeNs);
+
+    //! wait until a snapshot is complete, false on timeout
+    bool wait(const long timeoutUs);
+
+    /*!
+     * Point out at the contiguous snapshot samples from the read position, at most n.
+     * timeNs is the time of the first one, end marks the last samples of the snapshot.
+     */
+    size_t peek(const void **out, const size_t n, long long &timeNs, bool &end) const;
+
+    //! advance the read position, the history restarts after the last snapshot sample
+    void consume(const size_t n);
+
+    //! capturing, triggered or ready
+    std::string state(void) const;
+
+    size_t numChans(void) const
+    {
+        return _numChans;
+    }
+
+    size_t elemSize(void) const
+    {
+        return _elemSize;
+    }
+
+private:
+    enum State {CAPTURING, TRIGGERED, READY};
+    bool _trigger(const unsigned long long index);
+    const size_t _numChans;
+    const size_t _elemSize;
+    const size_t _pre;
+    const size_t _post;
+    const size_t _capacity;
+    const double _rate;
+    mutable std::mutex _mutex;
+    std::condition_variable _cond;
+    std::vector<std::vector<char>> _ring;
+    State _state;
+    unsigned long long _next; //index of the next sample written
+    unsigned long long _floor; //the history starts here after a gap or a snapshot
+    unsigned long long _runIndex; //first sample of the current gapless run
+    long long _runNs;
+    bool _running;
+    unsigned long long _start, _end; //snapshot samples
+    unsigned long long _read;
+    long long _startNs;
+};
@@ -0,0 +1,383 @@
+/*
+ * This file is part of the bladeRF project:
+ *   http://www.github.com/nuand/bladeRF
+ *
+ * Copyright (C) 2015-2018 Josh Blum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "bladeRF_SoapySDR.hpp"
+#include <SoapySDR/Logger.hpp>
+#include <algorithm> //stable_sort
+#include <stdexcept>
+#include <cctype>
+#include <cstring> //strchr
+#include <cmath>
+
+/*******************************************************************
+ * Profile parsing
+ ******************************************************************/
+
+//! apply order of the device wide settings, channel settings go in between
+static int deviceSettingOrder(const std::string &key)
+{
+    if (key == "xb200") return 0;
+    if (key == "sampling_mode") return 1;
+    if (key == "loopback") return 2;
+    if (key == "biastee_rx" or key == "biastee_tx") return 10;
+    return -1;
+}
+
+//! apply order of the channel settings: the gain range follows the band and the gain follows the mode
+static int channelSettingOrder(const std::string &param)
+{
+    if (param == "rate") return 3;
+    if (param == "bandwidth") return 4;
+    if (param == "frequency") return 5;
+    if (param == "agc") return 6;
+    if (param == "gain") return 7;
+    return -1;
+}
+
+static double toNumber(const std::string &key, const std::string &value)
+{
+    size_t pos(0);
+    double number(0.0);
+    try
+    {
+        number = std::stod(value, &pos);
+    }
+    catch (const std::exception &)
+    {
+        pos = 0;
+    }
+    if (pos == 0 or pos != value.size() or not std::isfinite(number))
+    {
+        throw std::runtime_error("profile " + key + "=" + value + " is not a number");
+    }
+    return number;
+}
+
+/*!
+ * Parse a flat JSON object of string, number and boolean members.
+ * Values are returned in their text form, in document order.
+ */
+static std::vector<std::pair<std::string, std::string>> parseJsonObject(const std::string &json)
+{
+    size_t pos(0);
+    const auto fail = [&pos](const std::string &what)
+    {
+        throw std::runtime_error("profile JSON " + what + " at offset " + std::to_string(pos));
+    };
+    const auto skipSpace = [&json, &pos](void)
+    {
+        while (pos < json.size() and std::isspace((unsigned char)json[pos])) pos++;
+    };
+    const auto parseString = [&json, &pos, &fail](void)
+    {
+        std::string out;
+        if (json[pos++] != '"') fail("expected string");
+        while (pos < json.size() and json[pos] != '"')
+        {
+            char c = json[pos++];
+            if (c == '\\')
+            {
+                if (pos == json.size()) break;
+                c = json[pos++];
+                if (c == 'n') c = '\n';
+                else if (c == 't') c = '\t';
+                else if (c != '"' and c != '\\' and c != '/') fail("unsupported escape");
+            }
+            out.push_back(c);
+        }
+        if (pos == json.size()) fail("unterminated string");
+        pos++;
+        return out;
+    };
+
+    std::vector<std::pair<std::string, std::string>> members;
+    skipSpace();
+    if (pos == json.size() or json[pos] != '{') fail("expected object");
+    pos++;
+    skipSpace();
+    if (pos < json.size() and json[pos] == '}') pos++;
+    else while (true)
+    {
+        skipSpace();
+        if (pos == json.size()) fail("unterminated object");
+        const std::string key = parseString();
+        skipSpace();
+        if (pos == json.size() or json[pos] != ':') fail("expected ':'");
+        pos++;
+        skipSpace();
+        if (pos == json.size()) fail("expected value");
+
+        std::string value;
+        if (json[pos] == '"') value = parseString();
+        else
+        {
+            const size_t start = pos;
+            while (pos < json.size() and (std::isalnum((unsigned char)json[pos]) or std::strchr("+-.", json[pos]) != nullptr)) pos++;
+            value = json.substr(start, pos-start);
+            if (value.empty() or value == "null") fail("expected value");
+        }
+        for (const auto &member : members)
+        {
+            if (member.first == key) fail("duplicate key " + key);
+        }
+        members.emplace_back(key, value);
+
+        skipSpace();
+        if (pos < json.size() and json[pos] == ',') {pos++; continue;}
+        if (pos < json.size() and json[pos] == '}') {pos++; break;}
+        fail("expected ',' or '}'");
+    }
+    skipSpace();
+    if (pos != json.size()) fail("trailing characters");
+    return members;
+}
+
+std::vector<ProfileStep> bladeRF_SoapySDR::parseProfile(const std::string &json, std::string &name) const
+{
+    const auto settingInfo = this->getSettingInfo();
+    bool xb200Enabled = _xb200Mode != "disabled";
+
+    std::vector<ProfileStep> steps;
+    for (const auto &member : parseJsonObject(json))
+    {
+        const std::string &key = member.first;
+        const std::string &value = member.second;
+        if (key == "name")
+        {
+            name = value;
+            continue;
+        }
+
+        ProfileStep step;
+        step.key = key;
+        step.value = value;
+        step.direction = SOAPY_SDR_RX;
+        step.channel = 0;
+        step.order = deviceSettingOrder(key);
+
+        //device wide settings must be one of the listed options
+        if (step.order >= 0)
+        {
+            auto info = std::find_if(settingInfo.begin(), settingInfo.end(), [&key](const SoapySDR::ArgInfo &i){return i.key == key;});
+            if (info == settingInfo.end()) throw std::runtime_error("profile " + key + " is not supported by this device");
+            if (not info->options.empty() and std::find(info->options.begin(), info->options.end(), value) == info->options.end())
+            {
+                throw std::runtime_error("profile " + key + "=" + value + " is not a valid option");
+            }
+            if (key == "xb200") xb200Enabled = value != "disabled";
+            steps.push_back(step);
+            continue;
+        }
+
+        //channel settings are named rx_<param>, tx_<param> or with a channel number rxN_<param>
+        const size_t sep = key.find('_');
+        const std::string prefix = key.substr(0, 2);
+        if (sep == std::string::npos or (prefix != "rx" and prefix != "tx"))
+        {
+            throw std::runtime_error("profile " + key + " unknown key");
+        }
+        step.direction = (prefix == "rx")?SOAPY_SDR_RX:SOAPY_SDR_TX;
+        if (sep > 2)
+        {
+            const std::string digits = key.substr(2, sep-2);
+            if (digits.find_first_not_of("0123456789") != std::string::npos) throw std::runtime_error("profile " + key + " unknown key");
+            step.channel = std::stoul(digits);
+        }
+        if (step.channel >= this->getNumChannels(step.direction))
+        {
+            throw std::runtime_error("profile " + key + " channel " + std::to_string(step.channel) + " does not exist");
+        }
+        step.key = key.substr(sep+1);
+        step.order = channelSettingOrder(step.key);
+        if (step.order < 0) throw std::runtime_error("profile " + key + " unknown key");
+
+        if (step.key == "agc")
+        {
+            if (value != "true" and value != "false") throw std::runtime_error("profile " + key + "=" + value + " is not a boolean");
+            if (value == "true" and not this->hasGainMode(step.direction, step.channel))
+            {
+                throw std::runtime_error("profile " + key + " automatic gain is not supported");
+            }
+        }
+        else
+        {
+            const double number = toNumber(key, value);
+            if (step.key == "rate")
+            {
+                const auto ranges = this->getSampleRateRange(step.direction, step.channel);
+                if (number < ranges.front().minimum() or number > ranges.back().maximum())
+                {
+                    throw std::runtime_error("profile " + key + "=" + value + " is out of range");
+                }
+            }
+            if (step.key == "bandwidth" and number <= 0.0)
+            {
+                throw std::runtime_error("profile " + key + "=" + value + " is out of range");
+            }
+        }
+        steps.push_back(step);
+    }
+
+    //the frequency range is only known once the final xb200 state is,
+    //the transverter extends it below the range probed at open
+    if (not xb200Enabled) for (const auto &step : steps)
+    {
+        if (step.key != "frequency") continue;
+        const auto ranges = this->getFrequencyRange(step.direction, step.channel, "RF");
+        const double number = std::stod(step.value);
+        if (number < ranges.front().minimum() or number > ranges.back().maximum())
+        {
+            throw std::runtime_error("profile frequency " + step.value + " is out of range");
+        }
+    }
+
+    std::stable_sort(steps.begin(), steps.end(), [](const ProfileStep &a, const ProfileStep &b)
+    {
+        if (a.order != b.order) return a.order < b.order;
+        if (a.direction != b.direction) return a.direction < b.direction;
+        return a.channel < b.channel;
+    });
+    return steps;
+}
+
+/*******************************************************************
+ * Profile API
+ ******************************************************************/
+
+bool bladeRF_SoapySDR::isProfileKey(const std::string &key)
+{
+    if (deviceSettingOrder(key) >= 0) return true;
+
+    //rx_<param>, tx_<param>, rxN_<param> or txN_<param>
+    const size_t sep = key.find('_');
+    const std::string prefix = key.substr(0, 2);
+    if (sep == std::string::npos or (prefix != "rx" and prefix != "tx")) return false;
+    if (key.substr(2, sep-2).find_first_not_of("0123456789") != std::string::npos) return false;
+    return channelSettingOrder(key.substr(sep+1)) >= 0;
+}
+
+void bladeRF_SoapySDR::storeProfile(const std::string &json)
+{
+    std::string name;
+    auto steps = this->parseProfile(json, name);
+    if (name.empty()) throw std::runtime_error("storeProfile() requires a \"name\" member");
+    if (name.find_first_of("{,") != std::string::npos) throw std::runtime_error("storeProfile() invalid name " + name);
+    _profiles[name] = std::move(steps);
+}
+
+void bladeRF_SoapySDR::applyProfile(const std::string &value)
+{
+    //a JSON object is validated and applied once, anything else names a stored profile
+    std::string name;
+    std::vector<ProfileStep> parsed;
+    const std::vector<ProfileStep> *steps(nullptr);
+    if (value.find('{') != std::string::npos)
+    {
+        parsed = this->parseProfile(value, name);
+        steps = &parsed;
+    }
+    else
+    {
+        auto it = _profiles.find(value);
+        if (it == _profiles.end()) throw std::runtime_error("applyProfile() unknown profile " + value);
+        name = value;
+        steps = &it->second;
+    }
+
+    //a step writes its value, the same write restores the value read before it
+    const auto readStep = [this](const ProfileStep &step) -> std::string
+    {
+        if (step.order == deviceSettingOrder(step.key)) return this->readSetting(step.key);
+        if (step.key == "agc") return std::string(this->getGainMode(step.direction, step.channel)?"true":"false");
+        double current(0.0);
+        if (step.key == "rate") current = this->getSampleRate(step.direction, step.channel);
+        if (step.key == "bandwidth") current = this->getBandwidth(step.direction, step.channel);
+        if (step.key == "frequency") current = this->getFrequency(step.direction, step.channel, "RF");
+        if (step.key == "gain") current = this->getGain(step.direction, step.channel);
+        return std::to_string(current);
+    };
+    const auto writeStep = [this](const ProfileStep &step, const std::string &value)
+    {
+        if (step.order == deviceSettingOrder(step.key)) return this->writeSetting(step.key, value);
+        if (step.key == "agc") return this->setGainMode(step.direction, step.channel, value == "true");
+        const double number = std::stod(value);
+        if (step.key == "rate") this->setSampleRate(step.direction, step.channel, number);
+        if (step.key == "bandwidth") this->setBandwidth(step.direction, step.channel, number);
+        if (step.key == "frequency") this->setFrequency(step.direction, step.channel, "RF", number, SoapySDR::Kwargs());
+        if (step.key == "gain") this->setGain(step.direction, step.channel, number);
+    };
+
+    std::vector<std::pair<const ProfileStep *, std::string>> undo;
+    for (const auto &step : *steps)
+    {
+        const int direction = step.direction;
+        const size_t channel = step.channel;
+        try
+        {
+            if (step.order == deviceSettingOrder(step.key))
+            {
+                if (this->readSetting(step.key) == step.value) continue;
+            }
+            else if (step.key == "agc")
+            {
+                bool current(false);
+                if (this->readShadow(&ChannelShadow::gainMode, direction, channel, current) and current == (step.value == "true")) continue;
+            }
+            else
+            {
+                const double number = std::stod(step.value);
+                double current(0.0);
+                if (step.key == "rate" and this->readShadow(&ChannelShadow::sampleRate, direction, channel, current) and std::abs(current - number) < 1e-3) continue;
+                if (step.key == "bandwidth" and this->readShadow(&ChannelShadow::bandwidth, direction, channel, current) and std::abs(current - number) < 1.0) continue;
+                if (step.key == "frequency" and this->readShadow(&ChannelShadow::frequency, direction, channel, current) and current == std::round(number)) continue;
+                if (step.key == "gain" and this->readShadow(&ChannelShadow::gain, direction, channel, current) and current == std::round(number)) continue;
+            }
+            undo.emplace_back(&step, readStep(step));
+            writeStep(step, step.value);
+        }
+        catch (const std::exception &ex)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "applyProfile(%s) failed at %s=%s, restoring %d changes: %s",
+                name.c_str(), step.key.c_str(), step.value.c_str(), int(undo.size()), ex.what());
+
+            //restore in reverse so that each value is written back under the routing it was read with,
+            //the failed step is restored too since it may have been partially applied
+            for (auto it = undo.rbegin(); it != undo.rend(); ++it)
+            {
+                try
+                {
+                    writeStep(*it->first, it->second);
+                }
+                catch (const std::exception &restoreEx)
+                {
+                    SoapySDR::logf(SOAPY_SDR_ERROR, "applyProfile(%s) cannot restore %s=%s: %s",
+                        name.c_str(), it->first->key.c_str(), it->second.c_str(), restoreEx.what());
+                }
+            }
+            throw std::runtime_error("applyProfile() " + step.key + "=" + step.value + " " + ex.what());
+        }
+    }
+    const size_t changed = undo.size();
+
+    _activeProfile = name;
+    SoapySDR::logf(SOAPY_SDR_INFO, "applyProfile(%s) %d changed, %d unchanged",
+        name.c_str(), int(changed), int(steps->size() - changed));
+}
@@ -0,0 +1,317 @@
+/*
+ * This file is part of the bladeRF project:
+ *   http://www.github.com/nuand/bladeRF
+ *
+ * Copyright (C) 2015-2022 Josh Blum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "bladeRF_Recorder.hpp"
+#include <SoapySDR/Logger.hpp>
+#include <algorithm> //min
+#include <stdexcept>
+#include <sstream>
+#include <iomanip>
+#include <cmath> //llround
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define RECORD_CHUNK_BYTES (4 << 20) //size of the disk writes
+#define RECORD_MAX_CHUNKS 64 //queued chunks before blocks are dropped
+
+SigMFRecorder::SigMFRecorder(const std::string &path, const size_t numChans, const double rate, const unsigned long long rotateElems, const std::string &hardware):
+    _path(path),
+    _numChans(numChans),
+    _rate(rate),
+    _rotateElems(rotateElems),
+    _hardware(hardware),
+    _file(0),
+    _fileElems(0),
+    _nextTicks(0),
+    _dropped(0),
+    _done(false)
+{
+    //fail at setup rather than in the writer thread
+    std::FILE *file = std::fopen(this->_fileName(0, ".sigmf-data").c_str(), "wb");
+    if (file == nullptr) throw std::runtime_error("cannot create " + this->_fileName(0, ".sigmf-data"));
+    std::fclose(file);
+
+    _chunk.file = 0;
+    _chunk.data.reserve(RECORD_CHUNK_BYTES);
+    _thread = std::thread(&SigMFRecorder::_work, this);
+}
+
+SigMFRecorder::~SigMFRecorder(void)
+{
+    this->_closeFile();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+    if (_dropped != 0) SoapySDR::logf(SOAPY_SDR_WARNING, "SigMF recorder dropped %llu samples", _dropped);
+}
+
+std::string SigMFRecorder::_fileName(const size_t file, const std::string &extension) const
+{
+    if (_rotateElems == 0) return _path + extension;
+    std::ostringstream name;
+    name << _path << "-" << std::setw(4) << std::setfill('0') << file << extension;
+    return name.str();
+}
+
+void SigMFRecorder::write(const int16_t *samples, const size_t n, const long long ticks, const long long timeNs, const double frequency, const double gain)
+{
+    //the disk fell behind, the next block starts a capture after the gap
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_queue.size() >= RECORD_MAX_CHUNKS)
+        {
+            if (_dropped == 0) SoapySDR::log(SOAPY_SDR_WARNING, "SigMF recorder cannot keep up, dropping samples");
+            _dropped += n;
+            return;
+        }
+    }
+
+    const bool retuned = _captures.empty() or _captures.back().frequency != frequency or _captures.back().gain != gain;
+    const bool gap = not _captures.empty() and ticks != _nextTicks;
+    if (_captures.empty() or retuned or gap)
+    {
+        Capture capture;
+        capture.sampleStart = _fileElems;
+        capture.ticks = ticks;
+        capture.timeNs = timeNs;
+        capture.frequency = frequency;
+        capture.gain = gain;
+        capture.missing = (gap and ticks > _nextTicks)?(unsigned long long)(ticks - _nextTicks):0;
+        _captures.push_back(capture);
+    }
+
+    const size_t elemBytes = 2*sizeof(int16_t)*_numChans;
+    for (size_t done = 0; done < n;)
+    {
+        const size_t count = (_rotateElems == 0)?(n - done):size_t(std::min<unsigned long long>(n - done, _rotateElems - _fileElems));
+        const char *bytes = reinterpret_cast<const char *>(samples) + done*elemBytes;
+        for (size_t copied = 0; copied < count*elemBytes;)
+        {
+            const size_t take = std::min(count*elemBytes - copied, RECORD_CHUNK_BYTES - _chunk.data.size());
+            _chunk.data.insert(_chunk.data.end(), bytes + copied, bytes + copied + take);
+            copied += take;
+            if (_chunk.data.size() == RECORD_CHUNK_BYTES) this->_flush();
+        }
+        done += count;
+        _fileElems += count;
+
+        //the next recording continues with the current tuning
+        if (_rotateElems != 0 and _fileElems == _rotateElems)
+        {
+            this->_closeFile();
+            _file++;
+            _fileElems = 0;
+            _chunk.file = _file;
+            Capture capture;
+            capture.sampleStart = 0;
+            capture.ticks = ticks + (long long)(done);
+            capture.timeNs = timeNs + std::llround(done*1e9/_rate);
+            capture.frequency = frequency;
+            capture.gain = gain;
+            capture.missing = 0;
+            _captures.push_back(capture);
+        }
+    }
+    _nextTicks = ticks + (long long)(n);
+}
+
+void SigMFRecorder::_flush(void)
+{
+    if (_chunk.data.empty() and _chunk.meta.empty()) return;
+    Chunk next;
+    next.file = _chunk.file;
+    next.data.reserve(RECORD_CHUNK_BYTES);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(std::move(_chunk));
+    }
+    _cond.notify_one();
+    _chunk = std::move(next);
+}
+
+void SigMFRecorder::_closeFile(void)
+{
+    //a capture starting at the end of the file has no samples,
+    //a rotated recording without samples was never created
+    if (not _captures.empty() and _captures.back().sampleStart == _fileElems and _fileElems != 0) _captures.pop_back();
+    if (_file == 0 or _fileElems != 0) _chunk.meta = this->_meta();
+    this->_flush();
+    _captures.clear();
+}
+
+std::string SigMFRecorder::_meta(void) const
+{
+    std::ostringstream json;
+    json << std::setprecision(17);
+    json << "{\n";
+    json << "    \"global\": {\n";
+    json << "        \"core:datatype\": \"ci16_le\",\n";
+    json << "        \"core:sample_rate\": " << _rate << ",\n";
+    json << "        \"core:num_channels\": " << _numChans << ",\n";
+    json << "        \"core:version\": \"1.0.0\",\n";
+    json << "        \"core:hw\": \"" << _hardware << "\",\n";
+    json << "        \"core:recorder\": \"SoapyBladeRF\",\n";
+    json << "        \"core:extensions\": [{\"name\": \"bladerf\", \"version\": \"1.0.0\", \"optional\": true}],\n";
+    json << "        \"bladerf:full_scale\": 2048\n";
+    json << "    },\n";
+
+    //the hardware tick counter is the global index, a gap is a jump in it
+    json << "    \"captures\": [";
+    for (size_t i = 0; i < _captures.size(); i++)
+    {
+        const Capture &capture = _captures[i];
+        json << ((i == 0)?"\n":",\n");
+        json << "        {\"core:sample_start\": " << capture.sampleStart;
+        json << ", \"core:global_index\": " << capture.ticks;
+        json << ", \"core:frequency\": " << capture.frequency;
+        json << ", \"bladerf:time_ns\": " << capture.timeNs;
+        json << ", \"bladerf:gain\": " << capture.gain << "}";
+    }
+    json << "\n    ],\n";
+
+    json << "    \"annotations\": [";
+    bool first(true);
+    for (const auto &capture : _captures)
+    {
+        if (capture.missing == 0) continue;
+        json << (first?"\n":",\n");
+        json << "        {\"core:sample_start\": " << capture.sampleStart;
+        json << ", \"core:sample_count\": 0";
+        json << ", \"core:comment\": \"gap of " << capture.missing << " samples\"}";
+        first = false;
+    }
+    json << "\n    ]\n";
+    json << "}\n";
+    return json.str();
+}
+
+void SigMFRecorder::_work(void)
+{
+    //stdio buffering is off, every chunk goes to the file in one large write
+    std::FILE *data(nullptr);
+    size_t open(0);
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _cond.wait(lock, [this]{return _done or not _queue.empty();});
+        if (_queue.empty()) break;
+        Chunk chunk = std::move(_queue.front());
+        _queue.pop_front();
+        lock.unlock();
+
+        if (data != nullptr and open != chunk.file)
+        {
+            std::fclose(data);
+            data = nullptr;
+        }
+        if (data == nullptr and not chunk.data.empty())
+        {
+            data = std::fopen(this->_fileName(chunk.file, ".sigmf-data").c_str(), (chunk.file == 0)?"ab":"wb");
+            if (data == nullptr) SoapySDR::logf(SOAPY_SDR_ERROR, "SigMF recorder cannot open %s", this->_fileName(chunk.file, ".sigmf-data").c_str());
+            else std::setvbuf(data, nullptr, _IONBF, 0);
+            open = chunk.file;
+        }
+        if (data != nullptr and std::fwrite(chunk.data.data(), 1, chunk.data.size(), data) != chunk.data.size())
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "SigMF recorder write failed on %s", this->_fileName(chunk.file, ".sigmf-data").c_str());
+        }
+        if (not chunk.meta.empty())
+        {
+            std::FILE *meta = std::fopen(this->_fileName(chunk.file, ".sigmf-meta").c_str(), "w");
+            if (meta != nullptr) std::fputs(chunk.meta.c_str(), meta);
+            if (meta != nullptr) std::fclose(meta);
+            else SoapySDR::logf(SOAPY_SDR_ERROR, "SigMF recorder cannot write %s", this->_fileName(chunk.file, ".sigmf-meta").c_str());
+        }
+        lock.lock();
+    }
+    if (data != nullptr) std::fclose(data);
+}
+
+/***********************************************************************
+ * Mapped file
+ **********************************************************************/
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &path):
+    _data(nullptr),
+    _size(0),
+    _mapping(nullptr)
+{
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("cannot open " + path);
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) and size.QuadPart > 0) _mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (_mapping == nullptr) throw std::runtime_error("cannot map " + path);
+    _data = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (_data == nullptr)
+    {
+        CloseHandle(_mapping);
+        throw std::runtime_error("cannot map " + path);
+    }
+    _size = size_t(size.QuadPart);
+}
+
+MappedFile::~MappedFile(void)
+{
+    UnmapViewOfFile(_data);
+    CloseHandle(_mapping);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &path):
+    _data(nullptr),
+    _size(0),
+    _mapping(nullptr)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open " + path);
+    struct stat info;
+    if (fstat(fd, &info) == 0 and info.st_size > 0)
+    {
+        _size = size_t(info.st_size);
+        _data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd); //the mapping keeps the file
+    if (_data == nullptr or _data == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+
+    //the replay reads the pages once in order
+    madvise(_data, _size, MADV_SEQUENTIAL);
+    madvise(_data, _size, MADV_WILLNEED);
+}
+
+MappedFile::~MappedFile(void)
+{
+    munmap(_data, _size);
+}
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * This file is part of the bladeRF project:
+ *   http://www.github.com/nuand/bladeRF
+ *
+ * Copyright (C) 2015-2022 Josh Blum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+/*!
+ * Records the rx wire format samples to SigMF recordings.
+ * The reading thread copies each block into large chunks that a writer
+ * thread puts on disk, so a slow disk drops whole blocks instead of
+ * stalling the stream. A recording is a .sigmf-data file of interleaved
+ * ci16_le channels and a .sigmf-meta file with a capture segment for every
+ * tuning change and gap, gaps are also annotated.
+ */
+class SigMFRecorder
+{
+public:
+    /*!
+     * path is the recording name without extension, rotateElems starts a new
+     * numbered recording after that many samples, 0 keeps one recording.
+     * hardware describes the device in the metadata.
+     */
+    SigMFRecorder(const std::string &path, const size_t numChans, const double rate, const unsigned long long rotateElems, const std::string &hardware);
+
+    //! writes the queued chunks and the metadata of the last recording
+    ~SigMFRecorder(void);
+
+    /*!
+     * Record n samples of interleaved channels, ticks is the hardware time of
+     * the first one. frequency and gain describe the channels when recorded.
+     */
+    void write(const int16_t *samples, const size_t n, const long long ticks, const long long timeNs, const double frequency, const double gain);
+
+    //! samples dropped because the disk did not keep up
+    unsigned long long dropped(void) const
+    {
+        return _dropped;
+    }
+
+private:
+    struct Capture
+    {
+        unsigned long long sampleStart;
+        long long ticks;
+        long long timeNs;
+        double frequency;
+        double gain;
+        unsigned long long missing; //samples lost before this capture
+    };
+
+    struct Chunk
+    {
+        size_t file;
+        std::vector<char> data;
+        std::string meta; //written after the data of the file
+    };
+
+    std::string _fileName(const size_t file, const std::string &extension) const;
+    std::string _meta(void) const;
+    void _flush(void);
+    void _closeFile(void);
+    void _work(void);
+
+    const std::string _path;
+    const size_t _numChans;
+    const double _rate;
+    const unsigned long long _rotateElems;
+    const std::string _hardware;
+
+    //reading thread state
+    size_t _file;
+    unsigned long long _fileElems;
+    long long _nextTicks;
+    std::vector<Capture> _captures;
+    Chunk _chunk;
+    unsigned long long _dropped;
+
+    //handed to the writer thread
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Chunk> _queue;
+    bool _done;
+    std::thread _thread;
+};
+
+/*!
+ * A recording mapped read only into memory, the samples are handed to
+ * libbladeRF straight from the pages of the file.
+ */
+class MappedFile
+{
+public:
+    //! maps the whole file, throws when it cannot be opened or is empty
+    MappedFile(const std::string &path);
+
+    ~MappedFile(void);
+
+    const void *data(void) const
+    {
+        return _data;
+    }
+
+    size_t size(void) const
+    {
+        return _size;
+    }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    void *_data;
+    size_t _size;
+    void *_mapping; //file mapping handle on windows
+};
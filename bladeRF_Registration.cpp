@@ -21,10 +21,27 @@
 
 #include <SoapySDR/Registry.hpp>
 #include "bladeRF_SoapySDR.hpp"
+#include "bladeRF_Aggregate.hpp"
 #include <cstdio>
 #include <sstream>
 #include <cstdlib>
 #include <cstring>
+#include <chrono>
+#include <mutex>
+#include <future>
+
+/*!
+ * Discovery results are reused for a short time so that a find
+ * followed by several makes (one per radio) only probes the bus once.
+ * The cache is shared between threads, SoapySDR::Device::make() with a
+ * list of args calls make_bladeRF() concurrently for each device.
+ */
+#define ENUM_CACHE_TTL_MS 2000
+
+static std::mutex enumCacheMutex;
+static std::chrono::steady_clock::time_point enumCacheTime;
+static std::vector<bladerf_devinfo> enumCache;
+static bool enumCacheValid = false;
 
 static SoapySDR::Kwargs devinfo_to_kwargs(const bladerf_devinfo &info)
 {
@@ -79,39 +96,178 @@ static bladerf_devinfo kwargs_to_devinfo(const SoapySDR::Kwargs &args)
     return info;
 }
 
+static std::vector<bladerf_devinfo> get_device_list(void)
+{
+    std::lock_guard<std::mutex> lock(enumCacheMutex);
+
+    const auto now = std::chrono::steady_clock::now();
+    if (enumCacheValid and now < enumCacheTime + std::chrono::milliseconds(ENUM_CACHE_TTL_MS)) return enumCache;
+
+    bladerf_devinfo *infos = NULL;
+    const int ret = bladerf_get_device_list(&infos);
+
+    enumCache.clear();
+    for (int i = 0; i < ret; i++) enumCache.push_back(infos[i]);
+    if (infos != NULL) bladerf_free_device_list(infos);
+
+    //dont hold on to an empty result, the device may still be enumerating
+    enumCacheValid = not enumCache.empty();
+    enumCacheTime = now;
+    return enumCache;
+}
+
+static void invalidate_device_list(void)
+{
+    std::lock_guard<std::mutex> lock(enumCacheMutex);
+    enumCacheValid = false;
+}
+
 static std::vector<SoapySDR::Kwargs> find_bladeRF(const SoapySDR::Kwargs &matchArgs)
 {
     const bladerf_devinfo matchinfo = kwargs_to_devinfo(matchArgs);
 
     std::vector<SoapySDR::Kwargs> results;
-    bladerf_devinfo *infos = NULL;
-    int ret = 0;
-    ret = bladerf_get_device_list(&infos);
-
-    for (int i = 0; i < ret; i++)
+    for (const auto &info : get_device_list())
     {
-        if (bladerf_devinfo_matches(infos+i, &matchinfo))
+        if (bladerf_devinfo_matches(&info, &matchinfo))
         {
-            results.push_back(devinfo_to_kwargs(infos[i]));
+            results.push_back(devinfo_to_kwargs(info));
         }
     }
 
-    bladerf_free_device_list(infos);
     return results;
 }
 
 static SoapySDR::Device *make_bladeRF(const SoapySDR::Kwargs &args)
 {
-    SoapySDR::Device *bladerf = new bladeRF_SoapySDR(kwargs_to_devinfo(args));
+    //args from find_bladeRF() carry the full serial, use the enumerated info as-is
+    bladerf_devinfo devinfo = kwargs_to_devinfo(args);
+    if (args.count("serial") != 0 and args.at("serial").size() == BLADERF_SERIAL_LENGTH-1)
+    {
+        for (const auto &info : get_device_list())
+        {
+            if (args.at("serial") == info.serial) devinfo = info;
+        }
+    }
+
+    //init=lazy skips programming the default rates at open
+    const bool lazyInit = args.count("init") != 0 and args.at("init") == "lazy";
+
+    bladeRF_SoapySDR *bladerf(nullptr);
+    try
+    {
+        bladerf = new bladeRF_SoapySDR(devinfo, lazyInit);
+    }
+    catch (const std::exception &)
+    {
+        //the device may have gone away since it was listed
+        invalidate_device_list();
+        throw;
+    }
 
-    //apply applicable settings found in args
+    //gather applicable settings found in args, then apply them in setting info order
+    std::vector<std::pair<std::string, std::string>> settings;
     for (const auto &info : bladerf->getSettingInfo())
     {
-        if (args.count(info.key) == 0) continue;
-        bladerf->writeSetting(info.key, args.at(info.key));
+        if (args.count(info.key) == 0 or bladeRF_SoapySDR::isProfileKey(info.key)) continue;
+        settings.emplace_back(info.key, args.at(info.key));
+    }
+
+    //the routing and channel args (xb200, rx_frequency...) go last as one profile,
+    //so they are validated together and applied in dependency order
+    std::string profile;
+    for (const auto &arg : args)
+    {
+        if (not bladeRF_SoapySDR::isProfileKey(arg.first)) continue;
+        std::string value;
+        for (const char c : arg.second)
+        {
+            if (c == '"' or c == '\\') value.push_back('\\');
+            value.push_back(c);
+        }
+        profile += std::string(profile.empty()?"{":",") + "\"" + arg.first + "\":\"" + value + "\"";
+    }
+    if (not profile.empty()) settings.emplace_back("profile", profile + "}");
+
+    try
+    {
+        for (const auto &setting : settings) bladerf->writeSetting(setting.first, setting.second);
+    }
+    catch (const std::exception &)
+    {
+        delete bladerf;
+        throw;
     }
 
     return bladerf;
 }
 
 static SoapySDR::Registry register__bladeRF("bladerf", &find_bladeRF, &make_bladeRF, SOAPY_SDR_ABI_VERSION);
+
+/***********************************************************************
+ * Aggregate of several boards: driver=bladerf_array,serials=<s0>,<s1>,...
+ **********************************************************************/
+
+static std::vector<std::string> split_serials(const SoapySDR::Kwargs &args)
+{
+    std::vector<std::string> serials;
+    if (args.count("serials") == 0) return serials;
+    std::stringstream ss(args.at("serials"));
+    std::string serial;
+    while (std::getline(ss, serial, ',')) if (not serial.empty()) serials.push_back(serial);
+    return serials;
+}
+
+static std::vector<SoapySDR::Kwargs> find_bladeRF_array(const SoapySDR::Kwargs &matchArgs)
+{
+    //an array is only listed when asked for, with every board present
+    const auto serials = split_serials(matchArgs);
+    if (serials.empty()) return {};
+
+    for (const auto &serial : serials)
+    {
+        SoapySDR::Kwargs boardArgs;
+        boardArgs["serial"] = serial;
+        if (find_bladeRF(boardArgs).size() != 1) return {};
+    }
+
+    SoapySDR::Kwargs args;
+    args["serials"] = matchArgs.at("serials");
+    args["label"] = "BladeRF array [" + std::to_string(serials.size()) + " boards]";
+    return {args};
+}
+
+static SoapySDR::Device *make_bladeRF_array(const SoapySDR::Kwargs &args)
+{
+    const auto serials = split_serials(args);
+    if (serials.empty()) throw std::runtime_error("bladerf_array requires serials=<serial>,<serial>,...");
+
+    //open the boards concurrently, the other args apply to each of them
+    std::vector<std::future<SoapySDR::Device *>> opens;
+    for (const auto &serial : serials)
+    {
+        SoapySDR::Kwargs boardArgs(args);
+        boardArgs.erase("serials");
+        boardArgs["serial"] = serial;
+        opens.push_back(std::async(std::launch::async, &make_bladeRF, boardArgs));
+    }
+
+    std::vector<std::unique_ptr<SoapySDR::Device>> boards;
+    std::string error;
+    for (auto &open : opens)
+    {
+        try
+        {
+            boards.emplace_back(open.get());
+        }
+        catch (const std::exception &ex)
+        {
+            if (error.empty()) error = ex.what();
+        }
+    }
+    if (not error.empty()) throw std::runtime_error("bladerf_array open failed: " + error);
+
+    return new bladeRF_Aggregate(std::move(boards));
+}
+
+static SoapySDR::Registry register__bladeRF_array("bladerf_array", &find_bladeRF_array, &make_bladeRF_array, SOAPY_SDR_ABI_VERSION);
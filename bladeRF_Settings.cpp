@@ -24,7 +24,21 @@
 #include <algorithm> //find
 #include <stdexcept>
 #include <cstdio>
+#include <cstring> //memset
 #include <cmath>
+#include <chrono>
+#include <cstdlib> //getenv
+#include <fstream>
+#include <sstream>
+
+//! RFIC fastlock profiles available per direction (NUM_BBP_FASTLOCK_PROFILES)
+#define NUM_QUICK_TUNE_PROFILES 256
+
+//! pending rx retune events kept for stream tagging
+#define MAX_RETUNE_EVENTS 64
+
+//! failed hardware time reads before the next timed command is dropped, 10ms apart
+#define TIMED_CMD_TIME_RETRIES 10
 
 //! convert bladerf range to a soapysdr range
 static SoapySDR::Range toRange(const bladerf_range* range)
@@ -32,28 +46,99 @@ static SoapySDR::Range toRange(const bladerf_range* range)
     return SoapySDR::Range(range->min*range->scale, range->max*range->scale, range->step*range->scale);
 }
 
+//! FNV-1a hash of a file, returns false when it cannot be read
+static bool hashFile(const std::string &path, uint64_t &hash, size_t &size)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (not file) return false;
+
+    hash = 0xcbf29ce484222325ull;
+    size = 0;
+    char buff[1 << 16];
+    while (file)
+    {
+        file.read(buff, sizeof(buff));
+        const std::streamsize n = file.gcount();
+        for (std::streamsize i = 0; i < n; i++)
+        {
+            hash ^= uint8_t(buff[i]);
+            hash *= 0x100000001b3ull;
+        }
+        size += size_t(n);
+    }
+    return file.eof();
+}
+
+//! where the record of the last FPGA image loaded into a device is kept across processes
+static std::string fpgaRecordPath(const std::string &serial)
+{
+    const char *dir = std::getenv("XDG_CACHE_HOME");
+    std::string base = (dir != nullptr)?dir:"";
+    if (base.empty() and (dir = std::getenv("HOME")) != nullptr) base = std::string(dir) + "/.cache";
+    if (base.empty() and (dir = std::getenv("LOCALAPPDATA")) != nullptr) base = dir;
+    if (base.empty()) return "";
+    return base + "/bladeRF_SoapySDR_fpga_" + serial;
+}
+
 /*******************************************************************
  * Device init/shutdown
  ******************************************************************/
 
-bladeRF_SoapySDR::bladeRF_SoapySDR(const bladerf_devinfo &devinfo):
+bladeRF_SoapySDR::bladeRF_SoapySDR(const bladerf_devinfo &devinfo, const bool lazyInit):
     _isBladeRF1(false),
     _rxSampRate(1.0),
     _txSampRate(1.0),
+    _rxRateChanged(false),
     _inTxBurst(false),
     _rxFloats(false),
     _txFloats(false),
     _rxOverflow(false),
     _rxNextTicks(0),
     _txNextTicks(0),
-    _timeNsOffset(0),
     _rxBuffSize(0),
     _txBuffSize(0),
     _rxMinTimeoutMs(0),
+    _channelizerSize(0),
+    _channelizerOversample(false),
+    _txMeta(false),
+    _txReplayRunning(false),
+    _txReplayLoops(1),
+    _txReplayTimeNs(0),
+    _txReplayPeriod(0.0),
+    _rxSpectrumOffset(0),
+    _rxSpectrumStarted(false),
+    _rxSpectrumStartNs(0),
+    _rxSpectrumCount(0),
+    _rxPreambleGate(false),
+    _rxLastDetection(),
+    _rxRunIndex(0),
+    _rxCaptureRunning(false),
+    _rxCaptureAcquired(0),
+    _rxScanDwell(0),
+    _rxScanSettle(0),
+    _rxScanIndex(0),
+    _rxScanScheduled(0),
+    _rxScanRemaining(0),
+    _rxScanStartTicks(0),
+    _rxScanFreq(0.0),
+    _rxRetuneSettle(0),
+    _rxRetuneOffset(0),
+    _rxRetuneFreq(0.0),
+    _cmdTimeNs(0),
+    _timedCmdDone(false),
+    _rxRetuneUntil(0),
+    _txRetuneUntil(0),
     _xb200Mode("disabled"),
     _samplingMode("internal"),
     _loopbackMode("disabled"),
-    _dev(NULL)
+    _triggerRole("disabled"),
+    _triggerSync(false),
+    _triggerArmTicks(0),
+    _dev(NULL),
+    _numRxChans(0),
+    _numTxChans(0),
+    _rxQuickTunes(NUM_QUICK_TUNE_PROFILES),
+    _txQuickTunes(NUM_QUICK_TUNE_PROFILES)
 
 {
     bladerf_devinfo info = devinfo;
@@ -73,6 +158,29 @@ bladeRF_SoapySDR::bladeRF_SoapySDR(const bladerf_devinfo &devinfo):
     ret = bladerf_get_serial_struct(_dev, &serial);
     if (ret == 0) SoapySDR::logf(SOAPY_SDR_INFO, "bladerf_get_serial() = %s", serial.serial);
 
+    this->probeCapabilities();
+
+    //the exact rates start out as 1 sample per second to match the default double rates
+    _rxEpoch.ticks = 0;
+    _rxEpoch.timeNs = 0;
+    _rxEpoch.rate.integer = 1;
+    _rxEpoch.rate.num = 0;
+    _rxEpoch.rate.den = 1;
+    _rxPrevEpoch = _txEpoch = _txPrevEpoch = _rxEpoch;
+
+    //the expansion header pin used as trigger line differs between boards
+    _triggerSignal = _isBladeRF1?"J71_4":"J51_1";
+    std::memset(&_rxTrigger, 0, sizeof(_rxTrigger));
+    std::memset(&_txTrigger, 0, sizeof(_txTrigger));
+
+    //lazy init keeps whatever rate the hardware is running at
+    if (lazyInit)
+    {
+        this->adoptSampleRate(SOAPY_SDR_RX);
+        this->adoptSampleRate(SOAPY_SDR_TX);
+        return;
+    }
+
     //initialize the sample rates to something
     this->setSampleRate(SOAPY_SDR_RX, 0, 4e6);
     this->setSampleRate(SOAPY_SDR_TX, 0, 4e6);
@@ -80,10 +188,151 @@ bladeRF_SoapySDR::bladeRF_SoapySDR(const bladerf_devinfo &devinfo):
 
 bladeRF_SoapySDR::~bladeRF_SoapySDR(void)
 {
+    this->stopCapture();
+    this->stopReplay();
+
+    //stop the timed command worker, pending commands are dropped
+    if (_timedCmdThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_timedCmdMutex);
+            _timedCmdDone = true;
+        }
+        _timedCmdCond.notify_one();
+        _timedCmdThread.join();
+    }
+
     SoapySDR::logf(SOAPY_SDR_INFO, "bladerf_close()");
     if (_dev != NULL) bladerf_close(_dev);
 }
 
+void bladeRF_SoapySDR::probeCapabilities(void)
+{
+    _caps.clear();
+    _loopbackModes.clear();
+
+    _numRxChans = bladerf_get_channel_count(_dev, BLADERF_RX);
+    _numTxChans = bladerf_get_channel_count(_dev, BLADERF_TX);
+
+    for (const int direction : {SOAPY_SDR_RX, SOAPY_SDR_TX})
+    {
+        const size_t numChans = (direction == SOAPY_SDR_RX)?_numRxChans:_numTxChans;
+        for (size_t channel = 0; channel < numChans; channel++)
+        {
+            const bladerf_channel ch = _toch(direction, channel);
+            ChannelCaps &caps = _caps[std::make_pair(direction, channel)];
+            const bladerf_range* range(nullptr);
+            int ret = 0;
+
+            //automatic gain is supported when the channel lists the mode,
+            //this avoids switching the device into AGC to find out
+            const bladerf_gain_modes *modes(nullptr);
+            ret = bladerf_get_gain_modes(_dev, ch, &modes);
+            if (direction == SOAPY_SDR_RX and modes) for (int i = 0; i < ret; i++)
+            {
+                if (modes[i].mode == BLADERF_GAIN_AUTOMATIC) caps.hasGainMode = true;
+            }
+
+            //on bladeRF1 the listed mode also depends on the presence of a DC calibration LUT,
+            //so test once here if it will take automatic mode and restore the original mode
+            if (caps.hasGainMode and not _isBladeRF2)
+            {
+                bladerf_gain_mode mode;
+                caps.hasGainMode =
+                    bladerf_get_gain_mode(_dev, ch, &mode) == 0 and
+                    bladerf_set_gain_mode(_dev, ch, BLADERF_GAIN_AUTOMATIC) == 0;
+                if (caps.hasGainMode and bladerf_set_gain_mode(_dev, ch, mode) != 0)
+                {
+                    SoapySDR::logf(SOAPY_SDR_WARNING, "bladerf_set_gain_mode() could not restore the gain mode of channel %d", int(channel));
+                    this->invalidateShadow(&ChannelShadow::gainMode, direction, channel);
+                }
+            }
+
+            #define MAX_STAGES 8
+            const char *stages[MAX_STAGES];
+            ret = bladerf_get_gain_stages(_dev, ch, (const char **)&stages, MAX_STAGES);
+            if (ret < 0) SoapySDR::logf(SOAPY_SDR_WARNING, "bladerf_get_gain_stages() returned %s", _err2str(ret).c_str());
+            for (int i = 0; i < ret; i++) caps.gainStages.push_back(stages[i]);
+
+            ret = bladerf_get_frequency_range(_dev, ch, &range);
+            if (ret != 0) SoapySDR::logf(SOAPY_SDR_WARNING, "bladerf_get_frequency_range() returned %s", _err2str(ret).c_str());
+            else caps.frequencyRange.push_back(toRange(range));
+
+            //create useful ranges based on the overall range
+            //these values were suggested by the authors in the gr-osmosdr plugin for bladerf
+            ret = bladerf_get_sample_rate_range(_dev, ch, &range);
+            if (ret != 0) SoapySDR::logf(SOAPY_SDR_WARNING, "bladerf_get_sample_rate_range() returned %s", _err2str(ret).c_str());
+            else
+            {
+                const auto overallRange = toRange(range);
+                caps.sampleRateRange.emplace_back(overallRange.minimum()/1.0, overallRange.maximum()/4.0, overallRange.maximum()/16.0);
+                caps.sampleRateRange.emplace_back(overallRange.maximum()/4.0, overallRange.maximum()/2.0, overallRange.maximum()/8.0);
+                caps.sampleRateRange.emplace_back(overallRange.maximum()/2.0, overallRange.maximum()/1.0, overallRange.maximum()/4.0);
+            }
+
+            ret = bladerf_get_bandwidth_range(_dev, ch, &range);
+            if (ret != 0) SoapySDR::logf(SOAPY_SDR_WARNING, "bladerf_get_bandwidth_range() returned %s", _err2str(ret).c_str());
+            else caps.bandwidthRange.push_back(toRange(range));
+        }
+    }
+
+    const bladerf_loopback_modes *modes(nullptr);
+    const int numModes = bladerf_get_loopback_modes(_dev, &modes);
+    if (modes and numModes > 0) for (int i = 0; i < numModes; i++)
+    {
+        if (modes[i].mode == BLADERF_LB_NONE) _defaultLoopback = modes[i].name;
+        _loopbackModes.emplace_back(modes[i].name, modes[i].mode);
+    }
+}
+
+void bladeRF_SoapySDR::adoptSampleRate(const int direction)
+{
+    bladerf_rational_rate ratRate;
+    int ret = bladerf_get_rational_sample_rate(_dev, _toch(direction, 0), &ratRate);
+    if (ret != 0)
+    {
+        SoapySDR::logf(SOAPY_SDR_WARNING, "bladerf_get_rational_sample_rate() returned %s", _err2str(ret).c_str());
+        return;
+    }
+
+    if (ratRate.den == 0) ratRate.den = 1;
+    const double rate = double(ratRate.integer) + (double(ratRate.num)/double(ratRate.den));
+    this->writeSharedShadow(&ChannelShadow::sampleRate, direction, rate);
+
+    //the counter was not rebased, time counts from tick zero at this rate
+    std::lock_guard<std::mutex> lock(_epochMutex);
+    TickEpoch &epoch = (direction == SOAPY_SDR_RX)?_rxEpoch:_txEpoch;
+    epoch.rate = ratRate;
+    ((direction == SOAPY_SDR_RX)?_rxPrevEpoch:_txPrevEpoch) = epoch;
+
+    if (direction == SOAPY_SDR_RX)
+    {
+        _rxSampRate = rate;
+        this->updateRxMinTimeoutMs();
+    }
+    if (direction == SOAPY_SDR_TX)
+    {
+        _txSampRate = rate;
+    }
+}
+
+std::string bladeRF_SoapySDR::fpgaImageRecord(const std::string &path) const
+{
+    uint64_t hash(0);
+    size_t size(0);
+    if (not hashFile(path, hash, size)) return "";
+
+    struct bladerf_version version;
+    bladerf_fpga_size fpgaSize = BLADERF_FPGA_UNKNOWN;
+    if (bladerf_fpga_version(_dev, &version) != 0) return "";
+    if (bladerf_get_fpga_size(_dev, &fpgaSize) != 0) return "";
+
+    std::stringstream ss;
+    ss << std::hex << hash << std::dec << " " << size << " " << int(fpgaSize) << " "
+       << version.major << "." << version.minor << "." << version.patch;
+    return ss.str();
+}
+
 /*******************************************************************
  * Identification API
  ******************************************************************/
@@ -131,7 +380,7 @@ SoapySDR::Kwargs bladeRF_SoapySDR::getHardwareInfo(void) const
 
 size_t bladeRF_SoapySDR::getNumChannels(const int direction) const
 {
-    return bladerf_get_channel_count(_dev, (direction == SOAPY_SDR_RX)?BLADERF_RX:BLADERF_TX);
+    return (direction == SOAPY_SDR_RX)?(_numRxChans + _channelizerSize):_numTxChans;
 }
 
 bool bladeRF_SoapySDR::getFullDuplex(const int, const size_t) const
@@ -145,6 +394,7 @@ bool bladeRF_SoapySDR::getFullDuplex(const int, const size_t) const
 
 std::vector<std::string> bladeRF_SoapySDR::listAntennas(const int direction, const size_t channel) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->listAntennas(direction, 0);
     return {BLADERF_CHANNEL_IS_TX(_toch(direction, channel))?"TX":"RX"};
 }
 
@@ -162,13 +412,14 @@ std::string bladeRF_SoapySDR::getAntenna(const int direction, const size_t chann
  * Calibration API
  ******************************************************************/
 
-bool bladeRF_SoapySDR::hasDCOffset(const int, const size_t) const
+bool bladeRF_SoapySDR::hasDCOffset(const int direction, const size_t channel) const
 {
-    return true;
+    return not _isVirtualChannel(direction, channel); //channelizer channels follow rx channel 0
 }
 
 void bladeRF_SoapySDR::setDCOffset(const int direction, const size_t channel, const std::complex<double> &offset)
 {
+    if (_isVirtualChannel(direction, channel)) throw std::runtime_error("setDCOffset() channelizer channels follow rx channel 0");
     int ret = 0;
     int16_t i = 0;
     int16_t q = 0;
@@ -196,10 +447,16 @@ void bladeRF_SoapySDR::setDCOffset(const int direction, const size_t channel, co
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_correction(%f) returned %s", q, _err2str(ret).c_str());
         throw std::runtime_error("setDCOffset() " + _err2str(ret));
     }
+
+    this->writeShadow(&ChannelShadow::dcOffset, direction, channel, std::complex<double>(i / 2048.0f, q / 2048.0f));
 }
 
 std::complex<double> bladeRF_SoapySDR::getDCOffset(const int direction, const size_t channel) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->getDCOffset(direction, 0);
+    std::complex<double> cached;
+    if (this->readShadow(&ChannelShadow::dcOffset, direction, channel, cached)) return cached;
+
     int ret = 0;
     int16_t i = 0;
     int16_t q = 0;
@@ -219,16 +476,18 @@ std::complex<double> bladeRF_SoapySDR::getDCOffset(const int direction, const si
     }
 
     std::complex<double> z(i / 2048.0f, q / 2048.0f);
+    this->writeShadow(&ChannelShadow::dcOffset, direction, channel, z);
     return z;
 }
 
-bool bladeRF_SoapySDR::hasIQBalance(const int, const size_t channel) const
+bool bladeRF_SoapySDR::hasIQBalance(const int direction, const size_t channel) const
 {
-    return true;
+    return not _isVirtualChannel(direction, channel); //channelizer channels follow rx channel 0
 }
 
 void bladeRF_SoapySDR::setIQBalance(const int direction, const size_t channel, const std::complex<double> &balance)
 {
+    if (_isVirtualChannel(direction, channel)) throw std::runtime_error("setIQBalance() channelizer channels follow rx channel 0");
     int ret = 0;
     int16_t gain = 0;
     int16_t phase = 0;
@@ -256,10 +515,16 @@ void bladeRF_SoapySDR::setIQBalance(const int direction, const size_t channel, c
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_correction(%f) returned %s", phase, _err2str(ret).c_str());
         throw std::runtime_error("setIQBalance() " + _err2str(ret));
     }
+
+    this->writeShadow(&ChannelShadow::iqBalance, direction, channel, std::complex<double>(gain / 4096.0f, phase / 4096.0f));
 }
 
 std::complex<double> bladeRF_SoapySDR::getIQBalance(const int direction, const size_t channel) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->getIQBalance(direction, 0);
+    std::complex<double> cached;
+    if (this->readShadow(&ChannelShadow::iqBalance, direction, channel, cached)) return cached;
+
     int ret = 0;
     int16_t gain = 0;
     int16_t phase = 0;
@@ -279,6 +544,7 @@ std::complex<double> bladeRF_SoapySDR::getIQBalance(const int direction, const s
     }
 
     std::complex<double> z(gain / 4096.0f, phase / 4096.0f);
+    this->writeShadow(&ChannelShadow::iqBalance, direction, channel, z);
     return z;
 }
 
@@ -288,38 +554,14 @@ std::complex<double> bladeRF_SoapySDR::getIQBalance(const int direction, const s
 
 bool bladeRF_SoapySDR::hasGainMode(const int direction, const size_t channel) const
 {
-    if (_toch(direction, channel) != BLADERF_CHANNEL_RX(channel)) {
-        return false;
-    } else {
-        /* This actually depends on a lot of things, including presence of a LUT
-         * table, so best to determine dynamically.
-         */
-        bladerf_gain_mode mode;
-        int ret;
-
-        ret = bladerf_get_gain_mode(_dev, _toch(direction, channel), &mode);
-        if (ret != 0) {
-            return false;
-        }
-
-		/* Test if it will take automatic mode */
-        ret = bladerf_set_gain_mode(_dev, _toch(direction, channel), BLADERF_GAIN_AUTOMATIC);
-        if (ret != 0) {
-            return false;
-        }
-
-		/* We're good - restore it to the original mode */
-		ret = bladerf_set_gain_mode(_dev, _toch(direction, channel), mode);
-        if (ret != 0) {
-            return false;
-        }
-        return true;
-    }
+    if (_isVirtualChannel(direction, channel)) return this->hasGainMode(direction, 0);
+    return _channelCaps(direction, channel).hasGainMode;
 }
 
 void bladeRF_SoapySDR::setGainMode(const int direction, const size_t channel, const bool automatic)
 {
     if (direction == SOAPY_SDR_TX) return; //not supported on tx
+    if (_isVirtualChannel(direction, channel)) throw std::runtime_error("setGainMode() channelizer channels follow rx channel 0");
     bladerf_gain_mode gain_mode = automatic ? BLADERF_GAIN_AUTOMATIC : BLADERF_GAIN_MANUAL;
     const int ret = bladerf_set_gain_mode(_dev, _toch(direction, channel), gain_mode);
     if (ret != 0 and automatic) //only throw when mode is automatic, manual is default even when call bombs
@@ -329,6 +571,9 @@ void bladeRF_SoapySDR::setGainMode(const int direction, const size_t channel, co
     }
     bladerf_gain_mode return_mode;
     bladerf_get_gain_mode(_dev, _toch(direction, channel), &return_mode);
+    this->writeShadow(&ChannelShadow::gainMode, direction, channel, return_mode == BLADERF_GAIN_AUTOMATIC);
+    //the overall gain is under AGC control or back to its manual setting
+    this->invalidateShadow(&ChannelShadow::gain, direction, channel);
     std::string gain_mode_string;
 
     if (return_mode == BLADERF_GAIN_DEFAULT) {
@@ -351,6 +596,9 @@ void bladeRF_SoapySDR::setGainMode(const int direction, const size_t channel, co
 bool bladeRF_SoapySDR::getGainMode(const int direction, const size_t channel) const
 {
     if (direction == SOAPY_SDR_TX) return false; //not supported on tx
+    if (_isVirtualChannel(direction, channel)) return this->getGainMode(direction, 0);
+    bool automatic(false);
+    if (this->readShadow(&ChannelShadow::gainMode, direction, channel, automatic)) return automatic;
     bladerf_gain_mode gain_mode;
     int ret = bladerf_get_gain_mode(_dev, _toch(direction, channel), &gain_mode);
     if (ret != 0)
@@ -358,47 +606,77 @@ bool bladeRF_SoapySDR::getGainMode(const int direction, const size_t channel) co
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_gain_mode() returned %s", _err2str(ret).c_str());
         throw std::runtime_error("getGainMode() " + _err2str(ret));
     }
+    this->writeShadow(&ChannelShadow::gainMode, direction, channel, gain_mode == BLADERF_GAIN_AUTOMATIC);
     return gain_mode == BLADERF_GAIN_AUTOMATIC;
 }
 
 std::vector<std::string> bladeRF_SoapySDR::listGains(const int direction, const size_t channel) const
 {
-    #define MAX_STAGES 8
-    const char *stages[MAX_STAGES];
-    int ret = bladerf_get_gain_stages(_dev, _toch(direction, channel), (const char **)&stages, MAX_STAGES);
-    if (ret < 0)
-    {
-        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_gain_stages() returned %s", _err2str(ret).c_str());
-        throw std::runtime_error("listGains() " + _err2str(ret));
-    }
-
-    std::vector<std::string> options;
-    for (int i = 0; i < ret; i++) options.push_back(stages[i]);
-    return options;
+    if (_isVirtualChannel(direction, channel)) return this->listGains(direction, 0);
+    return _channelCaps(direction, channel).gainStages;
 }
 
 void bladeRF_SoapySDR::setGain(const int direction, const size_t channel, const double value)
 {
+    if (_isVirtualChannel(direction, channel)) throw std::runtime_error("setGain() channelizer channels follow rx channel 0");
+
+    //a timed gain is shadowed by the worker once it is applied
+    if (_cmdTimeNs != 0) return this->queueTimedCommand(_cmdTimeNs, [this, direction, channel, value](void)
+    {
+        int ret = bladerf_set_gain(_dev, _toch(direction, channel), bladerf_gain(std::round(value)));
+        if (ret != 0) SoapySDR::logf(SOAPY_SDR_ERROR, "timed bladerf_set_gain(%f) returned %s", value, _err2str(ret).c_str());
+        else this->shadowGain(direction, channel);
+    });
+
     const int ret = bladerf_set_gain(_dev, _toch(direction, channel), bladerf_gain(std::round(value)));
     if (ret != 0)
     {
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_gain(%f) returned %s", value, _err2str(ret).c_str());
         throw std::runtime_error("setGain() " + _err2str(ret));
     }
+    this->shadowGain(direction, channel);
+}
+
+void bladeRF_SoapySDR::shadowGain(const int direction, const size_t channel)
+{
+    //the shadow holds the gain read back from the device
+    //AGC keeps changing the gain, so it is only shadowed in manual mode
+    bladerf_gain gain(0);
+    if (this->getGainMode(direction, channel) or bladerf_get_gain(_dev, _toch(direction, channel), &gain) != 0)
+    {
+        this->invalidateShadow(&ChannelShadow::gain, direction, channel);
+    }
+    else this->writeShadow(&ChannelShadow::gain, direction, channel, double(gain));
 }
 
 void bladeRF_SoapySDR::setGain(const int direction, const size_t channel, const std::string &name, const double value)
 {
+    if (_isVirtualChannel(direction, channel)) throw std::runtime_error("setGain("+name+") channelizer channels follow rx channel 0");
+
+    //a stage change moves the overall gain, read it back once the stage is applied
+    if (_cmdTimeNs != 0) return this->queueTimedCommand(_cmdTimeNs, [this, direction, channel, name, value](void)
+    {
+        int ret = bladerf_set_gain_stage(_dev, _toch(direction, channel), name.c_str(), bladerf_gain(std::round(value)));
+        if (ret != 0) SoapySDR::logf(SOAPY_SDR_ERROR, "timed bladerf_set_gain_stage(%s, %f) returned %s", name.c_str(), value, _err2str(ret).c_str());
+        else this->shadowGain(direction, channel);
+    });
+
     int ret = bladerf_set_gain_stage(_dev, _toch(direction, channel), name.c_str(), bladerf_gain(std::round(value)));
     if (ret != 0)
     {
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_gain_stage(%s, %f) returned %s", name.c_str(), value, _err2str(ret).c_str());
         throw std::runtime_error("setGain("+name+") " + _err2str(ret));
     }
+    this->shadowGain(direction, channel);
 }
 
 double bladeRF_SoapySDR::getGain(const int direction, const size_t channel) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->getGain(direction, 0);
+
+    double cached(0.0);
+    if (this->readShadow(&ChannelShadow::gain, direction, channel, cached)) return cached;
+
     bladerf_gain gain(0);
     const int ret = bladerf_get_gain(_dev, _toch(direction, channel), &gain);
     if (ret != 0)
@@ -406,11 +684,15 @@ double bladeRF_SoapySDR::getGain(const int direction, const size_t channel) cons
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_gain() returned %s", _err2str(ret).c_str());
         throw std::runtime_error("getGain() " + _err2str(ret));
     }
+    //AGC keeps changing the gain, only shadow it in manual mode
+    if (not this->getGainMode(direction, channel)) this->writeShadow(&ChannelShadow::gain, direction, channel, double(gain));
     return double(gain);
 }
 
 double bladeRF_SoapySDR::getGain(const int direction, const size_t channel, const std::string &name) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->getGain(direction, 0, name);
+
     bladerf_gain gain(0);
     int ret = bladerf_get_gain_stage(_dev, _toch(direction, channel), name.c_str(), &gain);
     if (ret != 0)
@@ -423,25 +705,34 @@ double bladeRF_SoapySDR::getGain(const int direction, const size_t channel, cons
 
 SoapySDR::Range bladeRF_SoapySDR::getGainRange(const int direction, const size_t channel) const
 {
-    const bladerf_range* range(nullptr);
-    int ret = bladerf_get_gain_range(_dev, _toch(direction, channel), &range);
-    if (ret != 0)
-    {
-        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_gain_range() returned %s", _err2str(ret).c_str());
-        throw std::runtime_error("getGainRange()" + _err2str(ret));
-    }
-    return toRange(range);
+    return this->getGainRange(direction, channel, "");
 }
 
 SoapySDR::Range bladeRF_SoapySDR::getGainRange(const int direction, const size_t channel, const std::string &name) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->getGainRange(direction, 0, name);
+
+    //gain ranges follow the tuned band, reuse the last read back for the same frequency
+    const double freq = this->getFrequency(direction, channel, "RF");
+    {
+        std::lock_guard<std::mutex> lock(_shadowMutex);
+        const auto &gainRanges = _shadows[std::make_pair(direction, channel)].gainRanges;
+        auto it = gainRanges.find(name);
+        if (it != gainRanges.end() and it->second.first == freq) return it->second.second;
+    }
+
     const bladerf_range* range(nullptr);
-    int ret = bladerf_get_gain_stage_range(_dev, _toch(direction, channel), name.c_str(), &range);
+    int ret = 0;
+    if (name.empty()) ret = bladerf_get_gain_range(_dev, _toch(direction, channel), &range);
+    else ret = bladerf_get_gain_stage_range(_dev, _toch(direction, channel), name.c_str(), &range);
     if (ret != 0)
     {
-        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_gain_stage_range(%s) returned %s", name.c_str(), _err2str(ret).c_str());
+        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_gain%s_range(%s) returned %s", name.empty()?"":"_stage", name.c_str(), _err2str(ret).c_str());
         throw std::runtime_error("getGainRange("+name+")" + _err2str(ret));
     }
+
+    std::lock_guard<std::mutex> lock(_shadowMutex);
+    _shadows[std::make_pair(direction, channel)].gainRanges[name] = std::make_pair(freq, toRange(range));
     return toRange(range);
 }
 
@@ -453,6 +744,7 @@ void bladeRF_SoapySDR::setFrequency(const int direction, const size_t channel, c
 {
     if (name == "BB") return; //for compatibility
     if (name != "RF") throw std::runtime_error("setFrequency("+name+") unknown name");
+    if (_isVirtualChannel(direction, channel)) throw std::runtime_error("setFrequency() channelizer channels follow rx channel 0");
 
     //NOTE on quick tunes:
     // - this is available on BladeRF2, not BladeRF1
@@ -461,9 +753,14 @@ void bladeRF_SoapySDR::setFrequency(const int direction, const size_t channel, c
     // - to clear previous quick tunes, the RFIC should have its state reset which is currently done
     //     when the FPGA is loaded or reloaded. To have the ability to live reset the index to 0,
     //     the ADI AXI core might have to be modified.
+    // - the driver keeps at most NUM_QUICK_TUNE_PROFILES quick tunes per direction and never evicts them,
+    //     saving a new frequency into a full store fails until the FPGA is loaded again.
+
+    //quick tunes are keyed by the integer frequency that is actually programmed
+    const uint64_t freqHz = uint64_t(std::llround(frequency));
 
     //if "saveQuickTune" == "1", set the frequency and store the quick tune parameter.
-    //NOTE that it's possible to overwrite previous quick tune parameter.
+    //a frequency that was already saved reuses its profile rather than consuming a new one.
     auto saveQuickTuneIter = args.find("saveQuickTune");
     if (saveQuickTuneIter != args.end() && saveQuickTuneIter->second == "1")
     {
@@ -473,19 +770,24 @@ void bladeRF_SoapySDR::setFrequency(const int direction, const size_t channel, c
             throw std::runtime_error("saveQuickTune is only available for BladeRF2.");
         }
 
+        auto &quickTunes = _quickTunes(direction);
+        const bool saved = quickTunes.find(channel, freqHz) != nullptr;
+        if (not saved and quickTunes.full())
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "saveQuickTune all %d quick tune profiles are in use, load the FPGA to free them", int(quickTunes.capacity()));
+            throw std::runtime_error("saveQuickTune all " + std::to_string(quickTunes.capacity()) + " quick tune profiles are in use");
+        }
+
         setRfFrequency(direction, channel, frequency);
 
-        auto quickTune = getQuickTune(direction, channel);
-        if (quickTune == nullptr)
+        if (saved)
         {
-            SoapySDR::logf(SOAPY_SDR_ERROR, "Cannot set frequency for retune.");
-            throw std::runtime_error("Cannot set frequency for retune.");
+            quickTunes.countHit();
+            return;
         }
+        quickTunes.countMiss();
 
-        auto quickTuneIter = _quickTunesByDirChanAndFreq.find({ direction, channel, frequency });
-        if (quickTuneIter != _quickTunesByDirChanAndFreq.end()) delete quickTuneIter->second;
-
-        _quickTunesByDirChanAndFreq[{direction, channel, frequency}] = quickTune;
+        quickTunes.insert(channel, freqHz, getQuickTune(direction, channel));
         return;
     }
 
@@ -500,17 +802,34 @@ void bladeRF_SoapySDR::setFrequency(const int direction, const size_t channel, c
             throw std::runtime_error("reuseQuickTune is only available for BladeRF2.");
         }
 
-        auto quickTuneIter = _quickTunesByDirChanAndFreq.find({ direction, channel, frequency });
-        if (quickTuneIter == _quickTunesByDirChanAndFreq.end())
+        const bladerf_quick_tune *quickTune = _quickTunes(direction).find(channel, freqHz);
+        if (quickTune == nullptr)
         {
-            SoapySDR::logf(SOAPY_SDR_ERROR, "Unkown quick tune for frequency %f and channel %d", frequency, channel);
+            SoapySDR::logf(SOAPY_SDR_ERROR, "Unkown quick tune for frequency %f and channel %d", frequency, int(channel));
             throw std::runtime_error("Unkown quick tune");
         }
 
         auto value = args.find("timestamp");
         long long timestamp = value == args.end() ? 0 : std::stoll(value->second);
 
-        retune(direction, channel, timestamp, quickTuneIter->second);
+        scheduleRetune(direction, channel, timestamp, *quickTune, frequency);
+        return;
+    }
+
+    //Else, if a command time is set, the frequency change is applied at that time.
+    //A saved quick tune is scheduled in hardware, otherwise the timed command worker applies it.
+    if (_cmdTimeNs != 0)
+    {
+        const bladerf_quick_tune *quickTune = _isBladeRF2?_quickTunes(direction).find(channel, freqHz):nullptr;
+        if (quickTune != nullptr)
+        {
+            const long long ticks = (direction == SOAPY_SDR_RX)?_timeNsToRxTicks(_cmdTimeNs):_timeNsToTxTicks(_cmdTimeNs);
+            scheduleRetune(direction, channel, ticks, *quickTune, frequency);
+        }
+        else this->queueTimedCommand(_cmdTimeNs, [this, direction, channel, frequency](void)
+        {
+            this->setRfFrequency(direction, channel, frequency);
+        });
         return;
     }
 
@@ -518,6 +837,30 @@ void bladeRF_SoapySDR::setFrequency(const int direction, const size_t channel, c
     setRfFrequency(direction, channel, frequency);
 }
 
+void bladeRF_SoapySDR::scheduleRetune(const int direction, const size_t channel, long long timestamp, const bladerf_quick_tune &quickTune, const double frequency)
+{
+    retune(direction, channel, timestamp, quickTune);
+
+    //the LO changes at the timestamp, until then the getter reads it back from the device
+    std::atomic<long long> &retuneUntil = (direction == SOAPY_SDR_RX)?_rxRetuneUntil:_txRetuneUntil;
+    if (timestamp > retuneUntil) retuneUntil = timestamp;
+    this->invalidateSharedShadow(&ChannelShadow::frequency, direction);
+
+    //remember timed rx retunes so readStream() can tag the first sample at the new frequency
+    if (direction == SOAPY_SDR_RX and timestamp != 0)
+    {
+        RetuneEvent event;
+        event.channel = channel;
+        event.ticks = timestamp;
+        event.frequency = frequency;
+        //retunes may be scheduled out of time order, the reader expects the earliest first
+        std::lock_guard<std::mutex> lock(_rxRetuneMutex);
+        if (_rxRetunes.size() >= MAX_RETUNE_EVENTS) _rxRetunes.pop_front();
+        _rxRetunes.insert(std::upper_bound(_rxRetunes.begin(), _rxRetunes.end(), event,
+            [](const RetuneEvent &a, const RetuneEvent &b){return a.ticks < b.ticks;}), event);
+    }
+}
+
 void bladeRF_SoapySDR::setRfFrequency(const int direction, const size_t channel, const double frequency)
 {
     int ret = bladerf_set_frequency(_dev, _toch(direction, channel), bladerf_frequency(std::round(frequency)));
@@ -526,12 +869,32 @@ void bladeRF_SoapySDR::setRfFrequency(const int direction, const size_t channel,
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_frequency(%f) returned %s", frequency, _err2str(ret).c_str());
         throw std::runtime_error("setFrequency(RF) " + _err2str(ret));
     }
+
+    //shadow the tuned LO, the channels of a direction share it
+    bladerf_frequency actual(0);
+    if (bladerf_get_frequency(_dev, _toch(direction, channel), &actual) == 0) this->writeSharedShadow(&ChannelShadow::frequency, direction, double(actual));
+    else this->invalidateSharedShadow(&ChannelShadow::frequency, direction);
+}
+
+bool bladeRF_SoapySDR::retunePending(const int direction) const
+{
+    std::atomic<long long> &retuneUntil = (direction == SOAPY_SDR_RX)?_rxRetuneUntil:_txRetuneUntil;
+    if (retuneUntil == 0) return false;
+    bladerf_timestamp ticksNow = 0;
+    if (bladerf_get_timestamp(_dev, (direction == SOAPY_SDR_RX)?BLADERF_RX:BLADERF_TX, &ticksNow) != 0) return true;
+    if ((long long)(ticksNow) < retuneUntil) return true;
+    retuneUntil = 0;
+    return false;
 }
 
 double bladeRF_SoapySDR::getFrequency(const int direction, const size_t channel, const std::string &name) const
 {
     if (name == "BB") return 0.0; //for compatibility
     if (name != "RF") throw std::runtime_error("getFrequency("+name+") unknown name");
+    if (_isVirtualChannel(direction, channel)) return this->getFrequency(direction, 0, name) + _virtualChannelOffset(channel);
+
+    double cached(0.0);
+    if (this->readShadow(&ChannelShadow::frequency, direction, channel, cached)) return cached;
 
     bladerf_frequency freq(0);
     int ret = bladerf_get_frequency(_dev, _toch(direction, channel), &freq);
@@ -540,6 +903,7 @@ double bladeRF_SoapySDR::getFrequency(const int direction, const size_t channel,
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_frequency() returned %s", _err2str(ret).c_str());
         throw std::runtime_error("getFrequency("+name+") " + _err2str(ret));
     }
+    if (not this->retunePending(direction)) this->writeSharedShadow(&ChannelShadow::frequency, direction, double(freq));
     return double(freq);
 }
 
@@ -552,38 +916,35 @@ SoapySDR::RangeList bladeRF_SoapySDR::getFrequencyRange(const int direction, con
 {
     if (name == "BB") return SoapySDR::RangeList(1, SoapySDR::Range(0.0, 0.0)); //for compatibility
     if (name != "RF") throw std::runtime_error("getFrequencyRange("+name+") unknown name");
+    if (_isVirtualChannel(direction, channel)) return this->getFrequencyRange(direction, 0, name);
 
-    const bladerf_range* range(nullptr);
-    int ret = bladerf_get_frequency_range(_dev, _toch(direction, channel), &range);
-    if (ret != 0)
-    {
-        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_frequency_range() returned %s", _err2str(ret).c_str());
-        throw std::runtime_error("getFrequencyRange() " + _err2str(ret));
-    }
-    return {toRange(range)};
+    const auto &ranges = _channelCaps(direction, channel).frequencyRange;
+    if (ranges.empty()) throw std::runtime_error("getFrequencyRange() unavailable");
+    return ranges;
 }
 
-bladerf_quick_tune* bladeRF_SoapySDR::getQuickTune(const int direction, const size_t channel) const
+bladerf_quick_tune bladeRF_SoapySDR::getQuickTune(const int direction, const size_t channel) const
 {
-    bladerf_quick_tune* quick_tune = new bladerf_quick_tune();
-    bladerf_channel ch = _toch(direction, channel);
-    int ret = bladerf_get_quick_tune(_dev, ch, quick_tune);
+    bladerf_quick_tune quickTune;
+    std::memset(&quickTune, 0, sizeof(quickTune));
+    int ret = bladerf_get_quick_tune(_dev, _toch(direction, channel), &quickTune);
 
+    //the RFIC hands out profiles sequentially and only reclaims them on an FPGA (re)load
     if (ret != 0)
     {
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_quick_tune() returned %s", _err2str(ret).c_str());
-        delete quick_tune;
-        return nullptr;
+        throw std::runtime_error("getQuickTune() " + _err2str(ret));
     }
 
-    return quick_tune;
+    return quickTune;
 }
 
-void bladeRF_SoapySDR::retune(const int direction, const size_t channel, long long timestamp, bladerf_quick_tune* quickTune)
+void bladeRF_SoapySDR::retune(const int direction, const size_t channel, long long timestamp, const bladerf_quick_tune &quickTune)
 {
     bladerf_channel ch = _toch(direction, channel);
 
-    int ret = bladerf_schedule_retune(_dev, ch, timestamp, 0 /* frequency not needed for retune */, quickTune);
+    bladerf_quick_tune conf = quickTune;
+    int ret = bladerf_schedule_retune(_dev, ch, timestamp, 0 /* frequency not needed for retune */, &conf);
 
     if (ret != 0)
     {
@@ -598,41 +959,93 @@ void bladeRF_SoapySDR::retune(const int direction, const size_t channel, long lo
 
 void bladeRF_SoapySDR::setSampleRate(const int direction, const size_t channel, const double rate)
 {
+    if (_isVirtualChannel(direction, channel)) throw std::runtime_error("setSampleRate() channelizer channels follow rx channel 0");
+
     bladerf_rational_rate ratRate;
     ratRate.integer = uint64_t(rate);
     ratRate.den = uint64_t(1 << 14); //arbitrary denominator -- should be big enough
-    ratRate.num = uint64_t(rate - ratRate.integer) * ratRate.den;
+    ratRate.num = uint64_t(std::llround((rate - ratRate.integer) * ratRate.den));
+    if (ratRate.num == ratRate.den)
+    {
+        ratRate.integer++;
+        ratRate.num = 0;
+    }
+
+    //nothing to program when the rate is unchanged
+    double current(0.0);
+    if (this->readShadow(&ChannelShadow::sampleRate, direction, channel, current) and
+        std::abs(current - rate) < 1.0/ratRate.den) return;
 
-    //stash the approximate hardware time so it can be restored
-    const long long timeNow = this->getHardwareTime();
+    //the trigger time base is shared by rx and tx, arming checked that their rates match
+    if (_triggerSync) throw std::runtime_error("setSampleRate() the trigger is armed, disarm it or wait until it fired");
 
-    int ret = bladerf_set_rational_sample_rate(_dev, _toch(direction, channel), &ratRate, NULL);
+    //the ddc, duc and resampler steps are derived from the rate when the stream is set up
+    if (not ((direction == SOAPY_SDR_RX)?_rxChains.empty():_txChains.empty()))
+    {
+        throw std::runtime_error("setSampleRate() the stream processing follows the rate at setupStream(), close the stream first");
+    }
+
+    //the capture history indexes its samples at the rate it was allocated with
+    if (direction == SOAPY_SDR_RX and _rxCapture) throw std::runtime_error("setSampleRate() the capture history follows the rate at setupStream(), close the stream first");
+
+    //a SigMF recording has a single sample rate in its global metadata
+    if (direction == SOAPY_SDR_RX and _rxRecorder) throw std::runtime_error("setSampleRate() the recording follows the rate at setupStream(), close the stream first");
+
+    //stash the tick count so the counter can be rebased rather than reset
+    const bladerf_direction dir = (direction == SOAPY_SDR_RX)?BLADERF_RX:BLADERF_TX;
+    bladerf_timestamp ticksNow = 0;
+    int ret = bladerf_get_timestamp(_dev, dir, &ticksNow);
     if (ret != 0)
     {
-        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_rational_sample_rate(%f) returned %s", rate, _err2str(ret).c_str());
+        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_timestamp() returned %s", _err2str(ret).c_str());
         throw std::runtime_error("setSampleRate() " + _err2str(ret));
     }
 
-    //stash the actual rate
-    const double actual = this->getSampleRate(direction, channel);
-    if (direction == SOAPY_SDR_RX)
+    bladerf_rational_rate actualRate;
+    ret = bladerf_set_rational_sample_rate(_dev, _toch(direction, channel), &ratRate, &actualRate);
+    if (ret != 0)
     {
-        _rxSampRate = actual;
-        this->updateRxMinTimeoutMs();
+        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_rational_sample_rate(%f) returned %s", rate, _err2str(ret).c_str());
+        throw std::runtime_error("setSampleRate() " + _err2str(ret));
     }
-    if (direction == SOAPY_SDR_TX)
+
+    //stash the actual rate
+    if (actualRate.den == 0) actualRate.den = 1;
+    const double actual = double(actualRate.integer) + (double(actualRate.num)/double(actualRate.den));
+    this->writeSharedShadow(&ChannelShadow::sampleRate, direction, actual);
+
+    //ticks after the change count at the new rate starting from the time at the change,
+    //this keeps the hardware time continuous without toggling the timestamp GPIO
     {
-        _txSampRate = actual;
-    }
+        std::lock_guard<std::mutex> lock(_epochMutex);
+        TickEpoch &epoch = (direction == SOAPY_SDR_RX)?_rxEpoch:_txEpoch;
+        TickEpoch &prevEpoch = (direction == SOAPY_SDR_RX)?_rxPrevEpoch:_txPrevEpoch;
+        const long long timeNow = _epochTicksToTimeNs(ticksNow, epoch);
+        prevEpoch = epoch;
+        epoch.ticks = ticksNow;
+        epoch.timeNs = timeNow;
+        epoch.rate = actualRate;
 
-    //restore the previous hardware time setting (after rate stash)
-    this->setHardwareTime(timeNow);
+        //an active stream marks the first buffer of this epoch
+        if (direction == SOAPY_SDR_RX) _rxRateChanged = not _rxChans.empty();
+        if (direction == SOAPY_SDR_RX) _rxSampRate = actual;
+        if (direction == SOAPY_SDR_TX) _txSampRate = actual;
+    }
+    if (direction == SOAPY_SDR_RX) this->updateRxMinTimeoutMs();
 
     SoapySDR::logf(SOAPY_SDR_INFO, "setSampleRate(%s, %d, %f MHz), actual = %f MHz", direction==SOAPY_SDR_RX?"Rx":"Tx", int(channel), rate/1e6, actual/1e6);
 }
 
 double bladeRF_SoapySDR::getSampleRate(const int direction, const size_t channel) const
 {
+    if (_isVirtualChannel(direction, channel))
+    {
+        return this->getSampleRate(direction, 0)/(_channelizerOversample?_channelizerSize/2:_channelizerSize);
+    }
+
+    double cached(0.0);
+    if (this->readShadow(&ChannelShadow::sampleRate, direction, channel, cached)) return cached;
+
     bladerf_rational_rate ratRate;
     int ret = bladerf_get_rational_sample_rate(_dev, _toch(direction, channel), &ratRate);
     if (ret != 0)
@@ -641,26 +1054,22 @@ double bladeRF_SoapySDR::getSampleRate(const int direction, const size_t channel
         throw std::runtime_error("getSampleRate() " + _err2str(ret));
     }
 
-    return double(ratRate.integer) + (double(ratRate.num)/double(ratRate.den));
+    const double rate = double(ratRate.integer) + (double(ratRate.num)/double(ratRate.den));
+    this->writeSharedShadow(&ChannelShadow::sampleRate, direction, rate);
+    return rate;
 }
 
 SoapySDR::RangeList bladeRF_SoapySDR::getSampleRateRange(const int direction, const size_t channel) const
 {
-    const bladerf_range* range(nullptr);
-    int ret = bladerf_get_sample_rate_range(_dev, _toch(direction, channel), &range);
-    if (ret != 0)
+    //the channelizer fixes the rate of its channels
+    if (_isVirtualChannel(direction, channel))
     {
-        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_sample_rate_range() returned %s", _err2str(ret).c_str());
-        throw std::runtime_error("getSampleRateRange() " + _err2str(ret));
+        const double rate = this->getSampleRate(direction, channel);
+        return SoapySDR::RangeList(1, SoapySDR::Range(rate, rate));
     }
 
-    //create useful ranges based on the overall range
-    //these values were suggested by the authors in the gr-osmosdr plugin for bladerf
-    const auto overallRange = toRange(range);
-    SoapySDR::RangeList ranges;
-    ranges.emplace_back(overallRange.minimum()/1.0, overallRange.maximum()/4.0, overallRange.maximum()/16.0);
-    ranges.emplace_back(overallRange.maximum()/4.0, overallRange.maximum()/2.0, overallRange.maximum()/8.0);
-    ranges.emplace_back(overallRange.maximum()/2.0, overallRange.maximum()/1.0, overallRange.maximum()/4.0);
+    const auto &ranges = _channelCaps(direction, channel).sampleRateRange;
+    if (ranges.empty()) throw std::runtime_error("getSampleRateRange() unavailable");
     return ranges;
 }
 
@@ -684,25 +1093,35 @@ std::vector<double> bladeRF_SoapySDR::listSampleRates(const int direction, const
 
 void bladeRF_SoapySDR::setBandwidth(const int direction, const size_t channel, const double bw)
 {
+    if (_isVirtualChannel(direction, channel)) throw std::runtime_error("setBandwidth() channelizer channels follow rx channel 0");
+
     //bypass the filter when sufficiently large BW is selected
     if (bw > this->getBandwidthRange(direction, channel).back().maximum())
     {
         bladerf_set_lpf_mode(_dev, _toch(direction, channel), BLADERF_LPF_BYPASSED);
+        this->invalidateSharedShadow(&ChannelShadow::bandwidth, direction);
         return;
     }
 
     //otherwise set to normal and configure the filter bandwidth
     bladerf_set_lpf_mode(_dev, _toch(direction, channel), BLADERF_LPF_NORMAL);
-    int ret = bladerf_set_bandwidth(_dev, _toch(direction, channel), bladerf_bandwidth(std::round(bw)), NULL);
+    bladerf_bandwidth actual(0);
+    int ret = bladerf_set_bandwidth(_dev, _toch(direction, channel), bladerf_bandwidth(std::round(bw)), &actual);
     if (ret != 0)
     {
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_bandwidth(%f) returned %s", bw, _err2str(ret).c_str());
         throw std::runtime_error("setBandwidth() " + _err2str(ret));
     }
+    this->writeSharedShadow(&ChannelShadow::bandwidth, direction, double(actual));
 }
 
 double bladeRF_SoapySDR::getBandwidth(const int direction, const size_t channel) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->getSampleRate(direction, 0)/_channelizerSize;
+
+    double cached(0.0);
+    if (this->readShadow(&ChannelShadow::bandwidth, direction, channel, cached)) return cached;
+
     bladerf_bandwidth bw(0);
     int ret = bladerf_get_bandwidth(_dev, _toch(direction, channel), &bw);
     if (ret != 0)
@@ -710,26 +1129,29 @@ double bladeRF_SoapySDR::getBandwidth(const int direction, const size_t channel)
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_bandwidth() returned %s", _err2str(ret).c_str());
         throw std::runtime_error("getBandwidth() " + _err2str(ret));
     }
+    this->writeSharedShadow(&ChannelShadow::bandwidth, direction, double(bw));
     return double(bw);
 }
 
 SoapySDR::RangeList bladeRF_SoapySDR::getBandwidthRange(const int direction, const size_t channel) const
 {
-    const bladerf_range* range(nullptr);
-    int ret = bladerf_get_bandwidth_range(_dev, _toch(direction, channel), &range);
-    if (ret != 0)
+    //the channel spacing of the channelizer is fixed
+    if (_isVirtualChannel(direction, channel))
     {
-        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_bandwidth_range() returned %s", _err2str(ret).c_str());
-        throw std::runtime_error("getBandwidthRange() " + _err2str(ret));
+        const double bw = this->getBandwidth(direction, channel);
+        return SoapySDR::RangeList(1, SoapySDR::Range(bw, bw));
     }
-    return {toRange(range)};
+
+    const auto &ranges = _channelCaps(direction, channel).bandwidthRange;
+    if (ranges.empty()) throw std::runtime_error("getBandwidthRange() unavailable");
+    return ranges;
 }
 
 std::vector<double> bladeRF_SoapySDR::listBandwidths(const int direction, const size_t channel) const
 {
     //this is a deprecated call, it should be removed in the future
-    //for bladerfv2, return a simple 2 element list based on the available range
-    if (this->getNumChannels(direction) == 2)
+    //for bladerfv2 and channelizer channels, return a simple 2 element list based on the available range
+    if (_isBladeRF2 or _isVirtualChannel(direction, channel))
     {
         const auto ranges = this->getBandwidthRange(direction, channel);
         return {ranges.front().minimum(), ranges.back().maximum()};
@@ -812,12 +1234,20 @@ void bladeRF_SoapySDR::setClockSource(const std::string &source)
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_set_pll_enable() returned %s", _err2str(ret).c_str());
         throw std::runtime_error("setClockSource() " + _err2str(ret));
     }
+
+    std::lock_guard<std::mutex> lock(_shadowMutex);
+    _clockSourceShadow.set(enable?"ref_in":"internal");
 }
 
 std::string bladeRF_SoapySDR::getClockSource(void) const
 {
     if (! _isBladeRF2) return "internal";
 
+    {
+        std::lock_guard<std::mutex> lock(_shadowMutex);
+        if (_clockSourceShadow.valid) return _clockSourceShadow.value;
+    }
+
     bool enabled(false);
     int ret = bladerf_get_pll_enable(_dev, &enabled);
 
@@ -827,8 +1257,9 @@ std::string bladeRF_SoapySDR::getClockSource(void) const
         throw std::runtime_error("getClockSource() " + _err2str(ret));
     }
 
-    if (enabled) return "ref_in";
-    else return "internal";
+    std::lock_guard<std::mutex> lock(_shadowMutex);
+    _clockSourceShadow.set(enabled?"ref_in":"internal");
+    return _clockSourceShadow.value;
 }
 
 
@@ -861,9 +1292,9 @@ void bladeRF_SoapySDR::setHardwareTime(const long long timeNs, const std::string
 {
     if (not what.empty()) return SoapySDR::Device::setHardwareTime(timeNs, what);
 
-    //reset the counters with GPIO and stash the offset
+    //reset the counters with GPIO and stash the time at tick zero
     //this is the same as setting the time because
-    //we maintain the offset math within the driver
+    //we maintain the epoch math within the driver
 
     int ret = 0;
     uint32_t original = 0;
@@ -877,7 +1308,88 @@ void bladeRF_SoapySDR::setHardwareTime(const long long timeNs, const std::string
         throw std::runtime_error("setHardwareTime() " + _err2str(ret));
     }
 
-    _timeNsOffset = timeNs;
+    //both counters restart from zero at the given time
+    std::lock_guard<std::mutex> lock(_epochMutex);
+    _rxEpoch.ticks = _txEpoch.ticks = 0;
+    _rxEpoch.timeNs = _txEpoch.timeNs = timeNs;
+    _rxPrevEpoch = _rxEpoch;
+    _txPrevEpoch = _txEpoch;
+}
+
+void bladeRF_SoapySDR::setCommandTime(const long long timeNs, const std::string &what)
+{
+    if (not what.empty()) return SoapySDR::Device::setCommandTime(timeNs, what);
+
+    //a time of 0 clears the command time, subsequent calls are applied immediately
+    _cmdTimeNs = timeNs;
+}
+
+void bladeRF_SoapySDR::queueTimedCommand(const long long timeNs, const std::function<void(void)> &command)
+{
+    std::lock_guard<std::mutex> lock(_timedCmdMutex);
+    if (not _timedCmdThread.joinable()) _timedCmdThread = std::thread(&bladeRF_SoapySDR::timedCommandWorker, this);
+    _timedCmds.emplace(timeNs, command);
+    _timedCmdCond.notify_one();
+}
+
+void bladeRF_SoapySDR::timedCommandWorker(void)
+{
+    std::unique_lock<std::mutex> lock(_timedCmdMutex);
+    size_t timeErrors(0);
+    while (not _timedCmdDone)
+    {
+        if (_timedCmds.empty())
+        {
+            _timedCmdCond.wait(lock);
+            continue;
+        }
+
+        //poll the hardware time, sleeping for half of the time left but at most 10ms
+        const long long timeNs = _timedCmds.begin()->first;
+        lock.unlock();
+        long long timeNow = 0;
+        std::string timeError;
+        try {timeNow = this->getHardwareTime();}
+        catch (const std::exception &ex) {timeError = ex.what();}
+        lock.lock();
+
+        //without the time a command could run early, retry and then drop it
+        if (not timeError.empty())
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "timed command cannot read the hardware time: %s", timeError.c_str());
+            if (++timeErrors < TIMED_CMD_TIME_RETRIES)
+            {
+                _timedCmdCond.wait_for(lock, std::chrono::milliseconds(10));
+                continue;
+            }
+            if (not _timedCmds.empty() and _timedCmds.begin()->first == timeNs)
+            {
+                SoapySDR::logf(SOAPY_SDR_ERROR, "timed command at %lld ns dropped", timeNs);
+                _timedCmds.erase(_timedCmds.begin());
+            }
+            timeErrors = 0;
+            continue;
+        }
+        timeErrors = 0;
+
+        if (timeNow < timeNs)
+        {
+            const long long sleepNs = std::min<long long>(std::max<long long>((timeNs - timeNow)/2, 100000), 10000000);
+            _timedCmdCond.wait_for(lock, std::chrono::nanoseconds(sleepNs));
+            continue;
+        }
+
+        //apply every command that is due, in time order
+        auto command = _timedCmds.begin()->second;
+        _timedCmds.erase(_timedCmds.begin());
+        lock.unlock();
+        try {command();}
+        catch (const std::exception &ex)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "timed command failed: %s", ex.what());
+        }
+        lock.lock();
+    }
 }
 
 /*******************************************************************
@@ -925,9 +1437,12 @@ std::string bladeRF_SoapySDR::readSensor(const std::string &key) const
 
 std::vector<std::string> bladeRF_SoapySDR::listSensors(const int direction, const size_t channel) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->listSensors(direction, 0);
     std::vector<std::string> sensors;
     if (_isBladeRF2 and direction == SOAPY_SDR_RX) sensors.push_back("PRE_RSSI");
     if (_isBladeRF2 and direction == SOAPY_SDR_RX) sensors.push_back("SYM_RSSI");
+    if (direction == SOAPY_SDR_RX) sensors.push_back("DC_ESTIMATE");
+    if (direction == SOAPY_SDR_RX) sensors.push_back("IQ_ESTIMATE");
     return sensors;
 }
 
@@ -955,11 +1470,32 @@ SoapySDR::ArgInfo bladeRF_SoapySDR::getSensorInfo(const int direction, const siz
         info.type = SoapySDR::ArgInfo::FLOAT;
         return info;
     }
+    else if (key == "DC_ESTIMATE" and direction == SOAPY_SDR_RX)
+    {
+        SoapySDR::ArgInfo info;
+        info.key = key;
+        info.value = "0,0";
+        info.name = "DC Offset Estimate";
+        info.description = "Residual DC offset tracked by the stream correction as real,imag (full scale 1.0 like setDCOffset)";
+        info.type = SoapySDR::ArgInfo::STRING;
+        return info;
+    }
+    else if (key == "IQ_ESTIMATE" and direction == SOAPY_SDR_RX)
+    {
+        SoapySDR::ArgInfo info;
+        info.key = key;
+        info.value = "0,0";
+        info.name = "IQ Imbalance Estimate";
+        info.description = "Image coefficient b of y = x + b*conj(x) tracked by the stream correction as real,imag";
+        info.type = SoapySDR::ArgInfo::STRING;
+        return info;
+    }
     else throw std::runtime_error("getSensorInfo(" + key + ") unknown sensor");
 }
 
 std::string bladeRF_SoapySDR::readSensor(const int direction, const size_t channel, const std::string &key) const
 {
+    if (_isVirtualChannel(direction, channel)) return this->readSensor(direction, 0, key);
     if (key == "PRE_RSSI" or key == "SYM_RSSI")
     {
         int32_t pre_rssi(0), sym_rssi(0);
@@ -971,6 +1507,13 @@ std::string bladeRF_SoapySDR::readSensor(const int direction, const size_t chann
         }
         return std::to_string((key[0] == 'P')?pre_rssi:sym_rssi);
     }
+    else if ((key == "DC_ESTIMATE" or key == "IQ_ESTIMATE") and direction == SOAPY_SDR_RX)
+    {
+        const IQCorrector *corrector = _rxCorrector(channel);
+        std::complex<double> z;
+        if (corrector != nullptr) z = (key == "DC_ESTIMATE")?corrector->dcOffset():corrector->imbalance();
+        return std::to_string(z.real()) + "," + std::to_string(z.imag());
+    }
     else throw std::runtime_error("readSensor(" + key + ") unknown sensor");
 }
 
@@ -1089,13 +1632,8 @@ SoapySDR::ArgInfoList bladeRF_SoapySDR::getSettingInfo(void) const
     lookbackArg.name = "Loopback Mode";
     lookbackArg.description = "Enable/disable internal loopback";
     lookbackArg.type = SoapySDR::ArgInfo::STRING;
-    const bladerf_loopback_modes *modes(nullptr);
-    const int numModes = bladerf_get_loopback_modes(_dev, &modes);
-    if (modes and numModes > 0) for (int i = 0; i < numModes; i++)
-    {
-        if (modes[i].mode == BLADERF_LB_NONE) lookbackArg.value = modes[i].name;
-        lookbackArg.options.push_back(modes[i].name);
-    }
+    lookbackArg.value = _defaultLoopback;
+    for (const auto &mode : _loopbackModes) lookbackArg.options.push_back(mode.first);
 
     setArgs.push_back(lookbackArg);
 
@@ -1166,7 +1704,8 @@ SoapySDR::ArgInfoList bladeRF_SoapySDR::getSettingInfo(void) const
     loadArg.key = "load_fpga";
     loadArg.value = "";
     loadArg.name = "Load device's FPGA";
-    loadArg.description = "Load device's FPGA from the provided file path. Note that this FPGA configuration will be reset at the next power cycle.";
+    loadArg.description = "Load device's FPGA from the provided file path. Note that this FPGA configuration will be reset at the next power cycle. "
+        "The load is skipped when the same image file is recorded as the running FPGA. Reads back loaded or skipped.";
     loadArg.type = SoapySDR::ArgInfo::STRING;
 
     setArgs.push_back(loadArg);
@@ -1199,6 +1738,199 @@ SoapySDR::ArgInfoList bladeRF_SoapySDR::getSettingInfo(void) const
 
     setArgs.push_back(biasTeeRx);
 
+    // Command time
+    SoapySDR::ArgInfo cmdTimeArg;
+    cmdTimeArg.key = "command_time";
+    cmdTimeArg.value = "0";
+    cmdTimeArg.name = "Command time";
+    cmdTimeArg.description = "Apply subsequent setFrequency() and setGain() calls at this hardware time, 0 applies them immediately. "
+        "Frequencies with a saved quick tune are retuned by the hardware, other changes are applied by a worker thread.";
+    cmdTimeArg.units = "ns";
+    cmdTimeArg.type = SoapySDR::ArgInfo::INT;
+
+    setArgs.push_back(cmdTimeArg);
+
+    // Refresh shadowed state
+    SoapySDR::ArgInfo refreshArg;
+    refreshArg.key = "refresh";
+    refreshArg.value = "false";
+    refreshArg.name = "Refresh cached state";
+    refreshArg.description = "Getters are served from state cached by the setters. "
+        "Invalidate it so the next getters read back from the device, e.g. when another process changed it.";
+    refreshArg.type = SoapySDR::ArgInfo::BOOL;
+    refreshArg.options.push_back("true");
+    refreshArg.optionNames.push_back("True");
+    refreshArg.options.push_back("false");
+    refreshArg.optionNames.push_back("False");
+
+    setArgs.push_back(refreshArg);
+
+    // Trigger lines
+    SoapySDR::ArgInfo triggerSignalArg;
+    triggerSignalArg.key = "trigger_signal";
+    triggerSignalArg.value = _isBladeRF1?"J71_4":"J51_1";
+    triggerSignalArg.name = "Trigger signal";
+    triggerSignalArg.description = "Expansion header pin shared between the boards that start together";
+    triggerSignalArg.type = SoapySDR::ArgInfo::STRING;
+    triggerSignalArg.options.push_back(_isBladeRF1?"J71_4":"J51_1");
+    triggerSignalArg.optionNames.push_back(_isBladeRF1?"J71 pin 4":"J51 pin 1");
+    triggerSignalArg.options.push_back("MINI_EXP_1");
+    triggerSignalArg.optionNames.push_back("Mini expansion pin 1");
+
+    setArgs.push_back(triggerSignalArg);
+
+    SoapySDR::ArgInfo triggerRoleArg;
+    triggerRoleArg.key = "trigger_role";
+    triggerRoleArg.value = "disabled";
+    triggerRoleArg.name = "Trigger role";
+    triggerRoleArg.description = "The master drives the trigger line when fired, slaves follow it";
+    triggerRoleArg.type = SoapySDR::ArgInfo::STRING;
+    triggerRoleArg.options.push_back("disabled");
+    triggerRoleArg.optionNames.push_back("Disabled");
+    triggerRoleArg.options.push_back("master");
+    triggerRoleArg.optionNames.push_back("Master");
+    triggerRoleArg.options.push_back("slave");
+    triggerRoleArg.optionNames.push_back("Slave");
+
+    setArgs.push_back(triggerRoleArg);
+
+    SoapySDR::ArgInfo triggerArmArg;
+    triggerArmArg.key = "trigger_arm";
+    triggerArmArg.value = "false";
+    triggerArmArg.name = "Arm trigger";
+    triggerArmArg.description = "Hold rx and tx samples until the trigger fires. "
+        "The first rx sample after the trigger becomes time 0, giving every armed board the same time base. "
+        "The rx and tx rates must match to arm, and they cannot change until the trigger fired. "
+        "Without an rx stream, writeStream() detects the fire and time 0 is the tx time when it was seen. "
+        "Reads back disabled, disarmed, armed or fired.";
+    triggerArmArg.type = SoapySDR::ArgInfo::BOOL;
+    triggerArmArg.options.push_back("true");
+    triggerArmArg.optionNames.push_back("True");
+    triggerArmArg.options.push_back("false");
+    triggerArmArg.optionNames.push_back("False");
+
+    setArgs.push_back(triggerArmArg);
+
+    SoapySDR::ArgInfo triggerFireArg;
+    triggerFireArg.key = "trigger_fire";
+    triggerFireArg.value = "false";
+    triggerFireArg.name = "Fire trigger";
+    triggerFireArg.description = "Fire the trigger line from the master once all boards are armed and streaming";
+    triggerFireArg.type = SoapySDR::ArgInfo::BOOL;
+    triggerFireArg.options.push_back("true");
+    triggerFireArg.optionNames.push_back("True");
+    triggerFireArg.options.push_back("false");
+    triggerFireArg.optionNames.push_back("False");
+
+    setArgs.push_back(triggerFireArg);
+
+    // Channelizer
+    SoapySDR::ArgInfo channelizerArg;
+    channelizerArg.key = "channelizer";
+    channelizerArg.value = "0";
+    channelizerArg.name = "Channelizer channels";
+    channelizerArg.description = "Split rx channel 0 into this many channels with a polyphase filter bank, 0 disables it. "
+        "The channels are added as rx channels after the hardware channels, from the lowest frequency, "
+        "and a stream of any of them is channelized from rx channel 0. Set before setupStream().";
+    channelizerArg.type = SoapySDR::ArgInfo::INT;
+    for (size_t size = 0; size <= 4096; size = (size == 0)?2:2*size)
+    {
+        channelizerArg.options.push_back(std::to_string(size));
+    }
+
+    setArgs.push_back(channelizerArg);
+
+    SoapySDR::ArgInfo channelizerOversampleArg;
+    channelizerOversampleArg.key = "channelizer_oversample";
+    channelizerOversampleArg.value = "false";
+    channelizerOversampleArg.name = "Oversample channelizer";
+    channelizerOversampleArg.description = "Output the channels at twice their bandwidth so that signals between two channels are not aliased";
+    channelizerOversampleArg.type = SoapySDR::ArgInfo::BOOL;
+    channelizerOversampleArg.options.push_back("true");
+    channelizerOversampleArg.optionNames.push_back("True");
+    channelizerOversampleArg.options.push_back("false");
+    channelizerOversampleArg.optionNames.push_back("False");
+
+    setArgs.push_back(channelizerOversampleArg);
+
+    SoapySDR::ArgInfo captureTriggerArg;
+    captureTriggerArg.key = "capture_trigger";
+    captureTriggerArg.value = "now";
+    captureTriggerArg.name = "Capture trigger";
+    captureTriggerArg.description = "Snapshot the history of an rx stream in capture mode around now or around a time in nanoseconds. "
+        "readStream() then returns the capture_pre samples before and the capture_post samples from the trigger as one burst. "
+        "Reading gives the state: capturing, triggered or ready.";
+    captureTriggerArg.type = SoapySDR::ArgInfo::STRING;
+
+    setArgs.push_back(captureTriggerArg);
+
+    // TX replay
+    SoapySDR::ArgInfo txReplayArg;
+    txReplayArg.key = "tx_replay";
+    txReplayArg.value = "";
+    txReplayArg.name = "TX replay";
+    txReplayArg.description = "Replay a raw CS16 or SigMF ci16_le recording of interleaved channels on the tx stream. "
+        "The file is memory mapped and sent without conversion at the hardware rate, writeStream() fails until it is done. "
+        "An empty value stops it, reading gives the state: running or idle. "
+        "The tx_replay_loops, tx_replay_time and tx_replay_period settings are taken when it starts and rejected while it runs.";
+    txReplayArg.type = SoapySDR::ArgInfo::STRING;
+
+    setArgs.push_back(txReplayArg);
+
+    SoapySDR::ArgInfo txReplayLoopsArg;
+    txReplayLoopsArg.key = "tx_replay_loops";
+    txReplayLoopsArg.value = "1";
+    txReplayLoopsArg.name = "TX replay loops";
+    txReplayLoopsArg.description = "Passes over the file by the next tx_replay, 0 repeats until stopped.";
+    txReplayLoopsArg.type = SoapySDR::ArgInfo::INT;
+
+    setArgs.push_back(txReplayLoopsArg);
+
+    SoapySDR::ArgInfo txReplayTimeArg;
+    txReplayTimeArg.key = "tx_replay_time";
+    txReplayTimeArg.value = "0";
+    txReplayTimeArg.name = "TX replay time";
+    txReplayTimeArg.description = "Hardware time in nanoseconds of the first sample of the next tx_replay, 0 starts now.";
+    txReplayTimeArg.units = "ns";
+    txReplayTimeArg.type = SoapySDR::ArgInfo::INT;
+
+    setArgs.push_back(txReplayTimeArg);
+
+    SoapySDR::ArgInfo txReplayPeriodArg;
+    txReplayPeriodArg.key = "tx_replay_period";
+    txReplayPeriodArg.value = "0";
+    txReplayPeriodArg.name = "TX replay period";
+    txReplayPeriodArg.description = "Time between the starts of the passes of the next tx_replay, each pass is then a timed burst. "
+        "0 plays the passes back to back in one burst.";
+    txReplayPeriodArg.units = "s";
+    txReplayPeriodArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    setArgs.push_back(txReplayPeriodArg);
+
+    // Configuration profiles
+    SoapySDR::ArgInfo profileArg;
+    profileArg.key = "profile";
+    profileArg.value = "";
+    profileArg.name = "Configuration profile";
+    profileArg.description = "Apply a JSON object or the name of a stored profile as one transaction. "
+        "Keys are rx_/tx_ (or rxN_/txN_ for channel N) followed by rate, bandwidth, frequency, agc or gain, "
+        "and the xb200, sampling_mode, loopback, biastee_rx and biastee_tx settings. "
+        "Everything is validated before anything is applied and values that did not change are skipped. "
+        "When a step fails, the values changed before it are restored in reverse order.";
+    profileArg.type = SoapySDR::ArgInfo::STRING;
+
+    setArgs.push_back(profileArg);
+
+    SoapySDR::ArgInfo storeProfileArg;
+    storeProfileArg.key = "store_profile";
+    storeProfileArg.value = "";
+    storeProfileArg.name = "Store configuration profile";
+    storeProfileArg.description = "Validate and store a JSON profile under its \"name\" member without applying it. "
+        "Reads back the stored profile names.";
+    storeProfileArg.type = SoapySDR::ArgInfo::STRING;
+
+    setArgs.push_back(storeProfileArg);
+
     return setArgs;
 }
 
@@ -1211,11 +1943,9 @@ std::string bladeRF_SoapySDR::readSetting(const std::string &key) const
     } else if (key == "loopback") {
         bladerf_loopback lb;
         bladerf_get_loopback(_dev, &lb);
-        const bladerf_loopback_modes *modes(nullptr);
-        const int numModes = bladerf_get_loopback_modes(_dev, &modes);
-        if (modes and numModes > 0) for (int i = 0; i < numModes; i++)
+        for (const auto &mode : _loopbackModes)
         {
-            if (modes[i].mode == lb) return modes[i].name;
+            if (mode.second == lb) return mode.first;
         }
         return "unknown";
     } else if (key == "reset") {
@@ -1229,11 +1959,78 @@ std::string bladeRF_SoapySDR::readSetting(const std::string &key) const
     } else if (key == "jump_to_bootloader") {
         return "false";
     } else if (key == "load_fpga") {
-        return "";
-    } else if (key == "biastee_tx") {
+        return _fpgaLoadResult;
+    } else if (key == "biastee_tx" or key == "biastee_rx") {
+        bool enabled(false);
+        const bladerf_channel ch = (key == "biastee_tx")?BLADERF_CHANNEL_TX(0):BLADERF_CHANNEL_RX(0);
+        if (bladerf_get_bias_tee(_dev, ch, &enabled) != 0) return "false";
+        return enabled?"true":"false";
+    } else if (key == "quick_tune_hits") {
+        return std::to_string(_rxQuickTunes.hits() + _txQuickTunes.hits());
+    } else if (key == "quick_tune_misses") {
+        return std::to_string(_rxQuickTunes.misses() + _txQuickTunes.misses());
+    } else if (key == "quick_tune_count") {
+        return std::to_string(_rxQuickTunes.size() + _txQuickTunes.size());
+    } else if (key == "scan_frequency") {
+        return std::to_string(_rxScanFreq);
+    } else if (key == "refresh") {
         return "false";
-    } else if (key == "biastee_rx") {
+    } else if (key == "command_time") {
+        return std::to_string(_cmdTimeNs);
+    } else if (key == "retune_offset") {
+        return std::to_string(_rxRetuneOffset);
+    } else if (key == "retune_frequency") {
+        return std::to_string(_rxRetuneFreq);
+    } else if (key == "detection_preamble" or key == "detection_peak" or key == "detection_frequency") {
+        std::lock_guard<std::mutex> lock(_rxDetectionMutex);
+        if (key == "detection_preamble") return std::to_string(_rxLastDetection.preamble);
+        if (key == "detection_peak") return std::to_string(_rxLastDetection.peak);
+        return std::to_string(_rxLastDetection.frequency);
+    } else if (key == "rx_stream_rate") {
+        return std::to_string(_rxStreamRate());
+    } else if (key == "tx_stream_rate") {
+        return std::to_string(_txStreamRate());
+    } else if (key == "rx_rational_rate") {
+        bladerf_rational_rate rate;
+        if (bladerf_get_rational_sample_rate(_dev, BLADERF_CHANNEL_RX(0), &rate) != 0) return "";
+        return std::to_string(rate.integer) + " " + std::to_string(rate.num) + " " + std::to_string(rate.den);
+    } else if (key == "channelizer") {
+        return std::to_string(_channelizerSize);
+    } else if (key == "channelizer_oversample") {
+        return _channelizerOversample?"true":"false";
+    } else if (key == "capture_trigger") {
+        return _rxCapture?_rxCapture->state():"disabled";
+    } else if (key == "tx_replay") {
+        return _txReplayRunning?"running":"idle";
+    } else if (key == "tx_replay_loops") {
+        return std::to_string(_txReplayLoops);
+    } else if (key == "tx_replay_time") {
+        return std::to_string(_txReplayTimeNs);
+    } else if (key == "tx_replay_period") {
+        return std::to_string(_txReplayPeriod);
+    } else if (key == "trigger_signal") {
+        return _triggerSignal;
+    } else if (key == "trigger_role") {
+        return _triggerRole;
+    } else if (key == "trigger_arm") {
+        if (_triggerRole == "disabled") return "disabled";
+        bool armed(false), fired(false), fireRequested(false);
+        uint64_t resv1(0), resv2(0);
+        if (bladerf_trigger_state(_dev, &_rxTrigger, &armed, &fired, &fireRequested, &resv1, &resv2) != 0) return "unknown";
+        if (fired) return "fired";
+        return armed?"armed":"disarmed";
+    } else if (key == "trigger_fire") {
         return "false";
+    } else if (key == "profile") {
+        return _activeProfile;
+    } else if (key == "store_profile") {
+        std::string names;
+        for (const auto &profile : _profiles)
+        {
+            if (not names.empty()) names += ",";
+            names += profile.first;
+        }
+        return names;
     }
 
     SoapySDR_logf(SOAPY_SDR_WARNING, "Unknown setting '%s'", key.c_str());
@@ -1276,6 +2073,9 @@ void bladeRF_SoapySDR::writeSetting(const std::string &key, const std::string &v
                     SoapySDR::logf(SOAPY_SDR_ERROR, "bladeRF: Could not attach to XB200");
                     return;
                 }
+
+                //the transverter extends the frequency range
+                this->probeCapabilities();
             }
             SoapySDR::logf(SOAPY_SDR_INFO, "bladeRF: XB200 is attached");
 
@@ -1396,11 +2196,9 @@ void bladeRF_SoapySDR::writeSetting(const std::string &key, const std::string &v
     else if (key == "loopback")
     {
         bladerf_loopback loopback(BLADERF_LB_NONE);
-        const bladerf_loopback_modes *modes(nullptr);
-        const int numModes = bladerf_get_loopback_modes(_dev, &modes);
-        if (modes and numModes > 0) for (int i = 0; i < numModes; i++)
+        for (const auto &mode : _loopbackModes)
         {
-            if (modes[i].name == value) loopback = modes[i].mode;
+            if (mode.first == value) loopback = mode.second;
         }
         if (bladerf_is_loopback_mode_supported(_dev, loopback))
         {
@@ -1437,6 +2235,7 @@ void bladeRF_SoapySDR::writeSetting(const std::string &key, const std::string &v
                                _err2str(ret).c_str());
                 throw std::runtime_error("writeSetting() " + _err2str(ret));
             }
+            this->invalidateShadows();
         }
         /*else {
             // --> Invalid setting has arrived
@@ -1512,12 +2311,36 @@ void bladeRF_SoapySDR::writeSetting(const std::string &key, const std::string &v
     else if (key == "load_fpga")
     {
         if (!value.empty()) {
+            //skip the load when this image is recorded as the one running
+            bladerf_serial serial;
+            std::string recordPath;
+            if (bladerf_get_serial_struct(_dev, &serial) == 0) recordPath = fpgaRecordPath(serial.serial);
+            std::string lastRecord;
+            if (not recordPath.empty()) std::getline(std::ifstream(recordPath), lastRecord);
+
+            const std::string record = this->fpgaImageRecord(value);
+            if (not record.empty() and record == lastRecord and bladerf_is_fpga_configured(_dev) == 1)
+            {
+                SoapySDR::logf(SOAPY_SDR_INFO, "bladerf_load_fpga(%s) skipped, image already loaded", value.c_str());
+                _fpgaLoadResult = "skipped";
+                return;
+            }
+
             int ret = bladerf_load_fpga(_dev, value.c_str());
             if (ret != 0) {
                 SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_load_fpga(%s) returned %s", value.c_str(),
                                _err2str(ret).c_str());
                 throw std::runtime_error("writeSetting() " + _err2str(ret));
             }
+            _fpgaLoadResult = "loaded";
+
+            //the record holds the running version, which is only known after the load
+            if (not recordPath.empty()) std::ofstream(recordPath) << this->fpgaImageRecord(value) << std::endl;
+
+            //loading the FPGA resets the RFIC and with it all quick tune profiles
+            _rxQuickTunes.clear();
+            _txQuickTunes.clear();
+            this->invalidateShadows();
         }
         /*else {
             // --> Invalid setting has arrived
@@ -1552,12 +2375,209 @@ void bladeRF_SoapySDR::writeSetting(const std::string &key, const std::string &v
             }
         }
     }
+    else if (key == "refresh")
+    {
+        if (value == "true") this->invalidateShadows();
+    }
+    else if (key == "command_time")
+    {
+        this->setCommandTime(value.empty()?0:std::stoll(value));
+    }
+    else if (key == "trigger_signal")
+    {
+        this->configureTriggers(value, _triggerRole);
+    }
+    else if (key == "trigger_role")
+    {
+        this->configureTriggers(_triggerSignal, value);
+    }
+    else if (key == "trigger_arm")
+    {
+        this->armTriggers(value == "true");
+    }
+    else if (key == "trigger_fire")
+    {
+        if (value != "true") return;
+        if (_triggerRole != "master") throw std::runtime_error("writeSetting(trigger_fire) requires trigger_role master");
+        int ret = bladerf_trigger_fire(_dev, &_rxTrigger);
+        if (ret != 0)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_trigger_fire() returned %s", _err2str(ret).c_str());
+            throw std::runtime_error("writeSetting() " + _err2str(ret));
+        }
+    }
+    else if (key == "profile")
+    {
+        this->applyProfile(value);
+    }
+    else if (key == "store_profile")
+    {
+        this->storeProfile(value);
+    }
+    else if (key == "channelizer" or key == "channelizer_oversample")
+    {
+        if (not _rxChans.empty()) throw std::runtime_error("writeSetting(" + key + ") close the rx stream first");
+        if (key == "channelizer_oversample") _channelizerOversample = (value == "true");
+        else
+        {
+            const unsigned long size = std::stoul(value);
+            if (size != 0 and (size < 2 or size > 4096 or (size & (size-1)) != 0))
+            {
+                throw std::runtime_error("writeSetting(channelizer) " + value + " is not a power of 2 from 2 to 4096");
+            }
+            _channelizerSize = size;
+        }
+    }
+    else if (key == "capture_trigger")
+    {
+        if (not _rxCapture) throw std::runtime_error("writeSetting(capture_trigger) requires an rx stream in capture mode");
+        const bool triggered = (value.empty() or value == "now")?_rxCapture->trigger():_rxCapture->trigger(std::stoll(value));
+        if (not triggered) throw std::runtime_error("writeSetting(capture_trigger) " + value + " a snapshot is pending or the time is outside of the history");
+    }
+    else if (key == "tx_replay")
+    {
+        if (value.empty() or value == "stop") this->stopReplay();
+        else this->startReplay(value);
+    }
+    else if ((key == "tx_replay_loops" or key == "tx_replay_time" or key == "tx_replay_period") and _txReplayRunning)
+    {
+        throw std::runtime_error("writeSetting(" + key + ") stop the replay first");
+    }
+    else if (key == "tx_replay_loops")
+    {
+        const long long loops = std::stoll(value);
+        if (loops < 0) throw std::runtime_error("writeSetting(tx_replay_loops) invalid value " + value);
+        _txReplayLoops = (unsigned long long)(loops);
+    }
+    else if (key == "tx_replay_time")
+    {
+        _txReplayTimeNs = std::stoll(value);
+    }
+    else if (key == "tx_replay_period")
+    {
+        const double period = std::stod(value);
+        if (period < 0.0) throw std::runtime_error("writeSetting(tx_replay_period) invalid value " + value);
+        _txReplayPeriod = period;
+    }
     else
     {
         throw std::runtime_error("writeSetting(" + key + ") unknown setting");
     }
 }
 
+/*******************************************************************
+ * Trigger API
+ ******************************************************************/
+
+void bladeRF_SoapySDR::configureTriggers(const std::string &signal, const std::string &role)
+{
+    bladerf_trigger_signal sig = BLADERF_TRIGGER_INVALID;
+    if (signal == "J71_4") sig = BLADERF_TRIGGER_J71_4;
+    else if (signal == "J51_1") sig = BLADERF_TRIGGER_J51_1;
+    else if (signal == "MINI_EXP_1") sig = BLADERF_TRIGGER_MINI_EXP_1;
+    else throw std::runtime_error("writeSetting(trigger_signal) unknown signal " + signal);
+
+    bladerf_trigger_role r = BLADERF_TRIGGER_ROLE_INVALID;
+    if (role == "disabled") r = BLADERF_TRIGGER_ROLE_DISABLED;
+    else if (role == "master") r = BLADERF_TRIGGER_ROLE_MASTER;
+    else if (role == "slave") r = BLADERF_TRIGGER_ROLE_SLAVE;
+    else throw std::runtime_error("writeSetting(trigger_role) unknown role " + role);
+
+    //disarm the previous configuration before changing it
+    if (_triggerRole != "disabled") this->armTriggers(false);
+
+    for (const int direction : {SOAPY_SDR_RX, SOAPY_SDR_TX})
+    {
+        bladerf_trigger &trigger = (direction == SOAPY_SDR_RX)?_rxTrigger:_txTrigger;
+        int ret = bladerf_trigger_init(_dev, _toch(direction, 0), sig, &trigger);
+        if (ret != 0)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_trigger_init(%s) returned %s", signal.c_str(), _err2str(ret).c_str());
+            throw std::runtime_error("configureTriggers() " + _err2str(ret));
+        }
+        trigger.role = r;
+    }
+
+    _triggerSignal = signal;
+    _triggerRole = role;
+}
+
+void bladeRF_SoapySDR::armTriggers(const bool arm)
+{
+    if (_triggerRole == "disabled") throw std::runtime_error("armTriggers() requires trigger_role master or slave");
+
+    //the rx and tx counters are held together, the shared time base needs them to count at the same rate
+    if (arm)
+    {
+        const bladerf_rational_rate rxRate = this->_epoch(SOAPY_SDR_RX).rate;
+        const bladerf_rational_rate txRate = this->_epoch(SOAPY_SDR_TX).rate;
+        if (rxRate.integer != txRate.integer or rxRate.num*txRate.den != txRate.num*rxRate.den)
+        {
+            throw std::runtime_error("armTriggers() the tx rate differs from the rx rate, the trigger time base cannot apply to both");
+        }
+
+        bladerf_timestamp ticksNow = 0;
+        const int ret = bladerf_get_timestamp(_dev, BLADERF_RX, &ticksNow);
+        if (ret != 0)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_timestamp() returned %s", _err2str(ret).c_str());
+            throw std::runtime_error("armTriggers() " + _err2str(ret));
+        }
+        _triggerArmTicks = (long long)(ticksNow);
+    }
+
+    for (const bladerf_trigger *trigger : {&_rxTrigger, &_txTrigger})
+    {
+        int ret = bladerf_trigger_arm(_dev, trigger, arm, 0, 0);
+        if (ret != 0)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_trigger_arm(%s) returned %s", arm?"true":"false", _err2str(ret).c_str());
+            throw std::runtime_error("armTriggers() " + _err2str(ret));
+        }
+    }
+
+    //samples are held until the trigger fires, the first one after it starts the shared time base
+    _triggerSync = arm;
+}
+
+void bladeRF_SoapySDR::rebaseOnTrigger(const long long ticks)
+{
+    //the rx and tx streams may both see the fire, only the first one rebases
+    bool armed(true);
+    if (not _triggerSync.compare_exchange_strong(armed, false)) return;
+
+    std::lock_guard<std::mutex> lock(_epochMutex);
+    _rxEpoch.ticks = ticks;
+    _rxEpoch.timeNs = 0;
+    _rxPrevEpoch = _rxEpoch;
+    //arming checked that tx counts at the rx rate and the rates are held until here
+    _txPrevEpoch = _txEpoch = _rxEpoch;
+}
+
+void bladeRF_SoapySDR::pollTxTrigger(void)
+{
+    bool armed(false), fired(false), fireRequested(false);
+    uint64_t resv1(0), resv2(0);
+    int ret = bladerf_trigger_state(_dev, &_txTrigger, &armed, &fired, &fireRequested, &resv1, &resv2);
+    if (ret != 0)
+    {
+        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_trigger_state() returned %s", _err2str(ret).c_str());
+        return;
+    }
+    if (not fired) return;
+
+    //the tx samples carry no timestamp of the edge, the counter read after it is the closest,
+    //time 0 is late by the polling latency on a tx only board
+    bladerf_timestamp ticksNow = 0;
+    ret = bladerf_get_timestamp(_dev, BLADERF_TX, &ticksNow);
+    if (ret != 0)
+    {
+        SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_timestamp() returned %s", _err2str(ret).c_str());
+        return;
+    }
+    this->rebaseOnTrigger((long long)(ticksNow));
+}
+
 /*******************************************************************
  * GPIO API
  ******************************************************************/
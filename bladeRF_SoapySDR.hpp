@@ -26,6 +26,21 @@
 #include <libbladeRF.h>
 #include <cstdio>
 #include <queue>
+#include <deque>
+#include <map>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <complex>
+#include <cmath>
+#include <string>
+#include <stdexcept>
+#include <memory>
+#include "bladeRF_DSP.hpp"
+#include "bladeRF_Recorder.hpp"
 
 #if defined(LIBBLADERF_API_VERSION) && (LIBBLADERF_API_VERSION >= 0x02000000)
 #else
@@ -43,6 +58,182 @@ struct StreamMetadata
     int code;
 };
 
+/*!
+ * A cached control value, valid once read back or written
+ */
+template <typename Type>
+struct Shadow
+{
+    Shadow(void):
+        valid(false),
+        value()
+    {
+        return;
+    }
+
+    void set(const Type &v)
+    {
+        value = v;
+        valid = true;
+    }
+
+    bool valid;
+    Type value;
+};
+
+/*!
+ * Shadow of the per-channel control state.
+ * Getters are served from here so they do not compete with streaming for the control endpoint.
+ */
+struct ChannelShadow
+{
+    Shadow<double> frequency;
+    Shadow<double> sampleRate;
+    Shadow<double> bandwidth;
+    Shadow<double> gain;
+    Shadow<bool> gainMode;
+    Shadow<std::complex<double>> dcOffset;
+    Shadow<std::complex<double>> iqBalance;
+
+    //! gain ranges by stage name ("" for overall), with the frequency they were read at
+    std::map<std::string, std::pair<double, SoapySDR::Range>> gainRanges;
+};
+
+/*!
+ * Capabilities of a channel, probed once when the device is opened
+ */
+struct ChannelCaps
+{
+    ChannelCaps(void):
+        hasGainMode(false)
+    {
+        return;
+    }
+
+    bool hasGainMode;
+    std::vector<std::string> gainStages;
+    SoapySDR::RangeList frequencyRange;
+    SoapySDR::RangeList sampleRateRange;
+    SoapySDR::RangeList bandwidthRange;
+};
+
+/*!
+ * Maps hardware ticks to time:
+ * ticks from the epoch onward count at the rate, starting at timeNs.
+ */
+struct TickEpoch
+{
+    long long ticks;
+    long long timeNs;
+    bladerf_rational_rate rate;
+};
+
+/*!
+ * One validated entry of a configuration profile.
+ * Steps apply in order: device routing, then per channel
+ * rate, bandwidth, frequency, gain mode and gain, then bias tees.
+ */
+struct ProfileStep
+{
+    int order;
+    int direction;
+    size_t channel;
+    std::string key;
+    std::string value;
+};
+
+/*!
+ * A retune scheduled at a timestamp, used to tag the rx stream
+ */
+struct RetuneEvent
+{
+    size_t channel;
+    long long ticks;
+    double frequency;
+};
+
+/*!
+ * A preamble found in the rx stream, reported by readStreamStatus()
+ */
+struct PreambleEvent
+{
+    size_t channel; //index in the stream channels
+    long long timeNs; //time of the first preamble sample
+    size_t preamble;
+    float peak;
+    double frequency; //offset in Hz
+};
+
+/*!
+ * Fixed capacity store for quick tune profiles.
+ * Entries are held by value and keyed by (channel, frequency in Hz).
+ * Entries are never evicted: the RFIC hands out its fastlock profiles
+ * sequentially and only reclaims them when the FPGA is loaded,
+ * so the store is full once every hardware profile has been handed out.
+ */
+class QuickTuneCache
+{
+public:
+    typedef std::pair<size_t, uint64_t> Key;
+
+    QuickTuneCache(const size_t capacity):
+        _capacity(capacity),
+        _hits(0),
+        _misses(0)
+    {
+        return;
+    }
+
+    //! Lookup a quick tune, or return nullptr
+    const bladerf_quick_tune *find(const size_t channel, const uint64_t freqHz) const
+    {
+        auto it = _entries.find(Key(channel, freqHz));
+        if (it == _entries.end()) return nullptr;
+        return &it->second;
+    }
+
+    //! Insert or overwrite a quick tune, returns false when a new entry does not fit
+    bool insert(const size_t channel, const uint64_t freqHz, const bladerf_quick_tune &quickTune)
+    {
+        const Key key(channel, freqHz);
+        if (_entries.count(key) == 0 and this->full()) return false;
+        _entries[key] = quickTune;
+        return true;
+    }
+
+    void clear(void)
+    {
+        _entries.clear();
+    }
+
+    size_t size(void) const
+    {
+        return _entries.size();
+    }
+
+    size_t capacity(void) const
+    {
+        return _capacity;
+    }
+
+    bool full(void) const
+    {
+        return _entries.size() >= _capacity;
+    }
+
+    //! saveQuickTune statistics: a hit reuses a stored profile, a miss allocates a new one
+    void countHit(void) { _hits++; }
+    void countMiss(void) { _misses++; }
+    unsigned long long hits(void) const { return _hits; }
+    unsigned long long misses(void) const { return _misses; }
+
+private:
+    const size_t _capacity;
+    std::map<Key, bladerf_quick_tune> _entries;
+    unsigned long long _hits;
+    unsigned long long _misses;
+};
+
 /*!
  * The SoapySDR device interface for a blade RF.
  * The overloaded virtual methods calls into the blade RF C API.
@@ -51,8 +242,12 @@ class bladeRF_SoapySDR : public SoapySDR::Device
 {
 public:
 
-    //! initialize blade RF from device info
-    bladeRF_SoapySDR(const bladerf_devinfo &devinfo);
+    /*!
+     * Initialize blade RF from device info.
+     * A lazy init adopts the sample rates already programmed in the
+     * hardware instead of programming the default rates.
+     */
+    bladeRF_SoapySDR(const bladerf_devinfo &devinfo, const bool lazyInit = false);
 
     //! destructor shuts down and cleans up
     ~bladeRF_SoapySDR(void);
@@ -132,6 +327,21 @@ public:
         const long timeoutUs
     );
 
+    //! the capture snapshot of an rx stream in capture mode is read in place
+    size_t getNumDirectAccessBuffers(SoapySDR::Stream *stream);
+
+    int acquireReadBuffer(
+        SoapySDR::Stream *stream,
+        size_t &handle,
+        const void **buffs,
+        int &flags,
+        long long &timeNs,
+        const long timeoutUs = 100000);
+
+    void releaseReadBuffer(
+        SoapySDR::Stream *stream,
+        const size_t handle);
+
     /*******************************************************************
      * Antenna API
      ******************************************************************/
@@ -244,6 +454,8 @@ public:
 
     void setHardwareTime(const long long timeNs, const std::string &what = "");
 
+    void setCommandTime(const long long timeNs, const std::string &what = "");
+
     /*******************************************************************
      * Sensor API
      ******************************************************************/
@@ -279,6 +491,9 @@ public:
 
     std::string readSetting(const std::string &key) const;
 
+    //! True when the key names a device or channel setting of a configuration profile
+    static bool isProfileKey(const std::string &key);
+
     /*******************************************************************
      * GPIO API
      ******************************************************************/
@@ -299,6 +514,9 @@ public:
 
 private:
 
+    //! the aggregate driver aligns the boards with the exact tick conversions
+    friend class bladeRF_Aggregate;
+
     static bladerf_channel _toch(const int direction, const size_t channel)
     {
         return (direction == SOAPY_SDR_RX)?BLADERF_CHANNEL_RX(channel):BLADERF_CHANNEL_TX(channel);
@@ -330,24 +548,137 @@ private:
         return buff;
     }
 
+    //! Exact (value*mul)/div rounded to the nearest integer, without intermediate overflow
+    static long long _mulDiv(const long long value, const unsigned long long mul, const unsigned long long div)
+    {
+        const bool neg = value < 0;
+        const unsigned long long mag = neg?(0ull - (unsigned long long)(value)):(unsigned long long)(value);
+        #ifdef __SIZEOF_INT128__
+        const unsigned __int128 prod = (unsigned __int128)(mag)*mul;
+        const long long result = (long long)((prod + div/2)/div);
+        #else
+        const unsigned long long whole = mag/div, rem = mag%div;
+        const long long result = (long long)(whole*mul + (unsigned long long)(((long double)(rem)*mul)/div + 0.5L));
+        #endif
+        return neg?-result:result;
+    }
+
+    //! Convert ticks to nanoseconds using the exact rational sample rate
+    static long long _ticksToNs(const long long ticks, const bladerf_rational_rate &rate)
+    {
+        return _mulDiv(ticks, 1000000000ull*rate.den, rate.integer*rate.den + rate.num);
+    }
+
+    //! Convert nanoseconds to ticks using the exact rational sample rate
+    static long long _nsToTicks(const long long timeNs, const bladerf_rational_rate &rate)
+    {
+        return _mulDiv(timeNs, rate.integer*rate.den + rate.num, 1000000000ull*rate.den);
+    }
+
+    static long long _epochTicksToTimeNs(const long long ticks, const TickEpoch &epoch)
+    {
+        return epoch.timeNs + _ticksToNs(ticks - epoch.ticks, epoch.rate);
+    }
+
+    static long long _epochTimeNsToTicks(const long long timeNs, const TickEpoch &epoch)
+    {
+        return epoch.ticks + _nsToTicks(timeNs - epoch.timeNs, epoch.rate);
+    }
+
+    //! Copy of the current epoch of a direction
+    TickEpoch _epoch(const int direction) const
+    {
+        std::lock_guard<std::mutex> lock(_epochMutex);
+        return (direction == SOAPY_SDR_RX)?_rxEpoch:_txEpoch;
+    }
+
+    //ticks before the last rate change are converted with the previous rate
     long long _rxTicksToTimeNs(const long long ticks) const
     {
-        return SoapySDR::ticksToTimeNs(ticks, _rxSampRate) + _timeNsOffset;
+        std::lock_guard<std::mutex> lock(_epochMutex);
+        return _epochTicksToTimeNs(ticks, (ticks < _rxEpoch.ticks)?_rxPrevEpoch:_rxEpoch);
+    }
+
+    //! time of a sample produced by the rx processing chain, offset in ticks from a hardware tick
+    long long _rxTicksToTimeNs(const long long ticks, const double offset) const
+    {
+        const double whole = std::floor(offset);
+        return _rxTicksToTimeNs(ticks + (long long)(whole)) + std::llround((offset - whole)*1e9/_rxSampRate);
     }
 
     long long _timeNsToRxTicks(const long long timeNs) const
     {
-        return SoapySDR::timeNsToTicks(timeNs-_timeNsOffset, _rxSampRate);
+        std::lock_guard<std::mutex> lock(_epochMutex);
+        return _epochTimeNsToTicks(timeNs, (timeNs < _rxEpoch.timeNs)?_rxPrevEpoch:_rxEpoch);
     }
 
     long long _txTicksToTimeNs(const long long ticks) const
     {
-        return SoapySDR::ticksToTimeNs(ticks, _txSampRate) + _timeNsOffset;
+        std::lock_guard<std::mutex> lock(_epochMutex);
+        return _epochTicksToTimeNs(ticks, (ticks < _txEpoch.ticks)?_txPrevEpoch:_txEpoch);
     }
 
     long long _timeNsToTxTicks(const long long timeNs) const
     {
-        return SoapySDR::timeNsToTicks(timeNs-_timeNsOffset, _txSampRate);
+        std::lock_guard<std::mutex> lock(_epochMutex);
+        return _epochTimeNsToTicks(timeNs, (timeNs < _txEpoch.timeNs)?_txPrevEpoch:_txEpoch);
+    }
+
+    //! Read a shadowed channel value, returns false when it must be read back from the device
+    template <typename Type>
+    bool readShadow(Shadow<Type> ChannelShadow::*field, const int direction, const size_t channel, Type &value) const
+    {
+        std::lock_guard<std::mutex> lock(_shadowMutex);
+        const Shadow<Type> &shadow = _shadows[std::make_pair(direction, channel)].*field;
+        if (shadow.valid) value = shadow.value;
+        return shadow.valid;
+    }
+
+    //! Update a shadowed channel value after a write or a device read back
+    template <typename Type>
+    void writeShadow(Shadow<Type> ChannelShadow::*field, const int direction, const size_t channel, const Type &value) const
+    {
+        std::lock_guard<std::mutex> lock(_shadowMutex);
+        (_shadows[std::make_pair(direction, channel)].*field).set(value);
+    }
+
+    //! Mark a shadowed channel value as unknown, the next getter reads it back
+    template <typename Type>
+    void invalidateShadow(Shadow<Type> ChannelShadow::*field, const int direction, const size_t channel) const
+    {
+        std::lock_guard<std::mutex> lock(_shadowMutex);
+        (_shadows[std::make_pair(direction, channel)].*field).valid = false;
+    }
+
+    /*!
+     * Update a value shared by every channel of a direction:
+     * the channels of a bladeRF2 share one LO, one sample rate and one bandwidth per direction.
+     */
+    template <typename Type>
+    void writeSharedShadow(Shadow<Type> ChannelShadow::*field, const int direction, const Type &value) const
+    {
+        std::lock_guard<std::mutex> lock(_shadowMutex);
+        const size_t numChans = std::max<size_t>(1, (direction == SOAPY_SDR_RX)?_numRxChans:_numTxChans);
+        for (size_t ch = 0; ch < numChans; ch++) (_shadows[std::make_pair(direction, ch)].*field).set(value);
+    }
+
+    template <typename Type>
+    void invalidateSharedShadow(Shadow<Type> ChannelShadow::*field, const int direction) const
+    {
+        std::lock_guard<std::mutex> lock(_shadowMutex);
+        const size_t numChans = std::max<size_t>(1, (direction == SOAPY_SDR_RX)?_numRxChans:_numTxChans);
+        for (size_t ch = 0; ch < numChans; ch++) (_shadows[std::make_pair(direction, ch)].*field).valid = false;
+    }
+
+    //! True while a scheduled retune has not happened yet, the LO read back is then not shadowed
+    bool retunePending(const int direction) const;
+
+    //! Forget all shadowed state, used when the device may have changed behind our back
+    void invalidateShadows(void) const
+    {
+        std::lock_guard<std::mutex> lock(_shadowMutex);
+        _shadows.clear();
+        _clockSourceShadow.valid = false;
     }
 
     void updateRxMinTimeoutMs(void)
@@ -358,45 +689,303 @@ private:
 
     bool _isBladeRF1;
     bool _isBladeRF2;
-    double _rxSampRate;
-    double _txSampRate;
+    //the rates are written by setSampleRate() on the control thread and read by the stream threads
+    std::atomic<double> _rxSampRate;
+    std::atomic<double> _txSampRate;
+    TickEpoch _rxEpoch;
+    TickEpoch _rxPrevEpoch;
+    TickEpoch _txEpoch;
+    TickEpoch _txPrevEpoch;
+    mutable std::mutex _epochMutex; //the epochs are rebased by the stream, control and timed command threads
+    bool _rxRateChanged; //set with the rx epoch, under _epochMutex
     bool _inTxBurst;
     bool _rxFloats;
     bool _txFloats;
     bool _rxOverflow;
     long long _rxNextTicks;
     long long _txNextTicks;
-    long long _timeNsOffset;
     int16_t *_rxConvBuff;
     int16_t *_txConvBuff;
     size_t _rxBuffSize;
     size_t _txBuffSize;
     std::vector<size_t> _rxChans;
     std::vector<size_t> _txChans;
-    long _rxMinTimeoutMs;
+    std::atomic<long> _rxMinTimeoutMs;
+
+    //! per rx stream channel software correction, empty when disabled
+    std::vector<std::unique_ptr<IQCorrector>> _rxCorrectors;
+    const IQCorrector *_rxCorrector(const size_t channel) const
+    {
+        for (size_t i = 0; i < _rxChans.size() and i < _rxCorrectors.size(); i++)
+        {
+            if (_rxChans[i] == channel) return _rxCorrectors[i].get();
+        }
+        return nullptr;
+    }
+
+    /*!
+     * Per rx stream channel processing: correction, NCO and decimation.
+     * Empty when readStream() converts the samples directly.
+     */
+    std::vector<std::unique_ptr<RxChain>> _rxChains;
+
+    /*!
+     * Polyphase channelizer of rx channel 0. Its channels are exposed as
+     * virtual rx channels numbered after the hardware channels, in order of frequency.
+     */
+    size_t _channelizerSize; //number of virtual channels, 0 when disabled
+    bool _channelizerOversample;
+    std::unique_ptr<Channelizer> _rxChannelizer;
+    bool _isVirtualChannel(const int direction, const size_t channel) const
+    {
+        return direction == SOAPY_SDR_RX and channel >= _numRxChans and channel < _numRxChans + _channelizerSize;
+    }
+    //! center of a virtual channel relative to rx channel 0
+    double _virtualChannelOffset(const size_t channel) const
+    {
+        return (double(channel - _numRxChans) - double(_channelizerSize/2))*_rxSampRate/_channelizerSize;
+    }
+
+    //! hardware samples per rx stream sample and the hardware samples to read for numOut stream samples
+    double _rxStreamRatio(void) const
+    {
+        if (_rxChannelizer) return double(_rxChannelizer->ratio());
+        return _rxChains.empty()?1.0:_rxChains.front()->ratio();
+    }
+    size_t _rxMaxInput(const size_t numOut) const
+    {
+        if (_rxChannelizer) return _rxChannelizer->maxInput(numOut);
+        return _rxChains.empty()?numOut:_rxChains.front()->maxInput(numOut);
+    }
+    double _rxStreamRate(void) const
+    {
+        return _rxSampRate/_rxStreamRatio();
+    }
+
+    //! Per tx stream channel processing: interpolation and NCO, empty when writeStream() converts directly
+    std::vector<std::unique_ptr<TxChain>> _txChains;
+    double _txStreamRate(void) const
+    {
+        return _txChains.empty()?_txSampRate.load():_txSampRate/_txChains.front()->ratio();
+    }
+    bool _txMeta; //the tx stream carries timestamps
+
+    /*!
+     * Recording replayed by the tx stream after the tx_replay setting, null otherwise.
+     * A worker thread feeds the mapped file to the device in the wire format.
+     * The loop, time and period are latched from the tx_replay_* settings when it starts,
+     * the settings are rejected while it runs.
+     */
+    std::unique_ptr<MappedFile> _txReplay;
+    std::thread _txReplayThread;
+    std::atomic<bool> _txReplayRunning;
+    unsigned long long _txReplayLoops; //passes over the file, 0 repeats until stopped
+    long long _txReplayTimeNs; //start of the first pass, 0 starts now
+    double _txReplayPeriod; //seconds between the starts of the passes, 0 plays them back to back
+
+    /*!
+     * Averaged power spectrum of each rx stream channel in psd mode, empty otherwise.
+     * readStream() integrates the processed samples and returns the frames as F32.
+     */
+    std::vector<std::unique_ptr<PowerSpectrum>> _rxSpectrums;
+    std::vector<std::vector<std::complex<float>>> _rxSpectrumBuffs; //processed samples of one read
+    std::vector<std::vector<float>> _rxSpectrumFrames; //frame being returned
+    size_t _rxSpectrumOffset; //frame elements already returned
+    bool _rxSpectrumStarted;
+    long long _rxSpectrumStartNs; //time of the first integrated sample
+    unsigned long long _rxSpectrumCount; //samples integrated since then
+
+    /*!
+     * Gate of the rx stream in squelch and preamble modes, null otherwise.
+     * readStream() only returns the bursts, timed from the index of each contiguous run.
+     */
+    std::unique_ptr<EnergySquelch> _rxSquelch;
+    std::vector<std::vector<char>> _rxSquelchBuffs; //samples of one read
+    bool _rxPreambleGate; //the detections open the gate instead of the power
+
+    //! Preamble correlator of each rx stream channel, the detections are queued for readStreamStatus()
+    std::vector<std::unique_ptr<PreambleDetector>> _rxDetectors;
+    std::deque<PreambleEvent> _rxDetections;
+    mutable std::mutex _rxDetectionMutex;
+    std::condition_variable _rxDetectionCond;
+    PreambleEvent _rxLastDetection; //the last one returned by readStreamStatus()
+
+    //! Stream samples counted since setupStream() and the index and time of the first sample of each contiguous run
+    unsigned long long _rxRunIndex;
+    std::deque<std::pair<unsigned long long, long long>> _rxRunAnchors;
+
+    /*!
+     * History of the rx stream in capture mode, null otherwise. A worker thread
+     * fills it while the stream is active, readStream() and acquireReadBuffer()
+     * hand out the snapshot taken with the capture_trigger setting.
+     */
+    std::unique_ptr<CaptureRing> _rxCapture;
+    std::thread _rxCaptureThread;
+    std::atomic<bool> _rxCaptureRunning;
+    size_t _rxCaptureAcquired; //samples handed out by acquireReadBuffer()
+
+    //! Records the wire samples of the rx stream when the record_path stream arg is set
+    std::unique_ptr<SigMFRecorder> _rxRecorder;
+    std::vector<double> _rxScanFreqs;
+    size_t _rxScanDwell;
+    size_t _rxScanSettle;
+    size_t _rxScanIndex;
+    size_t _rxScanScheduled;
+    size_t _rxScanRemaining;
+    long long _rxScanStartTicks;
+    double _rxScanFreq;
+    std::deque<RetuneEvent> _rxRetunes; //sorted by ticks, inserted by setFrequency(), popped by the stream reader
+    std::mutex _rxRetuneMutex;
+    size_t _rxRetuneSettle;
+    long long _rxRetuneOffset;
+    double _rxRetuneFreq;
+    long long _cmdTimeNs;
+    std::multimap<long long, std::function<void(void)>> _timedCmds;
+    std::mutex _timedCmdMutex;
+    std::condition_variable _timedCmdCond;
+    std::thread _timedCmdThread;
+    bool _timedCmdDone;
+    mutable std::mutex _shadowMutex;
+    mutable std::map<std::pair<int, size_t>, ChannelShadow> _shadows;
+    mutable Shadow<std::string> _clockSourceShadow;
+    mutable std::atomic<long long> _rxRetuneUntil; //tick of the last scheduled rx retune, 0 when none
+    mutable std::atomic<long long> _txRetuneUntil;
     std::queue<StreamMetadata> _rxCmds;
     std::queue<StreamMetadata> _txResps;
     std::string _xb200Mode;
     std::string _samplingMode;
     std::string _loopbackMode;
 
+    /*!
+     * Trigger lines shared between boards: RX and TX triggers on channel 0 are
+     * configured together. Once armed, the samples are held until the trigger fires,
+     * the first rx sample at or after the arm time is the fire edge and defines time zero
+     * so that all boards on the line share a time base. Without an rx stream,
+     * writeStream() polls the trigger state and uses the tx time when it sees the fire.
+     */
+    std::string _triggerSignal;
+    std::string _triggerRole;
+    bladerf_trigger _rxTrigger;
+    bladerf_trigger _txTrigger;
+    std::atomic<bool> _triggerSync;
+    long long _triggerArmTicks; //rx time at the arm, earlier samples were streamed before it
+    void configureTriggers(const std::string &signal, const std::string &role);
+    void armTriggers(const bool arm);
+    //! Start the shared time base at ticks, once per arm, from the rx or tx stream
+    void rebaseOnTrigger(const long long ticks);
+    //! Rebase the time from the tx stream once the trigger fired, used without an rx stream
+    void pollTxTrigger(void);
+
     bladerf *_dev;
 
     /*!
-     * Will contain a list containing the info on the already computed quick tunes.
-     * The key is (direction, channel, frequency), as defined in setFrequency(direction, channel, name, frequency, args).
+     * Capability table, probed without side effects in the constructor
+     * and again when an XB200 is attached. Gain ranges depend on the tuned band on
+     * BladeRF2 and are cached with the channel shadow instead.
+     */
+    size_t _numRxChans;
+    size_t _numTxChans;
+    std::map<std::pair<int, size_t>, ChannelCaps> _caps;
+    std::vector<std::pair<std::string, bladerf_loopback>> _loopbackModes;
+    std::string _defaultLoopback;
+    void probeCapabilities(void);
+    const ChannelCaps &_channelCaps(const int direction, const size_t channel) const
+    {
+        auto it = _caps.find(std::make_pair(direction, channel));
+        if (it == _caps.end()) throw std::runtime_error("invalid channel " + std::to_string(channel));
+        return it->second;
+    }
+
+    //! Take over the rate programmed in the hardware without changing it, used by a lazy init
+    void adoptSampleRate(const int direction);
+
+    /*!
+     * Identifies an FPGA image file loaded into this device by the file hash and size,
+     * the FPGA size and the running FPGA version. Empty when any of them is unavailable.
+     */
+    std::string fpgaImageRecord(const std::string &path) const;
+    std::string _fpgaLoadResult;
+
+    /*!
+     * Named configuration profiles, stored validated and in apply order.
+     * The active profile is the last stored profile that was applied by name.
+     */
+    std::map<std::string, std::vector<ProfileStep>> _profiles;
+    std::string _activeProfile;
+    std::vector<ProfileStep> parseProfile(const std::string &json, std::string &name) const;
+    void storeProfile(const std::string &json);
+    void applyProfile(const std::string &value);
+
+    /*!
+     * Stores the already computed quick tunes, one store per direction.
+     * The key is (channel, frequency in Hz), as defined in setFrequency(direction, channel, name, frequency, args).
      * The value is the computed bladerf_quick_tune.
      * It is filled when calling setFrequency(direction, channel, name, frequency, args)
-     * with "saveQuickTune" in the args.
+     * with "saveQuickTune" in the args. The capacity matches the RFIC fastlock profile count.
      */
-    std::map<std::tuple<int, size_t, double>, bladerf_quick_tune*> _quickTunesByDirChanAndFreq;
+    QuickTuneCache _rxQuickTunes;
+    QuickTuneCache _txQuickTunes;
+    QuickTuneCache &_quickTunes(const int direction)
+    {
+        return (direction == SOAPY_SDR_RX)?_rxQuickTunes:_txQuickTunes;
+    }
     //! Gets the quick tune info at the current frequency. Only available on BladeRF2.
-    bladerf_quick_tune* getQuickTune(const int direction, const size_t channel) const;
+    bladerf_quick_tune getQuickTune(const int direction, const size_t channel) const;
     /*!
      * Retunes to a specific quick tune.Only available on BladeRF2.
      * This is usually not blocking (bladerf_schedule_retune is usually not blocking, unlike bladerf_set_frequency).
      */
-    void retune(const int direction, const size_t channel, long long timestamp, bladerf_quick_tune* conf);
+    void retune(const int direction, const size_t channel, long long timestamp, const bladerf_quick_tune &conf);
+    //! Retune at a timestamp and record rx retunes so that readStream() can tag them.
+    void scheduleRetune(const int direction, const size_t channel, long long timestamp, const bladerf_quick_tune &conf, const double frequency);
+    /*!
+     * Queue a control call to be applied by the timed command worker once the hardware time reaches timeNs.
+     * This is used for settings that cannot be scheduled by the hardware itself.
+     */
+    void queueTimedCommand(const long long timeNs, const std::function<void(void)> &command);
+    //! Applies queued timed commands in time order, runs in _timedCmdThread
+    void timedCommandWorker(void);
+    /*!
+     * Restart the scan schedule so that the given step begins at the given tick.
+     * Previously scheduled retunes on the scan channel are cancelled.
+     */
+    void startScan(const long long startTicks, const size_t step);
+    /*!
+     * The resampling ratio interp/decim between the hardware rate divided by factor and the stream rate.
+     * The hardware rate is moved slightly when that gives an exact ratio with few filter phases.
+     */
+    std::pair<size_t, size_t> resampleRatio(const int direction, const size_t channel, const double rate, const size_t factor);
+    //! One hardware read through the rx processing, readStream() in samples mode
+    int readStreamSamples(void * const *buffs, size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    //! Integrate reads until a power spectrum frame is complete, readStream() in psd mode
+    int readStreamSpectrum(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    //! Read until the squelch has burst samples, readStream() in squelch and preamble modes
+    int readStreamSquelch(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    //! Read the capture snapshot, readStream() in capture mode
+    int readStreamCapture(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    //! Fills the capture history from the rx stream, runs in _rxCaptureThread
+    void captureWorker(void);
+    void stopCapture(void);
+    //! Map the recording at path and replay it on the tx stream
+    void startReplay(const std::string &path);
+    //! Feeds the replayed file to the device, runs in _txReplayThread. Passes are untimed when periodTicks and startTicks are 0.
+    void replayWorker(const unsigned long long loops, const long long startTicks, const long long periodTicks);
+    void stopReplay(void);
+    //! Count n stream samples read at timeNs, returns true when they do not follow the previous ones
+    bool trackRxRun(const size_t n, const long long timeNs);
+    //! Time of a stream sample index of a recorded run
+    long long rxRunTimeNs(const unsigned long long index) const;
+    //! Correlate n samples of each stream channel and queue the detections
+    std::vector<PreambleDetector::Detection> detectPreambles(const std::complex<float> * const *buffs, const size_t n, const bool restart);
+    //! Schedule quick tune retunes for the upcoming scan steps, returns a bladerf error code
+    int scheduleScanRetunes(void);
+    //! The tick at which a scan step begins (retune time, before settling)
+    long long scanStepTicks(const size_t step) const
+    {
+        return _rxScanStartTicks + (long long)(step*(_rxScanSettle + _rxScanDwell));
+    }
     //! Sets the RF frequency. Throws a runtime_error if bladerf_set_frequency is unsuccessful.
     void setRfFrequency(const int direction, const size_t channel, const double frequency);
+    //! Shadow the gain read back after a gain change
+    void shadowGain(const int direction, const size_t channel);
 };
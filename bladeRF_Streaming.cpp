@@ -27,9 +27,34 @@
 #include <thread>
 #include <chrono>
 #include <cstring> //memset
+#include <cstdlib> //llabs
+#include <cctype> //isspace
+#include <algorithm> //find
+#include <cmath>
+#include <sstream>
+#include <fstream>
+#include <set>
 
 #define DEF_NUM_BUFFS 32
 #define DEF_BUFF_LEN 4096
+#define DEF_SCAN_SETTLE 1024
+#define SCAN_LOOKAHEAD 8 //retunes queued ahead of the current dwell
+#define SCAN_LEAD_US 10000 //time from activation to the first scan step
+#define DDC_MAX_DECIM 512
+#define DUC_MAX_INTERP 512
+#define RESAMPLE_MAX_PHASES 1024 //limit on both terms of the resampling ratio
+#define RESAMPLE_RATE_TOLERANCE 0.01 //relative hardware rate change allowed for an exact resampling ratio
+#define CHANNELIZER_THREAD_MIN 256 //channelizer size from which frames are split between threads
+#define CHANNELIZER_MAX_THREADS 4
+#define PSD_MAX_SIZE 65536
+#define PSD_THREAD_MIN 1024 //psd size from which the transforms are split between threads
+#define PSD_MAX_THREADS 4
+#define SQUELCH_MAX_WINDOW 65536
+#define PREAMBLE_MAX_LENGTH 16384
+#define PREAMBLE_MAX_EVENTS 1024 //oldest detections are dropped when readStreamStatus() falls behind
+#define CAPTURE_TIMEOUT_US 100000 //capture worker reads, also the time to stop it
+#define REPLAY_TIMEOUT_MS 100 //replay worker writes, also the time to stop it
+#define REPLAY_LEAD_US 10000 //time from the tx_replay setting to the first timed pass
 
 std::vector<std::string> bladeRF_SoapySDR::getStreamFormats(const int, const size_t) const
 {
@@ -42,7 +67,7 @@ std::string bladeRF_SoapySDR::getNativeStreamFormat(const int, const size_t, dou
     return SOAPY_SDR_CS16;
 }
 
-SoapySDR::ArgInfoList bladeRF_SoapySDR::getStreamArgsInfo(const int, const size_t) const
+SoapySDR::ArgInfoList bladeRF_SoapySDR::getStreamArgsInfo(const int direction, const size_t) const
 {
     SoapySDR::ArgInfoList streamArgs;
 
@@ -85,9 +110,301 @@ SoapySDR::ArgInfoList bladeRF_SoapySDR::getStreamArgsInfo(const int, const size_
     xfersArg.optionNames = {"Automatic", "Metadata Streams", "Normal Streams"};
     streamArgs.push_back(metaArg);
 
+    if (direction == SOAPY_SDR_RX)
+    {
+        SoapySDR::ArgInfo scanFreqsArg;
+        scanFreqsArg.key = "scan_freqs";
+        scanFreqsArg.value = "";
+        scanFreqsArg.name = "Scan Frequencies";
+        scanFreqsArg.description = "Comma separated list of center frequencies to sweep over.\n"
+            "Each readStream() block is one dwell at a single frequency, ended by SOAPY_SDR_END_BURST. "
+            "Read the scan_frequency setting for the center frequency of the last block. Only available on BladeRF2.";
+        scanFreqsArg.units = "Hz";
+        scanFreqsArg.type = SoapySDR::ArgInfo::STRING;
+        streamArgs.push_back(scanFreqsArg);
+
+        SoapySDR::ArgInfo scanDwellArg;
+        scanDwellArg.key = "scan_dwell";
+        scanDwellArg.value = "0";
+        scanDwellArg.name = "Scan Dwell";
+        scanDwellArg.description = "Number of samples delivered per scan frequency. Use 0 for the buffer length.";
+        scanDwellArg.units = "samples";
+        scanDwellArg.type = SoapySDR::ArgInfo::INT;
+        streamArgs.push_back(scanDwellArg);
+
+        SoapySDR::ArgInfo scanSettleArg;
+        scanSettleArg.key = "scan_settle";
+        scanSettleArg.value = std::to_string(DEF_SCAN_SETTLE);
+        scanSettleArg.name = "Scan Settling";
+        scanSettleArg.description = "Number of samples discarded after each retune.";
+        scanSettleArg.units = "samples";
+        scanSettleArg.type = SoapySDR::ArgInfo::INT;
+        streamArgs.push_back(scanSettleArg);
+
+        SoapySDR::ArgInfo retuneSettleArg;
+        retuneSettleArg.key = "retune_settle";
+        retuneSettleArg.value = "0";
+        retuneSettleArg.name = "Retune Settling";
+        retuneSettleArg.description = "Number of samples dropped after a timed reuseQuickTune retune.\n"
+            "The first buffer at the new frequency is flagged with SOAPY_SDR_USER_FLAG2, "
+            "read the retune_offset and retune_frequency settings for the sample offset and frequency.\n"
+            "After a setSampleRate() on the active stream, the first buffer at the new rate is flagged with SOAPY_SDR_USER_FLAG3.";
+        retuneSettleArg.units = "samples";
+        retuneSettleArg.type = SoapySDR::ArgInfo::INT;
+        streamArgs.push_back(retuneSettleArg);
+
+        SoapySDR::ArgInfo correctionArg;
+        correctionArg.key = "correction";
+        correctionArg.value = "off";
+        correctionArg.name = "Software Correction";
+        correctionArg.description = "Track and remove the residual DC offset and IQ imbalance during the CF32 conversion.\n"
+            "The estimates can be read with the DC_ESTIMATE and IQ_ESTIMATE channel sensors.";
+        correctionArg.type = SoapySDR::ArgInfo::STRING;
+        correctionArg.options = {"off", "dc", "dciq"};
+        correctionArg.optionNames = {"Off", "DC Offset", "DC Offset and IQ Imbalance"};
+        streamArgs.push_back(correctionArg);
+
+        SoapySDR::ArgInfo ddcFreqArg;
+        ddcFreqArg.key = "ddc_freq";
+        ddcFreqArg.value = "0";
+        ddcFreqArg.name = "DDC Frequency";
+        ddcFreqArg.description = "Offset from the tuned center frequency that is shifted to 0 Hz before decimation.\n"
+            "The offset is converted with the sample rate at setupStream(), setup the stream again after changing the rate. "
+            "Requires a CF32 stream.";
+        ddcFreqArg.units = "Hz";
+        ddcFreqArg.type = SoapySDR::ArgInfo::FLOAT;
+        streamArgs.push_back(ddcFreqArg);
+
+        SoapySDR::ArgInfo ddcDecimArg;
+        ddcDecimArg.key = "ddc_decim";
+        ddcDecimArg.value = "1";
+        ddcDecimArg.name = "DDC Decimation";
+        ddcDecimArg.description = "Decimate by this factor with a lowpass FIR after the DDC mixer.\n"
+            "readStream() returns samples and timestamps at the decimated rate, read the rx_stream_rate setting for it. "
+            "Requires a CF32 stream.";
+        ddcDecimArg.type = SoapySDR::ArgInfo::INT;
+        ddcDecimArg.range = SoapySDR::Range(1, DDC_MAX_DECIM);
+        streamArgs.push_back(ddcDecimArg);
+    }
+
+    SoapySDR::ArgInfo resampleArg;
+    resampleArg.key = "resample_rate";
+    resampleArg.value = "0";
+    resampleArg.name = "Resample Rate";
+    resampleArg.description = "Stream at exactly this rate with a rational resampler, use 0 to stream at the hardware rate.\n"
+        "The hardware rate is moved by up to 1% when that makes the resampling ratio small, "
+        "read the " + std::string((direction == SOAPY_SDR_RX)?"rx":"tx") + "_stream_rate setting for the achieved rate. "
+        "Requires a CF32 stream.";
+    resampleArg.units = "Sps";
+    resampleArg.type = SoapySDR::ArgInfo::FLOAT;
+    streamArgs.push_back(resampleArg);
+
+    if (direction == SOAPY_SDR_RX)
+    {
+        SoapySDR::ArgInfo modeArg;
+        modeArg.key = "mode";
+        modeArg.value = "samples";
+        modeArg.name = "Stream Mode";
+        modeArg.description = "Stream the samples, their averaged power spectrum or only the samples around activity.\n"
+            "In psd mode the stream format is F32 and readStream() returns one frame of psd_size powers per average, "
+            "from the lowest frequency up and relative to a full scale tone. "
+            "A frame is one burst timestamped at its first sample, it can be read in several calls.\n"
+            "In squelch mode readStream() only returns bursts whose power exceeds squelch_level, "
+            "padded by squelch_pre and squelch_post samples and ended with an end of burst flag.\n"
+            "In preamble mode the bursts are the detected preambles instead, with the same padding.\n"
+            "In capture mode a driver thread keeps the last capture_pre seconds while the stream is active, "
+            "readStream() returns the snapshot taken with the capture_trigger setting as one burst.";
+        modeArg.type = SoapySDR::ArgInfo::STRING;
+        modeArg.options = {"samples", "psd", "squelch", "preamble", "capture"};
+        modeArg.optionNames = {"Samples", "Power Spectrum", "Energy Squelch", "Preamble Gate", "Capture"};
+        streamArgs.push_back(modeArg);
+
+        SoapySDR::ArgInfo psdSizeArg;
+        psdSizeArg.key = "psd_size";
+        psdSizeArg.value = "1024";
+        psdSizeArg.name = "PSD Size";
+        psdSizeArg.description = "Number of FFT bins of the power spectrum, a power of 2.";
+        psdSizeArg.type = SoapySDR::ArgInfo::INT;
+        psdSizeArg.range = SoapySDR::Range(16, PSD_MAX_SIZE);
+        streamArgs.push_back(psdSizeArg);
+
+        SoapySDR::ArgInfo psdWindowArg;
+        psdWindowArg.key = "psd_window";
+        psdWindowArg.value = "hann";
+        psdWindowArg.name = "PSD Window";
+        psdWindowArg.description = "Window applied before each FFT of the power spectrum.";
+        psdWindowArg.type = SoapySDR::ArgInfo::STRING;
+        psdWindowArg.options = {"rect", "hann", "hamming", "blackmanharris"};
+        psdWindowArg.optionNames = {"Rectangular", "Hann", "Hamming", "Blackman-Harris"};
+        streamArgs.push_back(psdWindowArg);
+
+        SoapySDR::ArgInfo psdOverlapArg;
+        psdOverlapArg.key = "psd_overlap";
+        psdOverlapArg.value = "0.5";
+        psdOverlapArg.name = "PSD Overlap";
+        psdOverlapArg.description = "Fraction of each FFT shared with the next one.";
+        psdOverlapArg.type = SoapySDR::ArgInfo::FLOAT;
+        psdOverlapArg.range = SoapySDR::Range(0.0, 0.95);
+        streamArgs.push_back(psdOverlapArg);
+
+        SoapySDR::ArgInfo psdAverageArg;
+        psdAverageArg.key = "psd_average";
+        psdAverageArg.value = "16";
+        psdAverageArg.name = "PSD Average";
+        psdAverageArg.description = "Number of FFTs averaged into each power spectrum frame.";
+        psdAverageArg.type = SoapySDR::ArgInfo::INT;
+        psdAverageArg.range = SoapySDR::Range(1, 1 << 20);
+        streamArgs.push_back(psdAverageArg);
+
+        SoapySDR::ArgInfo squelchLevelArg;
+        squelchLevelArg.key = "squelch_level";
+        squelchLevelArg.value = "-40";
+        squelchLevelArg.name = "Squelch Level";
+        squelchLevelArg.description = "Average power relative to full scale on any channel that opens the squelch.";
+        squelchLevelArg.units = "dBFS";
+        squelchLevelArg.type = SoapySDR::ArgInfo::FLOAT;
+        squelchLevelArg.range = SoapySDR::Range(-120.0, 0.0);
+        streamArgs.push_back(squelchLevelArg);
+
+        SoapySDR::ArgInfo squelchWindowArg;
+        squelchWindowArg.key = "squelch_window";
+        squelchWindowArg.value = "64";
+        squelchWindowArg.name = "Squelch Window";
+        squelchWindowArg.description = "Number of samples the squelch power is averaged over.";
+        squelchWindowArg.type = SoapySDR::ArgInfo::INT;
+        squelchWindowArg.range = SoapySDR::Range(1, SQUELCH_MAX_WINDOW);
+        streamArgs.push_back(squelchWindowArg);
+
+        SoapySDR::ArgInfo squelchPreArg;
+        squelchPreArg.key = "squelch_pre";
+        squelchPreArg.value = "1024";
+        squelchPreArg.name = "Squelch Pre Padding";
+        squelchPreArg.description = "Number of samples returned before the squelch opens.";
+        squelchPreArg.type = SoapySDR::ArgInfo::INT;
+        streamArgs.push_back(squelchPreArg);
+
+        SoapySDR::ArgInfo squelchPostArg;
+        squelchPostArg.key = "squelch_post";
+        squelchPostArg.value = "1024";
+        squelchPostArg.name = "Squelch Post Padding";
+        squelchPostArg.description = "Number of samples returned after the last sample above the level.";
+        squelchPostArg.type = SoapySDR::ArgInfo::INT;
+        streamArgs.push_back(squelchPostArg);
+
+        SoapySDR::ArgInfo preambleArg;
+        preambleArg.key = "preamble";
+        preambleArg.value = "";
+        preambleArg.name = "Preambles";
+        preambleArg.description = "Comma separated files of reference preambles to detect, as raw CF32 samples at the stream rate.\n"
+            "Each channel is correlated against them, readStreamStatus() returns a detection with the channel mask "
+            "and the time of the first preamble sample. The preamble index, normalized peak and frequency offset "
+            "of the last returned detection are read with the detection_preamble, detection_peak and detection_frequency settings. "
+            "Requires a CF32 stream.";
+        preambleArg.type = SoapySDR::ArgInfo::STRING;
+        streamArgs.push_back(preambleArg);
+
+        SoapySDR::ArgInfo preambleThresholdArg;
+        preambleThresholdArg.key = "preamble_threshold";
+        preambleThresholdArg.value = "0.5";
+        preambleThresholdArg.name = "Preamble Threshold";
+        preambleThresholdArg.description = "Correlation normalized by the preamble and sample energies above which a preamble is detected.";
+        preambleThresholdArg.type = SoapySDR::ArgInfo::FLOAT;
+        preambleThresholdArg.range = SoapySDR::Range(0.0, 1.0);
+        streamArgs.push_back(preambleThresholdArg);
+
+        SoapySDR::ArgInfo capturePreArg;
+        capturePreArg.key = "capture_pre";
+        capturePreArg.value = "1.0";
+        capturePreArg.name = "Capture Pre Trigger";
+        capturePreArg.description = "Time kept before the trigger in capture mode, the history is allocated at setupStream().";
+        capturePreArg.units = "s";
+        capturePreArg.type = SoapySDR::ArgInfo::FLOAT;
+        streamArgs.push_back(capturePreArg);
+
+        SoapySDR::ArgInfo capturePostArg;
+        capturePostArg.key = "capture_post";
+        capturePostArg.value = "0.1";
+        capturePostArg.name = "Capture Post Trigger";
+        capturePostArg.description = "Time captured from the trigger in capture mode.";
+        capturePostArg.units = "s";
+        capturePostArg.type = SoapySDR::ArgInfo::FLOAT;
+        streamArgs.push_back(capturePostArg);
+
+        SoapySDR::ArgInfo recordPathArg;
+        recordPathArg.key = "record_path";
+        recordPathArg.value = "";
+        recordPathArg.name = "Record Path";
+        recordPathArg.description = "Record the rx samples to a SigMF recording of this name, without the .sigmf-data extension.";
+        recordPathArg.type = SoapySDR::ArgInfo::STRING;
+        streamArgs.push_back(recordPathArg);
+
+        SoapySDR::ArgInfo recordFormatArg;
+        recordFormatArg.key = "record_format";
+        recordFormatArg.value = "cs16";
+        recordFormatArg.name = "Record Format";
+        recordFormatArg.description = "Sample format of the recording, the wire format is written as is.";
+        recordFormatArg.type = SoapySDR::ArgInfo::STRING;
+        recordFormatArg.options = {"cs16"};
+        recordFormatArg.optionNames = {"Complex int16"};
+        streamArgs.push_back(recordFormatArg);
+
+        SoapySDR::ArgInfo recordRotateArg;
+        recordRotateArg.key = "record_rotate";
+        recordRotateArg.value = "0";
+        recordRotateArg.name = "Record Rotate";
+        recordRotateArg.description = "Start a new numbered recording after this time, 0 records to a single recording.";
+        recordRotateArg.units = "s";
+        recordRotateArg.type = SoapySDR::ArgInfo::FLOAT;
+        streamArgs.push_back(recordRotateArg);
+    }
+
+    if (direction == SOAPY_SDR_TX)
+    {
+        SoapySDR::ArgInfo ducFreqArg;
+        ducFreqArg.key = "duc_freq";
+        ducFreqArg.value = "0";
+        ducFreqArg.name = "DUC Frequency";
+        ducFreqArg.description = "Offset from the tuned center frequency that the interpolated samples are shifted to.\n"
+            "The offset is converted with the sample rate at setupStream(), setup the stream again after changing the rate. "
+            "Requires a CF32 stream.";
+        ducFreqArg.units = "Hz";
+        ducFreqArg.type = SoapySDR::ArgInfo::FLOAT;
+        streamArgs.push_back(ducFreqArg);
+
+        SoapySDR::ArgInfo ducInterpArg;
+        ducInterpArg.key = "duc_interp";
+        ducInterpArg.value = "1";
+        ducInterpArg.name = "DUC Interpolation";
+        ducInterpArg.description = "Interpolate by this factor with a lowpass FIR before the DUC mixer.\n"
+            "writeStream() takes samples at the interpolated rate divided by this factor, read the tx_stream_rate setting for it. "
+            "Timestamps mark the first sample of a burst at the output and an end of burst flushes the filter. "
+            "Requires a CF32 stream.";
+        ducInterpArg.type = SoapySDR::ArgInfo::INT;
+        ducInterpArg.range = SoapySDR::Range(1, DUC_MAX_INTERP);
+        streamArgs.push_back(ducInterpArg);
+    }
+
     return streamArgs;
 }
 
+//! Reference preamble stored as raw CF32 samples
+static std::vector<std::complex<float>> loadPreamble(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (not file) throw std::runtime_error("setupStream cannot open preamble " + path);
+    const std::streamoff bytes = file.tellg();
+    const size_t size = size_t(bytes)/sizeof(std::complex<float>);
+    if (bytes <= 0 or (bytes % sizeof(std::complex<float>)) != 0 or size > PREAMBLE_MAX_LENGTH)
+    {
+        throw std::runtime_error("setupStream preamble " + path + " is not 1 to " + std::to_string(PREAMBLE_MAX_LENGTH) + " CF32 samples");
+    }
+    std::vector<std::complex<float>> samples(size);
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(samples.data()), bytes);
+    if (not file) throw std::runtime_error("setupStream cannot read preamble " + path);
+    return samples;
+}
+
 SoapySDR::Stream *bladeRF_SoapySDR::setupStream(
     const int direction,
     const std::string &format,
@@ -97,12 +414,36 @@ SoapySDR::Stream *bladeRF_SoapySDR::setupStream(
     auto channels = channels_;
     if (channels.empty()) channels.push_back(0);
 
+    //psd mode integrates the CF32 samples into F32 power spectrum frames
+    const std::string mode = (args.count("mode") == 0)? "samples" : args.at("mode");
+    if (mode != "samples" and mode != "psd" and mode != "squelch" and mode != "preamble" and mode != "capture") throw std::runtime_error("setupStream invalid mode " + mode);
+    const bool psd = mode == "psd";
+    const bool squelch = mode == "squelch" or mode == "preamble";
+    const bool capture = mode == "capture";
+    if (capture and direction != SOAPY_SDR_RX) throw std::runtime_error("setupStream capture mode requires an rx stream");
+    if (psd and (direction != SOAPY_SDR_RX or format != SOAPY_SDR_F32)) throw std::runtime_error("setupStream psd mode requires an rx F32 stream");
+    if (squelch and direction != SOAPY_SDR_RX) throw std::runtime_error("setupStream " + mode + " mode requires an rx stream");
+    const std::string sampleFormat = psd?SOAPY_SDR_CF32:format;
+
     //meta mode, automatically on in single channel mode
     auto metaMode = (args.count("meta") == 0)? "auto" : args.at("meta");
     bladerf_format sync_format = BLADERF_FORMAT_SC16_Q11;
     if (metaMode == "meta") sync_format = BLADERF_FORMAT_SC16_Q11_META;
     if (metaMode == "normal") sync_format = BLADERF_FORMAT_SC16_Q11;
 
+    //channelizer channels are all streamed from rx channel 0
+    std::vector<size_t> virtualChans;
+    if (direction == SOAPY_SDR_RX and std::any_of(channels.begin(), channels.end(), [this](const size_t ch){return ch >= _numRxChans;}))
+    {
+        for (const auto ch : channels)
+        {
+            if (not _isVirtualChannel(direction, ch)) throw std::runtime_error("setupStream invalid channel selection");
+        }
+        virtualChans = channels;
+        channels = {0};
+        if (sampleFormat != SOAPY_SDR_CF32) throw std::runtime_error("setupStream channelizer requires a CF32 stream");
+    }
+
     //check the channel configuration
     bladerf_channel_layout layout;
     if (channels.size() == 1 and (channels.at(0) == 0 or channels.at(0) == 1))
@@ -120,11 +461,135 @@ SoapySDR::Stream *bladeRF_SoapySDR::setupStream(
         throw std::runtime_error("setupStream invalid channel selection");
     }
 
+    //parse the scan configuration, the scan relies on timestamps and quick tunes
+    std::vector<double> scanFreqs;
+    if (direction == SOAPY_SDR_RX and args.count("scan_freqs") != 0)
+    {
+        std::stringstream ss(args.at("scan_freqs"));
+        std::string freq;
+        while (std::getline(ss, freq, ','))
+        {
+            if (not freq.empty()) scanFreqs.push_back(std::stod(freq));
+        }
+    }
+    if (not scanFreqs.empty())
+    {
+        if (sync_format != BLADERF_FORMAT_SC16_Q11_META) throw std::runtime_error("setupStream scan requires meta mode");
+        //saved quick tunes are never evicted, only the new frequencies need a free profile
+        std::set<uint64_t> newFreqs;
+        for (const auto freq : scanFreqs)
+        {
+            const uint64_t freqHz = uint64_t(std::llround(freq));
+            if (_rxQuickTunes.find(channels.at(0), freqHz) == nullptr) newFreqs.insert(freqHz);
+        }
+        if (_rxQuickTunes.size() + newFreqs.size() > _rxQuickTunes.capacity()) throw std::runtime_error("setupStream scan has too many frequencies for the free quick tune profiles");
+    }
+
+    //the recording is written in the wire format
+    const std::string recordPath = (direction == SOAPY_SDR_RX and args.count("record_path") != 0)? args.at("record_path") : "";
+    const std::string recordFormat = (args.count("record_format") == 0)? "cs16" : args.at("record_format");
+    if (not recordPath.empty() and recordFormat != "cs16") throw std::runtime_error("setupStream invalid record_format " + recordFormat);
+    if (not recordPath.empty() and sync_format != BLADERF_FORMAT_SC16_Q11_META) throw std::runtime_error("setupStream recording requires meta mode");
+
     //check the format
-    if (format == SOAPY_SDR_CF32) {}
-    else if (format == SOAPY_SDR_CS16) {}
+    if (sampleFormat == SOAPY_SDR_CF32) {}
+    else if (sampleFormat == SOAPY_SDR_CS16) {}
     else throw std::runtime_error("setupStream invalid format " + format);
 
+    //software correction runs in the float conversion
+    const std::string correction = (args.count("correction") == 0)? "off" : args.at("correction");
+    if (correction != "off" and correction != "dc" and correction != "dciq") throw std::runtime_error("setupStream invalid correction " + correction);
+    if (correction != "off" and (direction != SOAPY_SDR_RX or sampleFormat != SOAPY_SDR_CF32)) throw std::runtime_error("setupStream correction requires an rx CF32 stream");
+
+    //digital downconversion also runs on the float samples
+    const double ddcFreq = (args.count("ddc_freq") == 0)? 0.0 : std::stod(args.at("ddc_freq"));
+    const long ddcDecim = (args.count("ddc_decim") == 0)? 1 : std::stol(args.at("ddc_decim"));
+    const bool ddc = ddcFreq != 0.0 or ddcDecim != 1;
+    if (ddcDecim < 1 or ddcDecim > DDC_MAX_DECIM) throw std::runtime_error("setupStream invalid ddc_decim " + std::to_string(ddcDecim));
+    if (ddc and (direction != SOAPY_SDR_RX or sampleFormat != SOAPY_SDR_CF32)) throw std::runtime_error("setupStream ddc requires an rx CF32 stream");
+    if (ddc and std::abs(ddcFreq) >= _rxSampRate/2) throw std::runtime_error("setupStream ddc_freq outside of the sample rate");
+    if (ddc and not scanFreqs.empty()) throw std::runtime_error("setupStream ddc is not supported with a scan");
+
+    //digital upconversion converts the float samples
+    const double ducFreq = (args.count("duc_freq") == 0)? 0.0 : std::stod(args.at("duc_freq"));
+    const long ducInterp = (args.count("duc_interp") == 0)? 1 : std::stol(args.at("duc_interp"));
+    const bool duc = ducFreq != 0.0 or ducInterp != 1;
+    if (ducInterp < 1 or ducInterp > DUC_MAX_INTERP) throw std::runtime_error("setupStream invalid duc_interp " + std::to_string(ducInterp));
+    if (duc and (direction != SOAPY_SDR_TX or format != SOAPY_SDR_CF32)) throw std::runtime_error("setupStream duc requires a tx CF32 stream");
+    if (duc and std::abs(ducFreq) >= _txSampRate/2) throw std::runtime_error("setupStream duc_freq outside of the sample rate");
+
+    //resampling follows the decimation on rx and precedes the interpolation on tx
+    const double resampleRate = (args.count("resample_rate") == 0)? 0.0 : std::stod(args.at("resample_rate"));
+    if (resampleRate < 0.0) throw std::runtime_error("setupStream invalid resample_rate " + args.at("resample_rate"));
+    if (resampleRate != 0.0 and sampleFormat != SOAPY_SDR_CF32) throw std::runtime_error("setupStream resample_rate requires a CF32 stream");
+    if (resampleRate != 0.0 and not scanFreqs.empty()) throw std::runtime_error("setupStream resample_rate is not supported with a scan");
+    if (not virtualChans.empty() and (ddc or resampleRate != 0.0 or not scanFreqs.empty()))
+    {
+        throw std::runtime_error("setupStream channelizer channels do not support ddc, resample_rate or a scan");
+    }
+    //preambles are correlated on the stream samples
+    std::vector<std::vector<std::complex<float>>> preambles;
+    if (direction == SOAPY_SDR_RX and args.count("preamble") != 0)
+    {
+        std::stringstream ss(args.at("preamble"));
+        std::string path;
+        while (std::getline(ss, path, ','))
+        {
+            if (not path.empty()) preambles.push_back(loadPreamble(path));
+        }
+    }
+    const double preambleThreshold = (args.count("preamble_threshold") == 0)? 0.5 : std::stod(args.at("preamble_threshold"));
+    if (preambleThreshold <= 0.0 or preambleThreshold > 1.0) throw std::runtime_error("setupStream invalid preamble_threshold " + args.at("preamble_threshold"));
+    if (not preambles.empty() and (psd or sampleFormat != SOAPY_SDR_CF32)) throw std::runtime_error("setupStream preamble requires a CF32 stream");
+    if (mode == "preamble" and preambles.empty()) throw std::runtime_error("setupStream preamble mode requires a preamble");
+    if (capture and not preambles.empty()) throw std::runtime_error("setupStream preamble is not supported in capture mode");
+    if ((psd or squelch or capture) and not scanFreqs.empty()) throw std::runtime_error("setupStream " + mode + " mode is not supported with a scan");
+
+    //the mode arguments are checked before the hardware is touched
+    const long psdSize = (args.count("psd_size") == 0)? 1024 : std::stol(args.at("psd_size"));
+    const std::string psdWindow = (args.count("psd_window") == 0)? "hann" : args.at("psd_window");
+    const double psdOverlap = (args.count("psd_overlap") == 0)? 0.5 : std::stod(args.at("psd_overlap"));
+    const long psdAverage = (args.count("psd_average") == 0)? 16 : std::stol(args.at("psd_average"));
+    if (psd and (psdSize < 16 or psdSize > PSD_MAX_SIZE or (psdSize & (psdSize-1)) != 0)) throw std::runtime_error("setupStream invalid psd_size " + std::to_string(psdSize));
+    if (psd and psdWindow != "rect" and psdWindow != "hann" and psdWindow != "hamming" and psdWindow != "blackmanharris") throw std::runtime_error("setupStream invalid psd_window " + psdWindow);
+    if (psd and (psdOverlap < 0.0 or psdOverlap > 0.95)) throw std::runtime_error("setupStream invalid psd_overlap " + args.at("psd_overlap"));
+    if (psd and psdAverage < 1) throw std::runtime_error("setupStream invalid psd_average " + std::to_string(psdAverage));
+
+    const double squelchLevel = (args.count("squelch_level") == 0)? -40.0 : std::stod(args.at("squelch_level"));
+    const long squelchWindow = (args.count("squelch_window") == 0)? 64 : std::stol(args.at("squelch_window"));
+    const long squelchPre = (args.count("squelch_pre") == 0)? 1024 : std::stol(args.at("squelch_pre"));
+    const long squelchPost = (args.count("squelch_post") == 0)? 1024 : std::stol(args.at("squelch_post"));
+    if (squelch and squelchLevel > 0.0) throw std::runtime_error("setupStream invalid squelch_level " + args.at("squelch_level"));
+    if (squelch and (squelchWindow < 1 or squelchWindow > SQUELCH_MAX_WINDOW)) throw std::runtime_error("setupStream invalid squelch_window " + std::to_string(squelchWindow));
+    if (squelch and (squelchPre < 0 or squelchPost < 0)) throw std::runtime_error("setupStream invalid squelch padding");
+
+    const double capturePre = (args.count("capture_pre") == 0)? 1.0 : std::stod(args.at("capture_pre"));
+    const double capturePost = (args.count("capture_post") == 0)? 0.1 : std::stod(args.at("capture_post"));
+    if (capture and (capturePre < 0.0 or capturePost < 0.0 or capturePre + capturePost <= 0.0)) throw std::runtime_error("setupStream invalid capture_pre or capture_post");
+
+    //the recorder writes the interleaved wire samples at the hardware rate
+    const double recordRotate = (args.count("record_rotate") == 0)? 0.0 : std::stod(args.at("record_rotate"));
+    if (recordRotate < 0.0) throw std::runtime_error("setupStream invalid record_rotate " + args.at("record_rotate"));
+    std::unique_ptr<SigMFRecorder> recorder;
+    if (not recordPath.empty())
+    {
+        try
+        {
+            recorder.reset(new SigMFRecorder(recordPath, channels.size(), _rxSampRate, (unsigned long long)(std::llround(recordRotate*_rxSampRate)), this->getHardwareKey()));
+        }
+        catch (const std::exception &ex)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "setupStream cannot record to %s", recordPath.c_str());
+            throw std::runtime_error("setupStream " + std::string(ex.what()));
+        }
+    }
+
+    std::pair<size_t, size_t> resample(1, 1);
+    if (resampleRate != 0.0)
+    {
+        resample = this->resampleRatio(direction, channels.at(0), resampleRate, size_t((direction == SOAPY_SDR_RX)?ddcDecim:ducInterp));
+    }
+
     //determine the number of buffers to allocate
     int numBuffs = (args.count("buffers") == 0)? 0 : atoi(args.at("buffers").c_str());
     if (numBuffs == 0) numBuffs = DEF_NUM_BUFFS;
@@ -135,6 +600,17 @@ SoapySDR::Stream *bladeRF_SoapySDR::setupStream(
     if (bufSize == 0) bufSize = DEF_BUFF_LEN;
     if ((bufSize % 1024) != 0) bufSize = ((bufSize/1024) + 1) * 1024;
 
+    //a buffer must hold at least one interpolated sample after the end of burst flush
+    std::vector<std::unique_ptr<TxChain>> txChains;
+    if (direction == SOAPY_SDR_TX and (duc or resampleRate != 0.0)) for (size_t i = 0; i < channels.size(); i++)
+    {
+        txChains.emplace_back(new TxChain(ducFreq/_txSampRate, size_t(ducInterp), resample.first, resample.second));
+    }
+    if (not txChains.empty() and txChains.front()->maxInput(bufSize) <= txChains.front()->flushInput())
+    {
+        throw std::runtime_error("setupStream duc_interp or resample_rate requires a larger buflen");
+    }
+
     //determine the number of active transfers
     int numXfers = (args.count("transfers") == 0)? 0 : atoi(args.at("transfers").c_str());
     if (numXfers == 0) numXfers = numBuffs/2;
@@ -171,10 +647,114 @@ SoapySDR::Stream *bladeRF_SoapySDR::setupStream(
     {
         _rxOverflow = false;
         _rxChans = channels;
-        _rxFloats = (format == SOAPY_SDR_CF32);
+        _rxFloats = (sampleFormat == SOAPY_SDR_CF32);
         _rxConvBuff = new int16_t[bufSize*2*_rxChans.size()];
         _rxBuffSize = bufSize;
         this->updateRxMinTimeoutMs();
+
+        //compute a quick tune for every scan frequency up-front
+        for (const auto freq : scanFreqs)
+        {
+            this->setFrequency(SOAPY_SDR_RX, channels.at(0), "RF", freq, {{"saveQuickTune", "1"}});
+        }
+        _rxScanFreqs = scanFreqs;
+        _rxScanDwell = (args.count("scan_dwell") == 0)? 0 : std::stoul(args.at("scan_dwell"));
+        if (_rxScanDwell == 0) _rxScanDwell = bufSize;
+        _rxScanSettle = (args.count("scan_settle") == 0)? DEF_SCAN_SETTLE : std::stoul(args.at("scan_settle"));
+        _rxScanFreq = scanFreqs.empty()? 0.0 : scanFreqs.front();
+        _rxRetuneSettle = (args.count("retune_settle") == 0)? 0 : std::stoul(args.at("retune_settle"));
+
+        _rxChains.clear();
+        _rxCorrectors.clear();
+        if (correction != "off") for (size_t i = 0; i < channels.size(); i++)
+        {
+            _rxCorrectors.emplace_back(new IQCorrector(correction == "dciq"));
+        }
+        if (virtualChans.empty() and (ddc or resampleRate != 0.0 or not _rxCorrectors.empty())) for (size_t i = 0; i < channels.size(); i++)
+        {
+            IQCorrector *corrector = _rxCorrectors.empty()?nullptr:_rxCorrectors[i].get();
+            _rxChains.emplace_back(new RxChain(corrector, -ddcFreq/_rxSampRate, size_t(ddcDecim), resample.first, resample.second));
+        }
+
+        //virtual channel 0 is the lowest frequency FFT bin
+        _rxChannelizer.reset();
+        if (not virtualChans.empty())
+        {
+            std::vector<size_t> bins;
+            for (const auto ch : virtualChans) bins.push_back((ch - _numRxChans + _channelizerSize/2) % _channelizerSize);
+            const size_t numThreads = (_channelizerSize < CHANNELIZER_THREAD_MIN)?1:
+                std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), CHANNELIZER_MAX_THREADS));
+            _rxChannelizer.reset(new Channelizer(_channelizerSize, _channelizerOversample, bins, numThreads));
+        }
+
+        //the spectrum is taken after all of the processing above
+        _rxSpectrums.clear();
+        _rxSpectrumBuffs.clear();
+        _rxSpectrumFrames.clear();
+        if (psd)
+        {
+            const size_t hop = std::max<size_t>(1, size_t(std::lround(psdSize*(1.0 - psdOverlap))));
+            const size_t numThreads = (psdSize < PSD_THREAD_MIN)?1:
+                std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), PSD_MAX_THREADS));
+            const size_t numChans = virtualChans.empty()?channels.size():virtualChans.size();
+            for (size_t i = 0; i < numChans; i++)
+            {
+                _rxSpectrums.emplace_back(new PowerSpectrum(size_t(psdSize), psdWindow, hop, size_t(psdAverage), numThreads));
+                _rxSpectrumBuffs.emplace_back(size_t(_rxBuffSize/_rxStreamRatio()));
+                _rxSpectrumFrames.emplace_back(size_t(psdSize));
+            }
+            _rxSpectrumOffset = size_t(psdSize);
+            _rxSpectrumStarted = false;
+        }
+
+        //the detectors follow the stream index of each channel
+        _rxDetectors.clear();
+        for (size_t i = 0; not preambles.empty() and i < (virtualChans.empty()?channels.size():virtualChans.size()); i++)
+        {
+            _rxDetectors.emplace_back(new PreambleDetector(preambles, float(preambleThreshold)));
+        }
+        {
+            std::lock_guard<std::mutex> lock(_rxDetectionMutex);
+            _rxDetections.clear();
+        }
+        _rxRunIndex = 0;
+        _rxRunAnchors.clear();
+
+        //the squelch keeps the samples in the stream format
+        _rxSquelch.reset();
+        _rxSquelchBuffs.clear();
+        _rxPreambleGate = mode == "preamble";
+        if (squelch)
+        {
+            const size_t numChans = virtualChans.empty()?channels.size():virtualChans.size();
+            const size_t elemSize = _rxFloats?sizeof(std::complex<float>):2*sizeof(int16_t);
+            const size_t delay = _rxDetectors.empty()?0:_rxDetectors.front()->delay();
+            _rxSquelch.reset(new EnergySquelch(numChans, elemSize, float(std::pow(10.0, squelchLevel/10)), size_t(squelchWindow), size_t(squelchPre), size_t(squelchPost), delay));
+            _rxSquelchBuffs.assign(numChans, std::vector<char>(size_t(_rxBuffSize/_rxStreamRatio())*elemSize));
+        }
+
+        //the capture history is allocated once, the worker starts with the stream
+        _rxCapture.reset();
+        if (capture)
+        {
+            const long long preElems = std::llround(capturePre*_rxStreamRate());
+            const long long postElems = std::max<long long>(std::llround(capturePost*_rxStreamRate()), (preElems == 0)?1:0);
+
+            const size_t numChans = virtualChans.empty()?channels.size():virtualChans.size();
+            const size_t elemSize = _rxFloats?sizeof(std::complex<float>):2*sizeof(int16_t);
+            try
+            {
+                _rxCapture.reset(new CaptureRing(numChans, elemSize, size_t(preElems), size_t(postElems), _rxStreamRate()));
+            }
+            catch (const std::bad_alloc &)
+            {
+                SoapySDR::logf(SOAPY_SDR_ERROR, "setupStream cannot allocate %g MB of capture history", double(preElems + postElems)*numChans*elemSize/1e6);
+                this->closeStream((SoapySDR::Stream *)(new int(direction))); //release the hardware set up above
+                throw std::runtime_error("setupStream capture history too large");
+            }
+        }
+
+        _rxRecorder = std::move(recorder);
     }
 
     if (direction == SOAPY_SDR_TX)
@@ -184,6 +764,8 @@ SoapySDR::Stream *bladeRF_SoapySDR::setupStream(
         _txConvBuff = new int16_t[bufSize*2*_txChans.size()];
         _txBuffSize = bufSize;
         _inTxBurst = false;
+        _txChains = std::move(txChains);
+        _txMeta = sync_format == BLADERF_FORMAT_SC16_Q11_META;
     }
 
     return (SoapySDR::Stream *)(new int(direction));
@@ -193,6 +775,8 @@ void bladeRF_SoapySDR::closeStream(SoapySDR::Stream *stream)
 {
     const int direction = *reinterpret_cast<int *>(stream);
     auto &chans = (direction == SOAPY_SDR_RX)?_rxChans:_txChans;
+    if (direction == SOAPY_SDR_RX) this->stopCapture();
+    if (direction == SOAPY_SDR_TX) this->stopReplay();
 
     //deactivate the stream here -- only call once
     for (const auto ch : chans)
@@ -209,12 +793,21 @@ void bladeRF_SoapySDR::closeStream(SoapySDR::Stream *stream)
     //cleanup stream convert buffers
     if (direction == SOAPY_SDR_RX)
     {
+        _rxCapture.reset();
+        _rxRecorder.reset();
         delete [] _rxConvBuff;
+        _rxScanFreqs.clear();
+        _rxChains.clear();
+        _rxChannelizer.reset();
+        _rxSpectrums.clear();
+        _rxSquelch.reset();
+        _rxDetectors.clear();
     }
 
     if (direction == SOAPY_SDR_TX)
     {
         delete [] _txConvBuff;
+        _txChains.clear();
     }
 
     delete reinterpret_cast<int *>(stream);
@@ -223,6 +816,9 @@ void bladeRF_SoapySDR::closeStream(SoapySDR::Stream *stream)
 size_t bladeRF_SoapySDR::getStreamMTU(SoapySDR::Stream *stream) const
 {
     const int direction = *reinterpret_cast<int *>(stream);
+    if (direction == SOAPY_SDR_RX and not _rxSpectrums.empty()) return _rxSpectrums.front()->size();
+    if (direction == SOAPY_SDR_RX) return size_t(_rxBuffSize/_rxStreamRatio());
+    if (direction == SOAPY_SDR_TX and not _txChains.empty()) return _txChains.front()->maxInput(_txBuffSize);
     return (direction == SOAPY_SDR_RX)?_rxBuffSize:_txBuffSize;
 }
 
@@ -240,7 +836,26 @@ int bladeRF_SoapySDR::activateStream(
         cmd.flags = flags;
         cmd.timeNs = timeNs;
         cmd.numElems = numElems;
+        //a burst is counted in hardware samples, the request is at the processed rate
+        cmd.numElems = this->_rxMaxInput(numElems);
         _rxCmds.push(cmd);
+        _rxNextTicks = 0; //unknown until the first read
+
+        //in capture mode the driver reads the stream from now on
+        if (_rxCapture and not _rxCaptureThread.joinable())
+        {
+            _rxCaptureRunning = true;
+            _rxCaptureThread = std::thread(&bladeRF_SoapySDR::captureWorker, this);
+        }
+
+        //begin the scan at the requested time or shortly after now
+        if (not _rxScanFreqs.empty())
+        {
+            bladerf_timestamp ticksNow = 0;
+            bladerf_get_timestamp(_dev, BLADERF_RX, &ticksNow);
+            const long long leadTicks = (long long)((_rxSampRate*SCAN_LEAD_US)/1e6);
+            this->startScan(((flags & SOAPY_SDR_HAS_TIME) != 0)?_timeNsToRxTicks(timeNs):(ticksNow + leadTicks), 0);
+        }
     }
 
     if (direction == SOAPY_SDR_TX)
@@ -261,12 +876,24 @@ int bladeRF_SoapySDR::deactivateStream(
 
     if (direction == SOAPY_SDR_RX)
     {
+        this->stopCapture();
+
         //clear all commands when deactivating
         while (not _rxCmds.empty()) _rxCmds.pop();
+
+        //stop scanning, the remaining scheduled retunes are no longer needed
+        if (not _rxScanFreqs.empty())
+        {
+            bladerf_cancel_scheduled_retunes(_dev, BLADERF_CHANNEL_RX(_rxChans.at(0)));
+            _rxScanRemaining = 0;
+        }
     }
 
     if (direction == SOAPY_SDR_TX)
     {
+        //the replay ends its own burst
+        this->stopReplay();
+
         //in a burst -> end it
         if (_inTxBurst)
         {
@@ -289,12 +916,422 @@ int bladeRF_SoapySDR::deactivateStream(
 
 int bladeRF_SoapySDR::readStream(
     SoapySDR::Stream *,
+    void * const *buffs,
+    const size_t numElems,
+    int &flags,
+    long long &timeNs,
+    const long timeoutUs)
+{
+    if (not _rxSpectrums.empty()) return this->readStreamSpectrum(buffs, numElems, flags, timeNs, timeoutUs);
+    if (_rxSquelch) return this->readStreamSquelch(buffs, numElems, flags, timeNs, timeoutUs);
+    if (_rxCapture) return this->readStreamCapture(buffs, numElems, flags, timeNs, timeoutUs);
+    const int ret = this->readStreamSamples(buffs, numElems, flags, timeNs, timeoutUs);
+    if (ret > 0 and not _rxDetectors.empty())
+    {
+        const bool restart = this->trackRxRun(size_t(ret), timeNs);
+        this->detectPreambles((const std::complex<float> * const *)buffs, size_t(ret), restart);
+        while (_rxRunAnchors.size() > 1) _rxRunAnchors.pop_front();
+    }
+    return ret;
+}
+
+int bladeRF_SoapySDR::readStreamCapture(
+    void * const *buffs,
+    const size_t numElems,
+    int &flags,
+    long long &timeNs,
+    const long timeoutUs)
+{
+    if (not _rxCapture->wait(timeoutUs)) return SOAPY_SDR_TIMEOUT;
+
+    bool end(false);
+    std::vector<const void *> snapshot(_rxCapture->numChans());
+    const size_t n = _rxCapture->peek(snapshot.data(), numElems, timeNs, end);
+    const size_t bytes = n*_rxCapture->elemSize();
+    for (size_t c = 0; c < snapshot.size(); c++) std::memcpy(buffs[c], snapshot[c], bytes);
+    _rxCapture->consume(n);
+
+    flags = SOAPY_SDR_HAS_TIME;
+    if (end) flags |= SOAPY_SDR_END_BURST;
+    return int(n);
+}
+
+void bladeRF_SoapySDR::captureWorker(void)
+{
+    const size_t blockElems = size_t(_rxBuffSize/_rxStreamRatio());
+    std::vector<std::vector<char>> block(_rxCapture->numChans(), std::vector<char>(blockElems*_rxCapture->elemSize()));
+    std::vector<void *> buffs;
+    for (auto &buff : block) buffs.push_back(buff.data());
+
+    //gaps after an overflow are found by the ring from the sample times
+    while (_rxCaptureRunning)
+    {
+        int flags(0);
+        long long timeNs(0);
+        const int ret = this->readStreamSamples(buffs.data(), blockElems, flags, timeNs, CAPTURE_TIMEOUT_US);
+        if (ret > 0) _rxCapture->write(buffs.data(), size_t(ret), timeNs);
+        if (ret > 0 or ret == SOAPY_SDR_OVERFLOW) continue;
+        if (ret != SOAPY_SDR_TIMEOUT) SoapySDR::logf(SOAPY_SDR_ERROR, "capture readStream() returned %d", ret);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void bladeRF_SoapySDR::stopCapture(void)
+{
+    if (not _rxCaptureThread.joinable()) return;
+    _rxCaptureRunning = false;
+    _rxCaptureThread.join();
+}
+
+//! Raw value of a key in SigMF metadata, without quotes, empty when missing
+static std::string sigmfValue(const std::string &meta, const std::string &key)
+{
+    size_t pos = meta.find("\"" + key + "\"");
+    if (pos == std::string::npos) return "";
+    pos = meta.find(':', pos);
+    if (pos == std::string::npos) return "";
+    const size_t end = meta.find_first_of(",}\n", pos);
+    std::string value = meta.substr(pos + 1, end - pos - 1);
+    value.erase(std::remove_if(value.begin(), value.end(), [](const char c){return c == '"' or std::isspace((unsigned char)c);}), value.end());
+    return value;
+}
+
+void bladeRF_SoapySDR::startReplay(const std::string &path)
+{
+    if (_txChans.empty()) throw std::runtime_error("writeSetting(tx_replay) requires a tx stream");
+    if (not _txChains.empty()) throw std::runtime_error("writeSetting(tx_replay) requires a tx stream without processing, the file is sent as is");
+    if ((_txReplayTimeNs != 0 or _txReplayPeriod != 0.0) and not _txMeta) throw std::runtime_error("writeSetting(tx_replay) timed passes require meta mode");
+    this->stopReplay();
+    if (_inTxBurst) throw std::runtime_error("writeSetting(tx_replay) the tx stream is in a burst");
+
+    //a SigMF recording is named by either of its files, the metadata must match the stream
+    const std::string ext = (path.size() > 11)?path.substr(path.size() - 11):"";
+    const std::string dataPath = (ext == ".sigmf-meta")?(path.substr(0, path.size() - 11) + ".sigmf-data"):path;
+    if (ext == ".sigmf-meta" or ext == ".sigmf-data")
+    {
+        std::ifstream file(dataPath.substr(0, dataPath.size() - 11) + ".sigmf-meta");
+        const std::string meta((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        const std::string datatype = sigmfValue(meta, "core:datatype");
+        const std::string numChans = sigmfValue(meta, "core:num_channels");
+        if (not datatype.empty() and datatype != "ci16_le") throw std::runtime_error("writeSetting(tx_replay) unsupported datatype " + datatype + ", the stream sends ci16_le");
+        if (not numChans.empty() and numChans != std::to_string(_txChans.size())) throw std::runtime_error("writeSetting(tx_replay) recording has " + numChans + " channels");
+    }
+
+    std::unique_ptr<MappedFile> file;
+    try
+    {
+        file.reset(new MappedFile(dataPath));
+    }
+    catch (const std::exception &ex)
+    {
+        SoapySDR::logf(SOAPY_SDR_ERROR, "writeSetting(tx_replay) %s", ex.what());
+        throw std::runtime_error("writeSetting(tx_replay) " + std::string(ex.what()));
+    }
+
+    //the samples are interleaved channels in the wire format
+    const size_t elemBytes = 2*sizeof(int16_t)*_txChans.size();
+    const size_t numElems = file->size()/elemBytes;
+    if (numElems == 0) throw std::runtime_error("writeSetting(tx_replay) " + dataPath + " has no samples");
+    if (file->size() % elemBytes != 0) SoapySDR::logf(SOAPY_SDR_WARNING, "tx_replay ignores %d trailing bytes of %s", int(file->size() % elemBytes), dataPath.c_str());
+    const long long periodTicks = std::llround(_txReplayPeriod*_txSampRate);
+    if (periodTicks != 0 and periodTicks < (long long)(numElems))
+    {
+        throw std::runtime_error("writeSetting(tx_replay) tx_replay_period is shorter than the recording");
+    }
+
+    //timed passes start at the requested time or shortly after now
+    long long startTicks = 0;
+    if (_txReplayTimeNs != 0) startTicks = _timeNsToTxTicks(_txReplayTimeNs);
+    else if (periodTicks != 0)
+    {
+        bladerf_timestamp ticksNow = 0;
+        const int ret = bladerf_get_timestamp(_dev, BLADERF_TX, &ticksNow);
+        if (ret != 0)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_get_timestamp() returned %s", _err2str(ret).c_str());
+            throw std::runtime_error("writeSetting(tx_replay) " + _err2str(ret));
+        }
+        startTicks = ticksNow + (long long)((_txSampRate*REPLAY_LEAD_US)/1e6);
+    }
+
+    //the worker gets its own copy of the options, the settings may be written while it runs
+    _txReplay = std::move(file);
+    _txReplayRunning = true;
+    _txReplayThread = std::thread(&bladeRF_SoapySDR::replayWorker, this, _txReplayLoops, startTicks, periodTicks);
+}
+
+void bladeRF_SoapySDR::replayWorker(const unsigned long long loops, const long long startTicks, const long long periodTicks)
+{
+    const size_t numChans = _txChans.size();
+    const int16_t *samples = (const int16_t *)_txReplay->data();
+    const size_t numElems = _txReplay->size()/(2*sizeof(int16_t)*numChans);
+    const bool timed = startTicks != 0 or periodTicks != 0;
+
+    bool inBurst(false);
+    for (unsigned long long pass = 0; _txReplayRunning and (loops == 0 or pass < loops); pass++)
+    {
+        //without a period the passes continue one burst, so the loop boundary is sample exact
+        const bool endPass = periodTicks != 0 or pass + 1 == loops;
+        for (size_t offset = 0; _txReplayRunning and offset < numElems;)
+        {
+            const size_t n = std::min(numElems - offset, _txBuffSize);
+            bladerf_metadata md;
+            std::memset(&md, 0, sizeof(md));
+            if (not inBurst)
+            {
+                md.flags |= BLADERF_META_FLAG_TX_BURST_START;
+                if (timed) md.timestamp = startTicks + (long long)(pass)*periodTicks;
+                else md.flags |= BLADERF_META_FLAG_TX_NOW;
+            }
+            if (endPass and offset + n == numElems) md.flags |= BLADERF_META_FLAG_TX_BURST_END;
+
+            //the pages of the file are the wire buffer, libbladeRF only reads them
+            const int ret = bladerf_sync_tx(_dev, (void *)(samples + 2*numChans*offset), unsigned(n*numChans), &md, REPLAY_TIMEOUT_MS);
+            if (ret == BLADERF_ERR_TIMEOUT) continue;
+            if (ret != 0)
+            {
+                SoapySDR::logf(SOAPY_SDR_ERROR, "tx_replay bladerf_sync_tx() returned %s", _err2str(ret).c_str());
+                _txReplayRunning = false;
+                break;
+            }
+            if ((md.status & BLADERF_META_STATUS_UNDERRUN) != 0) SoapySDR::log(SOAPY_SDR_SSI, "U");
+            inBurst = (md.flags & BLADERF_META_FLAG_TX_BURST_END) == 0;
+            offset += n;
+        }
+    }
+
+    //stopped in a burst -> end it
+    if (inBurst)
+    {
+        bladerf_metadata md;
+        std::memset(&md, 0, sizeof(md));
+        md.flags = BLADERF_META_FLAG_TX_BURST_END;
+        int16_t zeros[4] = {0, 0, 0, 0};
+        bladerf_sync_tx(_dev, zeros, unsigned(numChans), &md, REPLAY_TIMEOUT_MS);
+    }
+    _inTxBurst = false;
+    _txReplayRunning = false;
+}
+
+void bladeRF_SoapySDR::stopReplay(void)
+{
+    if (not _txReplayThread.joinable()) return;
+    _txReplayRunning = false;
+    _txReplayThread.join();
+    _txReplay.reset();
+}
+
+size_t bladeRF_SoapySDR::getNumDirectAccessBuffers(SoapySDR::Stream *stream)
+{
+    const int direction = *reinterpret_cast<int *>(stream);
+    return (direction == SOAPY_SDR_RX and _rxCapture)?1:0;
+}
+
+int bladeRF_SoapySDR::acquireReadBuffer(
+    SoapySDR::Stream *stream,
+    size_t &handle,
+    const void **buffs,
+    int &flags,
+    long long &timeNs,
+    const long timeoutUs)
+{
+    //the buffers point into the held snapshot, up to the MTU or the wrap of the history
+    const int direction = *reinterpret_cast<int *>(stream);
+    if (direction != SOAPY_SDR_RX or not _rxCapture) return SOAPY_SDR_NOT_SUPPORTED;
+    if (not _rxCapture->wait(timeoutUs)) return SOAPY_SDR_TIMEOUT;
+
+    bool end(false);
+    _rxCaptureAcquired = _rxCapture->peek(buffs, this->getStreamMTU(stream), timeNs, end);
+    handle = 0;
+    flags = SOAPY_SDR_HAS_TIME;
+    if (end) flags |= SOAPY_SDR_END_BURST;
+    return int(_rxCaptureAcquired);
+}
+
+void bladeRF_SoapySDR::releaseReadBuffer(
+    SoapySDR::Stream *,
+    const size_t)
+{
+    if (_rxCapture) _rxCapture->consume(_rxCaptureAcquired);
+    _rxCaptureAcquired = 0;
+}
+
+bool bladeRF_SoapySDR::trackRxRun(const size_t n, const long long timeNs)
+{
+    const bool restart = _rxRunAnchors.empty() or std::llabs(timeNs - this->rxRunTimeNs(_rxRunIndex)) > std::llround(0.5e9/_rxStreamRate());
+    if (restart) _rxRunAnchors.emplace_back(_rxRunIndex, timeNs);
+    _rxRunIndex += n;
+    return restart;
+}
+
+long long bladeRF_SoapySDR::rxRunTimeNs(const unsigned long long index) const
+{
+    auto anchor = _rxRunAnchors.rbegin();
+    while (anchor + 1 != _rxRunAnchors.rend() and anchor->first > index) ++anchor;
+    return anchor->second + std::llround((index - anchor->first)*1e9/_rxStreamRate());
+}
+
+std::vector<PreambleDetector::Detection> bladeRF_SoapySDR::detectPreambles(const std::complex<float> * const *buffs, const size_t n, const bool restart)
+{
+    std::vector<PreambleDetector::Detection> detections;
+    std::vector<PreambleEvent> events;
+    for (size_t c = 0; c < _rxDetectors.size(); c++)
+    {
+        const size_t begin = detections.size();
+        if (restart) _rxDetectors[c]->discontinuity();
+        _rxDetectors[c]->process(buffs[c], n, detections);
+        for (size_t i = begin; i < detections.size(); i++)
+        {
+            PreambleEvent event;
+            event.channel = c;
+            event.timeNs = this->rxRunTimeNs(detections[i].index);
+            event.preamble = detections[i].preamble;
+            event.peak = detections[i].peak;
+            event.frequency = detections[i].freq*_rxStreamRate();
+            events.push_back(event);
+        }
+    }
+    if (events.empty()) return detections;
+
+    {
+        std::lock_guard<std::mutex> lock(_rxDetectionMutex);
+        for (const auto &event : events) _rxDetections.push_back(event);
+        while (_rxDetections.size() > PREAMBLE_MAX_EVENTS) _rxDetections.pop_front();
+    }
+    _rxDetectionCond.notify_all();
+
+    //the channels are correlated one after the other
+    std::sort(detections.begin(), detections.end(), [](const PreambleDetector::Detection &a, const PreambleDetector::Detection &b){return a.index < b.index;});
+    return detections;
+}
+
+int bladeRF_SoapySDR::readStreamSpectrum(
+    void * const *buffs,
+    const size_t numElems,
+    int &flags,
+    long long &timeNs,
+    const long timeoutUs)
+{
+    const size_t size = _rxSpectrums.front()->size();
+    const double rate = _rxStreamRate();
+    const auto exitTime = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+
+    //integrate reads until every channel has a frame, partial averages carry over a timeout
+    while (_rxSpectrumOffset == size and not _rxSpectrums.front()->ready())
+    {
+        std::vector<void *> blockBuffs;
+        for (auto &buff : _rxSpectrumBuffs) blockBuffs.push_back(buff.data());
+        int ret = this->readStreamSamples(blockBuffs.data(), _rxSpectrumBuffs.front().size(), flags, timeNs, timeoutUs);
+        if (ret == SOAPY_SDR_TIMEOUT) return ret;
+        if (ret < 0)
+        {
+            for (auto &spectrum : _rxSpectrums) spectrum->reset();
+            _rxSpectrumStarted = false;
+            return ret;
+        }
+
+        //an average only covers contiguous samples
+        const long long expectedNs = _rxSpectrumStartNs + std::llround(_rxSpectrumCount*1e9/rate);
+        if (ret > 0 and (not _rxSpectrumStarted or std::llabs(timeNs - expectedNs) > std::llround(0.5e9/rate)))
+        {
+            for (auto &spectrum : _rxSpectrums) spectrum->reset();
+            _rxSpectrumStarted = true;
+            _rxSpectrumStartNs = timeNs;
+            _rxSpectrumCount = 0;
+        }
+        for (size_t c = 0; c < _rxSpectrums.size(); c++) _rxSpectrums[c]->process(_rxSpectrumBuffs[c].data(), size_t(ret));
+        _rxSpectrumCount += size_t(ret);
+        if (std::chrono::steady_clock::now() > exitTime and not _rxSpectrums.front()->ready()) return SOAPY_SDR_TIMEOUT;
+    }
+
+    //a frame is one burst timestamped at the first sample of its first FFT
+    flags = 0;
+    timeNs = 0;
+    if (_rxSpectrumOffset == size)
+    {
+        unsigned long long index(0);
+        for (size_t c = 0; c < _rxSpectrums.size(); c++) index = _rxSpectrums[c]->take(_rxSpectrumFrames[c].data());
+        _rxSpectrumOffset = 0;
+        flags |= SOAPY_SDR_HAS_TIME;
+        timeNs = _rxSpectrumStartNs + std::llround(index*1e9/rate);
+    }
+
+    const size_t n = std::min(numElems, size - _rxSpectrumOffset);
+    for (size_t c = 0; c < _rxSpectrumFrames.size(); c++)
+    {
+        std::copy(_rxSpectrumFrames[c].begin() + _rxSpectrumOffset, _rxSpectrumFrames[c].begin() + _rxSpectrumOffset + n, (float *)buffs[c]);
+    }
+    _rxSpectrumOffset += n;
+    if (_rxSpectrumOffset == size) flags |= SOAPY_SDR_END_BURST;
+    return int(n);
+}
+
+int bladeRF_SoapySDR::readStreamSquelch(
+    void * const *buffs,
+    const size_t numElems,
+    int &flags,
+    long long &timeNs,
+    const long timeoutUs)
+{
+    const auto exitTime = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+
+    //read until a burst has samples, quiet reads are dropped here
+    while (not _rxSquelch->ready())
+    {
+        std::vector<void *> blockBuffs;
+        for (auto &buff : _rxSquelchBuffs) blockBuffs.push_back(buff.data());
+        const size_t blockElems = _rxSquelchBuffs.front().size()/(_rxFloats?sizeof(std::complex<float>):2*sizeof(int16_t));
+        const int ret = this->readStreamSamples(blockBuffs.data(), blockElems, flags, timeNs, timeoutUs);
+        if (ret == SOAPY_SDR_TIMEOUT) return ret;
+        if (ret < 0)
+        {
+            _rxSquelch->discontinuity();
+            return ret;
+        }
+
+        //a gap closes the open burst, samples are timed from the start of their run
+        const bool restart = (ret > 0) and this->trackRxRun(size_t(ret), timeNs);
+        if (restart) _rxSquelch->discontinuity();
+        if (_rxPreambleGate) _rxSquelch->keep(blockBuffs.data(), size_t(ret));
+        else if (_rxFloats) _rxSquelch->process((const std::complex<float> * const *)blockBuffs.data(), size_t(ret));
+        else _rxSquelch->process((const int16_t * const *)blockBuffs.data(), size_t(ret));
+
+        //in preamble mode each detection opens the gate over its preamble
+        if (not _rxDetectors.empty())
+        {
+            const auto detections = this->detectPreambles((const std::complex<float> * const *)blockBuffs.data(), size_t(ret), restart);
+            if (_rxPreambleGate) for (const auto &detection : detections)
+            {
+                _rxSquelch->trigger(detection.index, detection.index + detection.length - 1);
+            }
+        }
+        if (std::chrono::steady_clock::now() > exitTime and not _rxSquelch->ready()) return SOAPY_SDR_TIMEOUT;
+    }
+
+    flags = 0;
+    timeNs = 0;
+    unsigned long long index(0);
+    bool end(false);
+    const size_t n = _rxSquelch->read(buffs, numElems, index, end);
+
+    //runs before the one holding this burst are no longer needed
+    while (_rxRunAnchors.size() > 1 and _rxRunAnchors[1].first <= index) _rxRunAnchors.pop_front();
+    flags |= SOAPY_SDR_HAS_TIME;
+    timeNs = this->rxRunTimeNs(index);
+    if (end) flags |= SOAPY_SDR_END_BURST;
+    return int(n);
+}
+
+int bladeRF_SoapySDR::readStreamSamples(
     void * const *buffs,
     size_t numElems,
     int &flags,
     long long &timeNs,
     const long timeoutUs)
 {
+    //with processing the request is at the processed rate, read enough hardware samples for it
+    numElems = this->_rxMaxInput(numElems);
+
     //clip to the available conversion buffer size
     numElems = std::min(numElems, _rxBuffSize);
 
@@ -326,14 +1363,61 @@ int bladeRF_SoapySDR::readStream(
     if (cmd.numElems > 0) numElems = std::min(cmd.numElems, numElems);
     cmd.flags = 0; //clear flags for subsequent calls
 
+    //scan mode: each dwell begins after the settling time of its scheduled retune
+    const bool scanning = not _rxScanFreqs.empty();
+    const bool dwellStart = scanning and _rxScanRemaining == 0;
+    if (dwellStart)
+    {
+        int ret = this->scheduleScanRetunes();
+        if (ret != 0)
+        {
+            SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_schedule_retune() returned %s", _err2str(ret).c_str());
+            return SOAPY_SDR_STREAM_ERROR;
+        }
+        md.timestamp = this->scanStepTicks(_rxScanIndex) + _rxScanSettle;
+    }
+    else if (scanning) md.timestamp = _rxNextTicks;
+    if (scanning)
+    {
+        md.flags &= ~BLADERF_META_FLAG_RX_NOW;
+        numElems = std::min(numElems, dwellStart?_rxScanDwell:_rxScanRemaining);
+    }
+
+    //end the buffer at the next timed retune so the following buffer starts at the new frequency
+    long long retuneTicks(0);
+    {
+        std::lock_guard<std::mutex> lock(_rxRetuneMutex);
+        if (not _rxRetunes.empty()) retuneTicks = _rxRetunes.front().ticks;
+    }
+    if (not scanning and retuneTicks != 0 and _rxNextTicks != 0 and (md.flags & BLADERF_META_FLAG_RX_NOW) != 0)
+    {
+        if (retuneTicks <= _rxNextTicks and _rxRetuneSettle != 0)
+        {
+            md.flags &= ~BLADERF_META_FLAG_RX_NOW;
+            md.timestamp = std::max<long long>(retuneTicks + _rxRetuneSettle, _rxNextTicks);
+        }
+        else if (retuneTicks > _rxNextTicks and retuneTicks < _rxNextTicks + (long long)numElems)
+        {
+            numElems = size_t(retuneTicks - _rxNextTicks);
+        }
+    }
+
     //prepare buffers
     void *samples = (void *)buffs[0];
     if (_rxFloats or _rxChans.size() == 2) samples = _rxConvBuff;
 
     //recv the rx samples
-    const long timeoutMs = std::max(_rxMinTimeoutMs, timeoutUs/1000);
+    const long timeoutMs = std::max(_rxMinTimeoutMs.load(), timeoutUs/1000);
     int ret = bladerf_sync_rx(_dev, samples, numElems*_rxChans.size(), &md, timeoutMs);
     if (ret == BLADERF_ERR_TIMEOUT) return SOAPY_SDR_TIMEOUT;
+    if (ret == BLADERF_ERR_TIME_PAST and scanning)
+    {
+        //the reader fell behind the schedule, restart the scan from the next step
+        bladerf_timestamp ticksNow = 0;
+        bladerf_get_timestamp(_dev, BLADERF_RX, &ticksNow);
+        this->startScan(ticksNow + (long long)((_rxSampRate*SCAN_LEAD_US)/1e6), _rxScanIndex + 1);
+        return SOAPY_SDR_TIME_ERROR;
+    }
     if (ret == BLADERF_ERR_TIME_PAST) return SOAPY_SDR_TIME_ERROR;
     if (ret != 0)
     {
@@ -346,8 +1430,30 @@ int bladeRF_SoapySDR::readStream(
     //actual count is number of samples in total all channels
     numElems = md.actual_count / _rxChans.size();
 
+    //run the processing chain, its history is only valid for contiguous samples
+    size_t numOut = numElems;
+    double outOffset = 0.0;
+    if (_rxChannelizer)
+    {
+        if ((long long)(md.timestamp) != _rxNextTicks) _rxChannelizer->reset();
+        outOffset = _rxChannelizer->nextOutputOffset();
+        std::complex<float> *input = _rxChannelizer->input(numElems);
+        if (_rxCorrectors.empty()) convertCS16(_rxConvBuff, 1, input, numElems);
+        else _rxCorrectors.front()->convert(_rxConvBuff, 1, input, numElems);
+        numOut = _rxChannelizer->filter(numElems, (std::complex<float> * const *)buffs);
+    }
+    else if (not _rxChains.empty())
+    {
+        if ((long long)(md.timestamp) != _rxNextTicks) for (auto &chain : _rxChains) chain->reset();
+        outOffset = _rxChains.front()->nextOutputOffset();
+        for (size_t c = 0; c < _rxChans.size(); c++)
+        {
+            numOut = _rxChains[c]->process(_rxConvBuff + 2*c, _rxChans.size(), (std::complex<float> *)buffs[c], numElems);
+        }
+    }
+
     //perform the int16 to float conversion
-    if (_rxFloats and _rxChans.size() == 1)
+    else if (_rxFloats and _rxChans.size() == 1)
     {
         float *output = (float *)buffs[0];
         for (size_t i = 0; i < 2 * numElems; i++)
@@ -380,9 +1486,23 @@ int bladeRF_SoapySDR::readStream(
         }
     }
 
+    //the samples are held from the arm until the trigger fires, so the first sample
+    //at or after the arm time is the fire edge, buffers streamed before the arm are skipped
+    if (_triggerSync and (long long)(md.timestamp) >= _triggerArmTicks) this->rebaseOnTrigger(md.timestamp);
+
+    //the recording keeps the wire samples, the tuning is read from the shadow
+    //or from the device while a scheduled retune is pending
+    if (_rxRecorder)
+    {
+        double frequency(0.0), gain(0.0);
+        if (not this->readShadow(&ChannelShadow::frequency, SOAPY_SDR_RX, _rxChans.front(), frequency)) frequency = this->getFrequency(SOAPY_SDR_RX, _rxChans.front(), "RF");
+        this->readShadow(&ChannelShadow::gain, SOAPY_SDR_RX, _rxChans.front(), gain);
+        _rxRecorder->write((const int16_t *)samples, numElems, md.timestamp, _rxTicksToTimeNs(md.timestamp), frequency, gain);
+    }
+
     //unpack the metadata
     flags |= SOAPY_SDR_HAS_TIME;
-    timeNs = _rxTicksToTimeNs(md.timestamp);
+    timeNs = (_rxStreamRatio() == 1.0 and outOffset == 0.0)?_rxTicksToTimeNs(md.timestamp):_rxTicksToTimeNs(md.timestamp, outOffset);
 
     //parse the status
     if ((md.status & BLADERF_META_STATUS_OVERRUN) != 0)
@@ -397,6 +1517,51 @@ int bladeRF_SoapySDR::readStream(
     if ((md.status & BLADERF_META_FLAG_RX_HW_MINIEXP2) != 0) flags |= SOAPY_SDR_USER_FLAG1;
     #endif
 
+    //mark the discontinuity at the first buffer at a new sample rate
+    bool rateChanged(false);
+    {
+        std::lock_guard<std::mutex> lock(_epochMutex);
+        rateChanged = _rxRateChanged and (long long)(md.timestamp + numElems) > _rxEpoch.ticks;
+        if (rateChanged) _rxRateChanged = false;
+    }
+    if (rateChanged)
+    {
+        #ifdef SOAPY_SDR_USER_FLAG3
+        flags |= SOAPY_SDR_USER_FLAG3;
+        #endif
+    }
+
+    //tag the first buffer containing samples at a newly retuned frequency
+    std::unique_lock<std::mutex> retuneLock(_rxRetuneMutex);
+    while (not _rxRetunes.empty() and _rxRetunes.front().ticks < (long long)(md.timestamp + numElems))
+    {
+        const RetuneEvent &event = _rxRetunes.front();
+        if (std::find(_rxChans.begin(), _rxChans.end(), event.channel) != _rxChans.end())
+        {
+            _rxRetuneOffset = std::max<long long>(0, event.ticks - (long long)md.timestamp);
+            if (_rxStreamRatio() != 1.0) _rxRetuneOffset = std::max<long long>(0, (long long)std::ceil((_rxRetuneOffset - outOffset)/_rxStreamRatio()));
+            _rxRetuneFreq = event.frequency;
+            #ifdef SOAPY_SDR_USER_FLAG2
+            flags |= SOAPY_SDR_USER_FLAG2;
+            #endif
+        }
+        _rxRetunes.pop_front();
+    }
+    retuneLock.unlock();
+
+    //tag the block with its center frequency, the dwell ends the burst
+    if (scanning)
+    {
+        _rxScanFreq = _rxScanFreqs.at(_rxScanIndex % _rxScanFreqs.size());
+        if (dwellStart) _rxScanRemaining = _rxScanDwell;
+        _rxScanRemaining -= numElems;
+        if (_rxScanRemaining == 0)
+        {
+            flags |= SOAPY_SDR_END_BURST;
+            _rxScanIndex++;
+        }
+    }
+
     //consume from the command if this is a finite burst
     if (cmd.numElems > 0)
     {
@@ -405,7 +1570,122 @@ int bladeRF_SoapySDR::readStream(
     }
 
     _rxNextTicks = md.timestamp + numElems;
-    return numElems;
+    return numOut;
+}
+
+static unsigned long long greatestCommonDivisor(unsigned long long a, unsigned long long b)
+{
+    while (b != 0)
+    {
+        const unsigned long long r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+/*!
+ * Exact ratio between the stream rate (millihertz resolution) and the rational hardware rate
+ * divided by the decimation or interpolation factor, as the resampler interp/decim.
+ */
+static std::pair<unsigned long long, unsigned long long> exactResampleRatio(
+    const int direction, const double rate, const bladerf_rational_rate &hwRate, const size_t factor)
+{
+    const unsigned long long rateMilliHz = (unsigned long long)(std::llround(rate*1000));
+    const unsigned long long den = (hwRate.den == 0)?1:hwRate.den;
+    const unsigned long long hwNum = hwRate.integer*den + hwRate.num;
+    const unsigned long long streamSide = rateMilliHz*factor*den;
+    const unsigned long long hwSide = 1000*hwNum;
+    const unsigned long long gcd = greatestCommonDivisor(streamSide, hwSide);
+    if (gcd == 0) return std::make_pair(0ull, 0ull);
+    if (direction == SOAPY_SDR_RX) return std::make_pair(streamSide/gcd, hwSide/gcd);
+    return std::make_pair(hwSide/gcd, streamSide/gcd);
+}
+
+//! Closest ratio to x with both terms within maxTerm, from the continued fraction convergents
+static std::pair<size_t, size_t> approxResampleRatio(const double x, const size_t maxTerm)
+{
+    unsigned long long p0(0), q0(1), p1(1), q1(0);
+    double r = x;
+    for (size_t i = 0; i < 64; i++)
+    {
+        const double a = std::floor(r);
+        const unsigned long long p2 = (unsigned long long)(a)*p1 + p0;
+        const unsigned long long q2 = (unsigned long long)(a)*q1 + q0;
+        if (p2 > maxTerm or q2 > maxTerm) break;
+        p0 = p1; q0 = q1;
+        p1 = p2; q1 = q2;
+        if (r - a < 1e-12) break;
+        r = 1.0/(r - a);
+    }
+    return std::make_pair(size_t(p1), size_t(q1));
+}
+
+std::pair<size_t, size_t> bladeRF_SoapySDR::resampleRatio(const int direction, const size_t channel, const double rate, const size_t factor)
+{
+    const auto fits = [](const std::pair<unsigned long long, unsigned long long> &r)
+    {
+        return r.first != 0 and r.second != 0 and r.first <= RESAMPLE_MAX_PHASES and r.second <= RESAMPLE_MAX_PHASES;
+    };
+    auto ratio = exactResampleRatio(direction, rate, this->_epoch(direction).rate, factor);
+
+    //move the hardware to the closest rate with a small ratio, preferring fewer stream side terms
+    if (not fits(ratio))
+    {
+        const double hwRate = (direction == SOAPY_SDR_RX)?_rxSampRate:_txSampRate;
+        const auto ranges = this->getSampleRateRange(direction, channel);
+        for (size_t streamSide = 1; streamSide <= RESAMPLE_MAX_PHASES; streamSide++)
+        {
+            const double hwSide = std::round(streamSide*hwRate/(factor*rate));
+            const double newRate = factor*rate*hwSide/streamSide;
+            if (hwSide < 1 or hwSide > RESAMPLE_MAX_PHASES) continue;
+            if (std::abs(newRate - hwRate) > RESAMPLE_RATE_TOLERANCE*hwRate) continue;
+            if (newRate < ranges.front().minimum() or newRate > ranges.back().maximum()) continue;
+            SoapySDR::logf(SOAPY_SDR_INFO, "resample_rate %f moves the hardware rate to %f", rate, newRate);
+            this->setSampleRate(direction, channel, newRate);
+            ratio = exactResampleRatio(direction, rate, this->_epoch(direction).rate, factor);
+            break;
+        }
+    }
+
+    //the hardware could not reach an exact rate, use the closest ratio
+    std::pair<size_t, size_t> result(ratio.first, ratio.second);
+    if (not fits(ratio))
+    {
+        const double hwRate = (direction == SOAPY_SDR_RX)?_rxSampRate:_txSampRate;
+        const double x = (direction == SOAPY_SDR_RX)?(rate*factor/hwRate):(hwRate/(factor*rate));
+        result = approxResampleRatio(x, RESAMPLE_MAX_PHASES);
+        if (result.first == 0 or result.second == 0) throw std::runtime_error("setupStream resample_rate " + std::to_string(rate) + " is out of range");
+        const double actual = (direction == SOAPY_SDR_RX)?(hwRate/factor*result.first/result.second):(hwRate/factor*result.second/result.first);
+        SoapySDR::logf(SOAPY_SDR_WARNING, "resample_rate %f is not exact, actual = %f", rate, actual);
+    }
+    return result;
+}
+
+void bladeRF_SoapySDR::startScan(const long long startTicks, const size_t step)
+{
+    bladerf_cancel_scheduled_retunes(_dev, BLADERF_CHANNEL_RX(_rxChans.at(0)));
+    _rxScanStartTicks = startTicks - (long long)(step*(_rxScanSettle + _rxScanDwell));
+    _rxScanIndex = step;
+    _rxScanScheduled = step;
+    _rxScanRemaining = 0;
+}
+
+int bladeRF_SoapySDR::scheduleScanRetunes(void)
+{
+    const size_t channel = _rxChans.at(0);
+    while (_rxScanScheduled < _rxScanIndex + SCAN_LOOKAHEAD)
+    {
+        const double freq = _rxScanFreqs.at(_rxScanScheduled % _rxScanFreqs.size());
+        const bladerf_quick_tune *quickTune = _rxQuickTunes.find(channel, uint64_t(std::llround(freq)));
+        if (quickTune == nullptr) return BLADERF_ERR_INVAL;
+        bladerf_quick_tune conf = *quickTune;
+        const int ret = bladerf_schedule_retune(_dev, BLADERF_CHANNEL_RX(channel), this->scanStepTicks(_rxScanScheduled), 0, &conf);
+        if (ret == BLADERF_ERR_QUEUE_FULL) break; //try again on the next dwell
+        if (ret != 0) return ret;
+        _rxScanScheduled++;
+    }
+    return 0;
 }
 
 int bladeRF_SoapySDR::writeStream(
@@ -416,11 +1696,26 @@ int bladeRF_SoapySDR::writeStream(
     const long long timeNs,
     const long timeoutUs)
 {
+    //the replay worker owns the tx stream until it is done
+    if (_txReplayRunning) return SOAPY_SDR_STREAM_ERROR;
+
+    //without an rx stream the fire edge is not seen by readStream()
+    if (_triggerSync and _rxChans.empty()) this->pollTxTrigger();
+
+    //with processing the request is at the stream rate, and an end of burst also flushes the filter
+    size_t flush = ((flags & SOAPY_SDR_END_BURST) != 0 and not _txChains.empty())?_txChains.front()->flushInput():0;
+    const size_t maxElems = (_txChains.empty()?_txBuffSize:_txChains.front()->maxInput(_txBuffSize)) - flush;
+
     //clear EOB when the last sample will not be transmitted
-    if (numElems > _txBuffSize) flags &= ~(SOAPY_SDR_END_BURST);
+    if (numElems > maxElems)
+    {
+        flags &= ~(SOAPY_SDR_END_BURST);
+        flush = 0;
+    }
 
     //clip to the available conversion buffer size
-    numElems = std::min(numElems, _txBuffSize);
+    numElems = std::min(numElems, maxElems);
+    const long long delayTicks = _txChains.empty()?0:std::llround(_txChains.front()->delay());
 
     //initialize metadata
     bladerf_metadata md;
@@ -432,7 +1727,7 @@ int bladeRF_SoapySDR::writeStream(
     {
         if ((flags & SOAPY_SDR_HAS_TIME) != 0)
         {
-            md.timestamp = _timeNsToTxTicks(timeNs);
+            md.timestamp = _timeNsToTxTicks(timeNs) - delayTicks;
             md.flags |= BLADERF_META_FLAG_TX_UPDATE_TIMESTAMP;
             _txNextTicks = md.timestamp;
         }
@@ -442,10 +1737,12 @@ int bladeRF_SoapySDR::writeStream(
     else
     {
         md.flags |= BLADERF_META_FLAG_TX_BURST_START;
+        for (auto &chain : _txChains) chain->reset();
         //use the metadata to start the burst and set a timestamp if provided
+        //the filter delays the first sample, start early so that it is sent at the given time
         if ((flags & SOAPY_SDR_HAS_TIME) != 0)
         {
-            md.timestamp = _timeNsToTxTicks(timeNs);
+            md.timestamp = _timeNsToTxTicks(timeNs) - delayTicks;
             _txNextTicks = md.timestamp;
         }
         //otherwise set now flag and record the rough time for reporting
@@ -468,8 +1765,20 @@ int bladeRF_SoapySDR::writeStream(
     void *samples = (void *)buffs[0];
     if (_txFloats or _txChans.size() == 2) samples = _txConvBuff;
 
+    //run the processing chain, the end of burst flush follows the samples
+    size_t numOut = numElems;
+    if (not _txChains.empty())
+    {
+        const size_t stride = _txChans.size();
+        for (size_t c = 0; c < _txChans.size(); c++)
+        {
+            numOut = _txChains[c]->process((const std::complex<float> *)buffs[c], _txConvBuff + 2*c, stride, numElems);
+            if (flush != 0) numOut += _txChains[c]->process(nullptr, _txConvBuff + 2*(c + numOut*stride), stride, flush);
+        }
+    }
+
     //perform the float to int16 conversion
-    if (_txFloats and _txChans.size() == 1)
+    else if (_txFloats and _txChans.size() == 1)
     {
         float *input = (float *)buffs[0];
         for (size_t i = 0; i < 2 * numElems; i++)
@@ -503,7 +1812,7 @@ int bladeRF_SoapySDR::writeStream(
     }
 
     //send the tx samples
-    int ret = bladerf_sync_tx(_dev, samples, numElems*_txChans.size(), &md, timeoutUs/1000);
+    int ret = bladerf_sync_tx(_dev, samples, numOut*_txChans.size(), &md, timeoutUs/1000);
     if (ret == BLADERF_ERR_TIMEOUT) return SOAPY_SDR_TIMEOUT;
     if (ret == BLADERF_ERR_TIME_PAST) return SOAPY_SDR_TIME_ERROR;
     if (ret != 0)
@@ -511,7 +1820,7 @@ int bladeRF_SoapySDR::writeStream(
         SoapySDR::logf(SOAPY_SDR_ERROR, "bladerf_sync_tx() returned %s", _err2str(ret).c_str());
         return SOAPY_SDR_STREAM_ERROR;
     }
-    _txNextTicks += numElems;
+    _txNextTicks += numOut;
 
     //always in a burst after successful tx
     _inTxBurst = true;
@@ -542,14 +1851,30 @@ int bladeRF_SoapySDR::writeStream(
 
 int bladeRF_SoapySDR::readStreamStatus(
     SoapySDR::Stream *stream,
-    size_t &,
+    size_t &chanMask,
     int &flags,
     long long &timeNs,
     const long timeoutUs
 )
 {
     const int direction = *reinterpret_cast<int *>(stream);
-    if (direction == SOAPY_SDR_RX) return SOAPY_SDR_NOT_SUPPORTED;
+
+    //the rx events are the preamble detections
+    if (direction == SOAPY_SDR_RX)
+    {
+        if (_rxDetectors.empty()) return SOAPY_SDR_NOT_SUPPORTED;
+        std::unique_lock<std::mutex> lock(_rxDetectionMutex);
+        if (not _rxDetectionCond.wait_for(lock, std::chrono::microseconds(timeoutUs), [this]{return not _rxDetections.empty();}))
+        {
+            return SOAPY_SDR_TIMEOUT;
+        }
+        _rxLastDetection = _rxDetections.front();
+        _rxDetections.pop_front();
+        chanMask = size_t(1) << _rxLastDetection.channel;
+        flags = SOAPY_SDR_HAS_TIME;
+        timeNs = _rxLastDetection.timeNs;
+        return 0;
+    }
 
     //wait for an event to be ready considering the timeout and time
     //this is an emulation by polling and waiting on the hardware time
@@ -0,0 +1,255 @@
+/*
+ * This file is part of the bladeRF project:
+ *   http://www.github.com/nuand/bladeRF
+ *
+ * Copyright (C) 2015-2022 Josh Blum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs the aggregate rx alignment against simulated boards.
+ * Each board starts at its own tick, and the boards drop samples at
+ * different points with an overflow or a silent gap. Every sample holds
+ * its own tick, so the test checks that readStream() returns the same tick
+ * on every channel and that the reported time matches it.
+ * The tx part checks that a burst on several boards needs a time
+ * and that a board which accepts nothing does not stall writeStream().
+ */
+
+#include "bladeRF_Aggregate.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <complex>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+
+//! 3000000 + 1/3 Hz, a rate that a double does not hold exactly
+#define RATE_INTEGER 3000000ull
+#define RATE_NUM 1ull
+#define RATE_DEN 3ull
+
+static long long ticksToNs(const long long ticks)
+{
+    const unsigned long long rate = RATE_INTEGER*RATE_DEN + RATE_NUM;
+    return (long long)((ticks*1000000000ull*RATE_DEN + rate/2)/rate);
+}
+
+/*!
+ * A board that streams CF32 samples holding their tick in the real part
+ * and the board and channel number in the imaginary part.
+ */
+class FakeBoard : public SoapySDR::Device
+{
+public:
+    FakeBoard(const size_t id, const long long firstTick, const size_t overflowBlock, const size_t gapBlock, const long long lostTicks):
+        txStalled(false),
+        txElems(0),
+        txTimeNs(0),
+        _id(id),
+        _nextTick(firstTick),
+        _block(0),
+        _overflowBlock(overflowBlock),
+        _gapBlock(gapBlock),
+        _lostTicks(lostTicks)
+    {
+        return;
+    }
+
+    size_t getNumChannels(const int) const
+    {
+        return 2;
+    }
+
+    double getSampleRate(const int, const size_t) const
+    {
+        return RATE_INTEGER + double(RATE_NUM)/RATE_DEN;
+    }
+
+    std::string readSetting(const std::string &key) const
+    {
+        if (key == "rx_rational_rate") return std::to_string(RATE_INTEGER) + " " + std::to_string(RATE_NUM) + " " + std::to_string(RATE_DEN);
+        return "";
+    }
+
+    SoapySDR::Stream *setupStream(const int, const std::string &, const std::vector<size_t> &channels, const SoapySDR::Kwargs &)
+    {
+        _chans = channels;
+        return reinterpret_cast<SoapySDR::Stream *>(this);
+    }
+
+    void closeStream(SoapySDR::Stream *)
+    {
+        return;
+    }
+
+    size_t getStreamMTU(SoapySDR::Stream *) const
+    {
+        return 1000;
+    }
+
+    int activateStream(SoapySDR::Stream *, const int, const long long, const size_t)
+    {
+        return 0;
+    }
+
+    int deactivateStream(SoapySDR::Stream *, const int, const long long)
+    {
+        return 0;
+    }
+
+    int readStream(SoapySDR::Stream *, void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long)
+    {
+        //the samples lost in an overflow are reported, those of a gap only show in the time
+        _block++;
+        if (_block == _overflowBlock)
+        {
+            _nextTick += _lostTicks;
+            return SOAPY_SDR_OVERFLOW;
+        }
+        if (_block == _gapBlock) _nextTick += _lostTicks;
+
+        const size_t n = std::min<size_t>(numElems, 600 + 150*(_block % 3));
+        for (size_t c = 0; c < _chans.size(); c++)
+        {
+            std::complex<float> *out = reinterpret_cast<std::complex<float> *>(buffs[c]);
+            for (size_t i = 0; i < n; i++) out[i] = std::complex<float>(float(_nextTick + (long long)(i)), float(10*_id + _chans[c]));
+        }
+        flags = SOAPY_SDR_HAS_TIME;
+        timeNs = ticksToNs(_nextTick);
+        _nextTick += (long long)(n);
+        return int(n);
+    }
+
+    int writeStream(SoapySDR::Stream *, const void * const *, const size_t numElems, int &flags, const long long timeNs, const long)
+    {
+        if (txStalled) return 0;
+        if (txElems == 0 and (flags & SOAPY_SDR_HAS_TIME) != 0) txTimeNs = timeNs;
+        txElems += numElems;
+        return int(numElems);
+    }
+
+    bool txStalled; //accepts nothing, like a full buffer without a timeout error
+    size_t txElems;
+    long long txTimeNs;
+
+private:
+    const size_t _id;
+    std::vector<size_t> _chans;
+    long long _nextTick;
+    size_t _block;
+    const size_t _overflowBlock;
+    const size_t _gapBlock;
+    const long long _lostTicks;
+};
+
+static int fail(const std::string &what)
+{
+    std::cerr << "FAIL: " << what << std::endl;
+    return EXIT_FAILURE;
+}
+
+int main(void)
+{
+    //staggered starts, an overflow on board 0 and a gap on board 1
+    std::vector<std::unique_ptr<SoapySDR::Device>> boards;
+    boards.emplace_back(new FakeBoard(0, 1000, 20, 0, 5000));
+    boards.emplace_back(new FakeBoard(1, 1837, 0, 30, 2500));
+    boards.emplace_back(new FakeBoard(2, 1500, 0, 0, 0));
+    bladeRF_Aggregate aggregate(std::move(boards));
+    if (aggregate.getNumChannels(SOAPY_SDR_RX) != 6) return fail("expected 6 rx channels");
+
+    //the requested order is not the board order
+    const std::vector<size_t> channels = {5, 0, 2};
+    const std::vector<float> expectedIds = {21, 0, 10};
+    SoapySDR::Stream *stream = aggregate.setupStream(SOAPY_SDR_RX, SOAPY_SDR_CF32, channels);
+    aggregate.activateStream(stream);
+
+    std::vector<std::vector<std::complex<float>>> buffs(channels.size(), std::vector<std::complex<float>>(512));
+    std::vector<void *> ptrs;
+    for (auto &buff : buffs) ptrs.push_back(buff.data());
+
+    size_t overflows(0);
+    long long nextTick(0);
+    for (size_t read = 0; read < 400; read++)
+    {
+        int flags(0);
+        long long timeNs(0);
+        const int ret = aggregate.readStream(stream, ptrs.data(), 512, flags, timeNs, 1000000);
+        if (ret == SOAPY_SDR_OVERFLOW)
+        {
+            overflows++;
+            continue;
+        }
+        if (ret <= 0) return fail("readStream() returned " + std::to_string(ret));
+
+        const long long tick = (long long)(buffs[0][0].real());
+        if (read == 0 and tick != 1837) return fail("first aligned tick " + std::to_string(tick) + ", expected the latest start 1837");
+        if (tick < nextTick) return fail("tick " + std::to_string(tick) + " repeats samples before " + std::to_string(nextTick));
+        if ((flags & SOAPY_SDR_HAS_TIME) == 0 or timeNs != ticksToNs(tick)) return fail("time of tick " + std::to_string(tick) + " is " + std::to_string(timeNs));
+        for (size_t c = 0; c < channels.size(); c++)
+        {
+            for (int i = 0; i < ret; i++)
+            {
+                if (buffs[c][i] != std::complex<float>(float(tick + i), expectedIds[c]))
+                {
+                    return fail("channel " + std::to_string(channels[c]) + " sample " + std::to_string(i) + " is not aligned at tick " + std::to_string(tick));
+                }
+            }
+        }
+        nextTick = tick + ret;
+    }
+    aggregate.deactivateStream(stream);
+    aggregate.closeStream(stream);
+
+    if (overflows != 1) return fail("expected one overflow, got " + std::to_string(overflows));
+
+    //tx on two boards, the second one stalls after the first burst
+    std::vector<std::unique_ptr<SoapySDR::Device>> txBoards;
+    txBoards.emplace_back(new FakeBoard(0, 0, 0, 0, 0));
+    txBoards.emplace_back(new FakeBoard(1, 0, 0, 0, 0));
+    FakeBoard &txBoard0 = static_cast<FakeBoard &>(*txBoards[0]);
+    FakeBoard &txBoard1 = static_cast<FakeBoard &>(*txBoards[1]);
+    bladeRF_Aggregate txAggregate(std::move(txBoards));
+    SoapySDR::Stream *txStream = txAggregate.setupStream(SOAPY_SDR_TX, SOAPY_SDR_CF32, {0, 2});
+    std::vector<const void *> txPtrs = {buffs[0].data(), buffs[1].data()};
+
+    int txFlags(0);
+    int ret = txAggregate.writeStream(txStream, txPtrs.data(), 512, txFlags, 0, 100000);
+    if (ret != SOAPY_SDR_NOT_SUPPORTED or txBoard0.txElems != 0) return fail("untimed burst on two boards returned " + std::to_string(ret));
+
+    txFlags = SOAPY_SDR_HAS_TIME;
+    ret = txAggregate.writeStream(txStream, txPtrs.data(), 512, txFlags, 5000000, 100000);
+    if (ret != 512) return fail("timed burst start returned " + std::to_string(ret));
+    txFlags = SOAPY_SDR_END_BURST;
+    ret = txAggregate.writeStream(txStream, txPtrs.data(), 1500, txFlags, 0, 100000);
+    if (ret != 1500) return fail("burst continuation returned " + std::to_string(ret));
+    if (txBoard0.txElems != 2012 or txBoard1.txElems != 2012 or txBoard0.txTimeNs != 5000000 or txBoard1.txTimeNs != 5000000)
+    {
+        return fail("boards did not get the same timed burst");
+    }
+
+    txBoard1.txStalled = true;
+    txFlags = SOAPY_SDR_HAS_TIME;
+    ret = txAggregate.writeStream(txStream, txPtrs.data(), 512, txFlags, 6000000, 100000);
+    if (ret != SOAPY_SDR_STREAM_ERROR) return fail("stalled board after another board sent returned " + std::to_string(ret));
+    txBoard0.txStalled = true;
+    ret = txAggregate.writeStream(txStream, txPtrs.data(), 512, txFlags, 6000000, 100000);
+    if (ret != SOAPY_SDR_TIMEOUT) return fail("all boards stalled returned " + std::to_string(ret));
+    txAggregate.closeStream(txStream);
+
+    std::cout << "PASS: aligned up to tick " << nextTick << std::endl;
+    return EXIT_SUCCESS;
+}